@@ -1,176 +1,756 @@
 #include "apu.h"
+#include "simd.h"
+#include <algorithm>
 #include <math.h>
 #include <memory>
+#include <string.h>
 #include "memory.h"
-#include <sdl2/SDL_timer.h>
 
 namespace nesemu
 {
-	APU::APU()
+	static const uint8_t LengthTable[32] =
+	{
+		10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+		12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+	};
+
+	static const uint8_t DutySequences[4][8] =
+	{
+		{ 0, 1, 0, 0, 0, 0, 0, 0 },
+		{ 0, 1, 1, 0, 0, 0, 0, 0 },
+		{ 0, 1, 1, 1, 1, 0, 0, 0 },
+		{ 1, 0, 0, 1, 1, 1, 1, 1 }
+	};
+
+	// NTSC timer periods, in CPU cycles
+	static const uint16_t NoisePeriods[16] = { 4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068 };
+	static const uint16_t DMCPeriods[16] = { 428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54 };
+
+	// Frame counter steps, in CPU cycles since the last reset. The last step resets the counter.
+	static const int FrameStepCycles[2][5] =
+	{
+		{ 7457, 14913, 22371, 29829, 29830 },
+		{ 7457, 14913, 22371, 37281, 37282 }
+	};
+
+	// Mixer table indices, with APU_MIX_FRACTION_BITS fractional bits after band-limiting
+	static const int PulseIndexWeight = 1 << APU_MIX_FRACTION_BITS;
+	static const int TriangleIndexWeight = 3 << APU_MIX_FRACTION_BITS;
+	static const int NoiseIndexWeight = 2 << APU_MIX_FRACTION_BITS;
+	static const int DMCIndexWeight = 1 << APU_MIX_FRACTION_BITS;
+
+	// Advances a timer that clocks every arg_period CPU cycles.
+	// @return How many times it clocked.
+	static inline int RunTimer(int& arg_timer, int arg_period, int arg_cycles)
+	{
+		if (arg_cycles < arg_timer)
+		{
+			arg_timer -= arg_cycles;
+			return 0;
+		}
+		arg_cycles -= arg_timer;
+		arg_timer = arg_period - arg_cycles % arg_period;
+		return 1 + arg_cycles / arg_period;
+	}
+
+	void APUEnvelope::Clock()
 	{
-		std::fill_n(mSampleBuffer, SAMPLE_RATE, 0);
+		if (mStart)
+		{
+			mStart = false;
+			mDecay = 15;
+			mDivider = mVolume;
+		}
+		else if (mDivider == 0)
+		{
+			mDivider = mVolume;
+			if (mDecay > 0)
+				mDecay--;
+			else if (mLoop)
+				mDecay = 15;
+		}
+		else
+		{
+			mDivider--;
+		}
 	}
 
-	void APU::Tick(int arg_cpucycles)
+	uint16_t APUPulse::GetSweepTarget() const
 	{
-		UpdateBuffer();
+		const int change = mPeriod >> mSweepShift;
+		if (!mSweepNegate)
+			return (uint16_t)(mPeriod + change);
+		const int target = mPeriod - change - (mOnesComplement ? 1 : 0);
+		return (uint16_t)std::max(target, 0);
+	}
 
-		if (!mInitialised)
+	void APUPulse::ClockSweep()
+	{
+		if (mSweepDivider == 0 && mSweepEnabled && mSweepShift > 0 && !IsMuted())
+			mPeriod = GetSweepTarget();
+		if (mSweepDivider == 0 || mSweepReload)
 		{
-			Initialise();
+			mSweepDivider = mSweepPeriod;
+			mSweepReload = false;
+		}
+		else
+		{
+			mSweepDivider--;
+		}
+	}
+
+	void APUPulse::Run(uint32_t arg_time, int arg_cycles)
+	{
+		const int period = (mPeriod + 1) * 2;
+		const int volume = mEnvelope.GetVolume();
+		if (mLength == 0 || volume == 0 || IsMuted())
+		{
+			// Silent: only the sequencer position matters
+			mStep = (uint8_t)((mStep + RunTimer(mTimer, period, arg_cycles)) & 0x07);
+			return;
+		}
+
+		const uint8_t* sequence = DutySequences[mDuty];
+		while (arg_cycles >= mTimer)
+		{
+			arg_time += mTimer;
+			arg_cycles -= mTimer;
+			mTimer = period;
+			mStep = (mStep + 1) & 0x07;
+			mOutput.Update(arg_time, sequence[mStep] ? volume : 0);
 		}
+		mTimer -= arg_cycles;
 	}
 
-	void APU::UpdateBuffer()
+	uint8_t APUPulse::GetOutput() const
 	{
-		Uint32 currTime = SDL_GetTicks();
+		if (mLength == 0 || IsMuted() || !DutySequences[mDuty][mStep])
+			return 0;
+		return mEnvelope.GetVolume();
+	}
 
-		Uint32 timeDiff = currTime - mTimeLastSample;
+	void APUTriangle::ClockLinearCounter()
+	{
+		if (mLinearReload)
+			mLinearCounter = mLinearReloadValue;
+		else if (mLinearCounter > 0)
+			mLinearCounter--;
+		if (!mControl)
+			mLinearReload = false;
+	}
 
-		if (timeDiff > 0)
+	void APUTriangle::Run(uint32_t arg_time, int arg_cycles)
+	{
+		// Periods below 2 are ultrasonic: the sequencer is held instead, like most emulators do
+		const int period = mPeriod + 1;
+		if (mLength == 0 || mLinearCounter == 0 || mPeriod < 2)
 		{
-			const int samplesPerMS = (SAMPLE_RATE / 1000) + 1; // TEMP
-			const int samplesThisFrame = samplesPerMS * timeDiff;
-			mTimeLastSample = currTime;
-			for (int i = 0; i < samplesThisFrame; i++)
-			{
-				// *** Combine all the channels
-				// https://wiki.nesdev.com/w/index.php/APU_Mixer
+			RunTimer(mTimer, period, arg_cycles);
+			return;
+		}
 
-				mSampleWriteBuffer[mSampleWriteBufferPos] = 0;
+		while (arg_cycles >= mTimer)
+		{
+			arg_time += mTimer;
+			arg_cycles -= mTimer;
+			mTimer = period;
+			mStep = (mStep + 1) & 0x1F;
+			mOutput.Update(arg_time, GetOutput());
+		}
+		mTimer -= arg_cycles;
+	}
+
+	uint8_t APUTriangle::GetOutput() const
+	{
+		// 15 down to 0, then 0 up to 15
+		return mStep < 16 ? 15 - mStep : mStep - 16;
+	}
 
-				const double square1 = GetSquareChannelSampleValue(SquareChannel::One);
-				const double square2 = GetSquareChannelSampleValue(SquareChannel::Two);
-				const double triangle = GetTriangleChannelSampleValue();
+	void APUNoise::Run(uint32_t arg_time, int arg_cycles)
+	{
+		const int tap = mMode ? 6 : 1;
+		const int volume = mLength > 0 ? mEnvelope.GetVolume() : 0;
+		while (arg_cycles >= mTimer)
+		{
+			arg_time += mTimer;
+			arg_cycles -= mTimer;
+			mTimer = mPeriod;
+			const uint16_t feedback = (mShiftRegister ^ (mShiftRegister >> tap)) & 0x01;
+			mShiftRegister = (mShiftRegister >> 1) | (feedback << 14);
+			if (volume > 0)
+				mOutput.Update(arg_time, (mShiftRegister & 0x01) ? 0 : volume);
+		}
+		mTimer -= arg_cycles;
+	}
 
-				const double square_out = 0.00752 * (square1 + square2);
-				const double tnd_out = 0.00851 * triangle;
+	uint8_t APUNoise::GetOutput() const
+	{
+		if (mLength == 0 || (mShiftRegister & 0x01))
+			return 0;
+		return mEnvelope.GetVolume();
+	}
 
-				mSampleWriteBuffer[mSampleWriteBufferPos] += (Sint16)(AMPLITUDE * square_out);
-				mSampleWriteBuffer[mSampleWriteBufferPos] += (Sint16)(AMPLITUDE * tnd_out);
+	void APUDMC::Restart()
+	{
+		mCurrentAddress = mSampleAddress;
+		mBytesRemaining = mSampleLength;
+	}
 
-				mSampleWriteBufferPos++;
+	bool APUDMC::FillBuffer()
+	{
+		// The CPU stall of the sample fetch isn't emulated
+		if (mBufferFull || mBytesRemaining == 0)
+			return false;
+
+		mBuffer = GMemory->ReadByte(mCurrentAddress);
+		mBufferFull = true;
+		mCurrentAddress = mCurrentAddress == 0xFFFF ? 0x8000 : mCurrentAddress + 1;
+		if (--mBytesRemaining > 0)
+			return false;
+		if (mLoop)
+		{
+			Restart();
+			return false;
+		}
+		return mIRQEnabled;
+	}
 
-				// Copy to sample buffer
-				if (mSampleWriteBufferPos >= SAMPLE_WRITE_BUFFER)
+	bool APUDMC::Run(uint32_t arg_time, int arg_cycles)
+	{
+		bool irq = false;
+		while (arg_cycles >= mTimer)
+		{
+			arg_time += mTimer;
+			arg_cycles -= mTimer;
+			mTimer = mPeriod;
+			if (!mSilence)
+			{
+				if (mShiftRegister & 0x01)
 				{
-					const size_t totalLen = SAMPLE_WRITE_BUFFER;
-					const size_t lenToEnd = SAMPLE_RATE - mWritePos;
-					const size_t len = lenToEnd > totalLen ? totalLen : lenToEnd;
-					const size_t lenBytes = len * 2;
-					memcpy(mSampleBuffer + mWritePos, mSampleWriteBuffer, lenBytes);
-					mWritePos += totalLen;
-					if (mWritePos >= SAMPLE_RATE)
-					{
-						mWritePos -= SAMPLE_RATE;
-						if (mWritePos > 0)
-						{
-							memcpy(mSampleBuffer, mSampleWriteBuffer + len, (totalLen - len) * 2);
-						}
-					}
-
-					mSampleWriteBufferPos = 0;
+					if (mOutputLevel <= 125)
+						mOutputLevel += 2;
 				}
+				else if (mOutputLevel >= 2)
+				{
+					mOutputLevel -= 2;
+				}
+				mOutput.Update(arg_time, mOutputLevel);
+			}
+			mShiftRegister >>= 1;
 
-				mSampleCounter += 1;
-				mTime = (double)mSampleCounter / (double)SAMPLE_RATE;
+			if (--mBitsRemaining == 0)
+			{
+				mBitsRemaining = 8;
+				mSilence = !mBufferFull;
+				if (mBufferFull)
+				{
+					mShiftRegister = mBuffer;
+					mBufferFull = false;
+					irq |= FillBuffer();
+				}
 			}
 		}
+		mTimer -= arg_cycles;
+		return irq;
 	}
 
-	void APU::Initialise()
+	APU::APU()
 	{
-		mInitialised = true;
+		mPulse[0].mOnesComplement = true;
+		mHighPassCoefficient = (int)lrint(exp(-2.0 * 3.14159265358979323846 * 90.0 / APU_MIX_RATE) * 32768.0);
+		ConfigureOutput();
+
+		mPulseBlip.SetRates(APU_CPU_CLOCK, APU_MIX_RATE, APU_AUDIO_FRAME);
+		mTNDBlip.SetRates(APU_CPU_CLOCK, APU_MIX_RATE, APU_AUDIO_FRAME);
+		APUOutput* outputs[] = { &mPulse[0].mOutput, &mPulse[1].mOutput, &mTriangle.mOutput, &mNoise.mOutput, &mDMC.mOutput };
+		BlipBuffer* buffers[] = { &mPulseBlip, &mPulseBlip, &mTNDBlip, &mTNDBlip, &mTNDBlip };
+		const int weights[] = { PulseIndexWeight, PulseIndexWeight, TriangleIndexWeight, NoiseIndexWeight, DMCIndexWeight };
+		for (int i = 0; i < 5; i++)
+		{
+			outputs[i]->mBuffer = buffers[i];
+			outputs[i]->mWeight = weights[i];
+		}
 
-		mTimeLastSample = SDL_GetTicks();
+		mPulseTable[0] = 0;
+		for (int i = 1; i < 31; i++)
+			mPulseTable[i] = (int32_t)lrint(95.52 / (8128.0 / i + 100.0) * AMPLITUDE);
+		mPulseTable[31] = mPulseTable[30];
+		mTNDTable[0] = 0;
+		for (int i = 1; i < 203; i++)
+			mTNDTable[i] = (int32_t)lrint(163.67 / (24329.0 / i + 100.0) * AMPLITUDE);
+		mTNDTable[203] = mTNDTable[202];
+	}
 
-		int sample_nr = 0;
+	void APU::CatchUp(uint64_t arg_cpuCycle)
+	{
+		if (!mInitialised)
+		{
+			Initialise();
+		}
 
-		SDL_AudioSpec audioSpec;
-		audioSpec.freq = SAMPLE_RATE; // samples per second
-		audioSpec.format = AUDIO_S16SYS; // signed short (16 bit)
-		audioSpec.channels = 1;
-		audioSpec.samples = 512; // buffer-size
-		audioSpec.callback = audio_callback;
-		audioSpec.userdata = this;
+		// Runs the channels from one frame counter step or audio frame end to the next
+		while (mCPUCycle < arg_cpuCycle)
+		{
+			const uint64_t audioFrameEnd = mAudioFrameStart + APU_AUDIO_FRAME;
+			const uint64_t frameStepCycle = mCPUCycle + (GetFrameStepCycle() - mFrameCycle);
+			const uint64_t nextCycle = std::min(arg_cpuCycle, std::min(audioFrameEnd, frameStepCycle));
+			const int cycles = (int)(nextCycle - mCPUCycle);
+			RunChannels(cycles);
+			mFrameCycle += cycles;
+			mCPUCycle = nextCycle;
+
+			if (mFrameCycle == GetFrameStepCycle())
+			{
+				ClockFrameCounter();
+				UpdateOutputs();
+			}
+			if (mCPUCycle == audioFrameEnd)
+				EndAudioFrame();
+		}
+	}
 
-		SDL_AudioSpec desiredSpec;
-		if (SDL_OpenAudio(&audioSpec, &desiredSpec) != 0)
-			SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to open audio: %s", SDL_GetError());
-		if (audioSpec.format != desiredSpec.format)
-			SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to get the desired AudioSpec");
+	uint64_t APU::GetNextEventCycle() const
+	{
+		uint64_t next = UINT64_MAX;
+		if (!mFiveStepMode && !mIRQInhibit && !(mStatus & APUSTATUS_FRAME_IRQ))
+		{
+			// The IRQ is raised with the 4th step. After it, only the reset step is left in this frame.
+			const int irqCycle = FrameStepCycles[0][3];
+			if (mFrameStep <= 3)
+				next = mCPUCycle + (irqCycle - mFrameCycle);
+			else
+				next = mCPUCycle + (FrameStepCycles[0][4] - mFrameCycle) + irqCycle;
+		}
 
-		SDL_PauseAudio(0);
+		// The DMC IRQ comes with the fetch of the sample's last byte. A full buffer is fetched into at the end of
+		// each output cycle (8 timer clocks), one byte per cycle.
+		if (mDMC.mIRQEnabled && !mDMC.mLoop && mDMC.mBytesRemaining > 0 && !(mStatus & APUSTATUS_DMC_IRQ))
+		{
+			const uint64_t outputCycles = mDMC.mBufferFull ? mDMC.mBytesRemaining : 1;
+			const uint64_t clocks = mDMC.mBitsRemaining - 1 + (outputCycles - 1) * 8;
+			next = std::min(next, mCPUCycle + mDMC.mTimer + clocks * mDMC.mPeriod);
+		}
+		return next;
 	}
 
-	double APU::GetSquareChannelSampleValue(const SquareChannel arg_channel)
+	int APU::GetFrameStepCycle() const
 	{
-		// read frequency from memory
-		const uint8_t b1 = GMemory->ReadByte(arg_channel == SquareChannel::One ? 0x4000 : 0x4004);
-		const uint8_t b2 = GMemory->ReadByte(arg_channel == SquareChannel::One ? 0x4001 : 0x4005);
-		const uint8_t b3 = GMemory->ReadByte(arg_channel == SquareChannel::One ? 0x4002 : 0x4006);
-		const uint8_t b4 = GMemory->ReadByte(arg_channel == SquareChannel::One ? 0x4003 : 0x4007);
-
-		uint16_t freqVal = b3 | (((uint16_t)b4 << 8) & 0b0000011100000000);
+		return FrameStepCycles[mFiveStepMode ? 1 : 0][mFrameStep];
+	}
 
-		if (freqVal > 0)
+	void APU::ClockFrameCounter()
+	{
+		switch (mFrameStep)
 		{
-			const uint8_t duty = b1 >> 6; // first two bits of $4000 / $4004
-			const double fPulse = (double)freqVal;
-			const double freq = ((1789773.0f) / (16.0f * (fPulse + 1.0f))) - 1.0f;
+		case 0:
+		case 2:
+			ClockQuarterFrame();
+			break;
+		case 1:
+			ClockQuarterFrame();
+			ClockHalfFrame();
+			break;
+		case 3:
+			ClockQuarterFrame();
+			ClockHalfFrame();
+			if (!mFiveStepMode && !mIRQInhibit)
+				mStatus |= APUSTATUS_FRAME_IRQ;
+			break;
+		case 4:
+			mFrameCycle = 0;
+			mFrameStep = 0;
+			return;
+		}
+		mFrameStep++;
+	}
 
-			const double f = sin(2.0f * M_PI * (freq)* mTime);
-			const double fRel = (f + 1.0f) / 2.0f;
-			const int iSample = (fRel * 8);
+	void APU::ClockQuarterFrame()
+	{
+		mPulse[0].mEnvelope.Clock();
+		mPulse[1].mEnvelope.Clock();
+		mNoise.mEnvelope.Clock();
+		mTriangle.ClockLinearCounter();
+	}
 
-			return SquareDutyChannel[duty][iSample];
+	void APU::ClockHalfFrame()
+	{
+		for (APUPulse& pulse : mPulse)
+		{
+			if (!pulse.mEnvelope.mLoop && pulse.mLength > 0)
+				pulse.mLength--;
+			pulse.ClockSweep();
 		}
-		return 0.0f;
+		if (!mTriangle.mControl && mTriangle.mLength > 0)
+			mTriangle.mLength--;
+		if (!mNoise.mEnvelope.mLoop && mNoise.mLength > 0)
+			mNoise.mLength--;
 	}
 
-	double APU::GetTriangleChannelSampleValue()
+	void APU::RunChannels(int arg_cycles)
 	{
-		// read sound data from memory
-		const uint8_t b1 = GMemory->ReadByte(0x4008);
-		const uint8_t b2 = GMemory->ReadByte(0x400A);
-		const uint8_t b3 = GMemory->ReadByte(0x400B);
+		const uint32_t time = (uint32_t)(mCPUCycle - mAudioFrameStart);
+		mPulse[0].Run(time, arg_cycles);
+		mPulse[1].Run(time, arg_cycles);
+		mTriangle.Run(time, arg_cycles);
+		mNoise.Run(time, arg_cycles);
+		if (mDMC.Run(time, arg_cycles))
+			mStatus |= APUSTATUS_DMC_IRQ;
+	}
 
-		uint16_t freqVal = b2 | (((uint16_t)b3 << 8) & 0b0000011100000000);
+	void APU::UpdateOutputs()
+	{
+		// Levels change outside of the timers with register writes and frame counter clocks
+		const uint32_t time = (uint32_t)(mCPUCycle - mAudioFrameStart);
+		mPulse[0].mOutput.Update(time, mPulse[0].GetOutput());
+		mPulse[1].mOutput.Update(time, mPulse[1].GetOutput());
+		mTriangle.mOutput.Update(time, mTriangle.GetOutput());
+		mNoise.mOutput.Update(time, mNoise.GetOutput());
+		mDMC.mOutput.Update(time, mDMC.mOutputLevel);
+	}
 
-		if (freqVal > 0)
+	void APU::EndAudioFrame()
+	{
+		const uint32_t time = (uint32_t)(mCPUCycle - mAudioFrameStart);
+		mPulseBlip.EndFrame(time);
+		mTNDBlip.EndFrame(time);
+		mAudioFrameStart = mCPUCycle;
+		if (mAudioPlaying && mRateControl)
+			ControlRate();
+
+		// Both buffers always have the same number of samples
+		int count;
+		while ((count = mPulseBlip.ReadSamples(mPulseIndices, APU_MIX_BUFFER)) > 0)
 		{
-			const double fPulse = (double)freqVal;
-			const double freq = ((1789773.0f) / (16.0f * (fPulse + 1.0f))) - 1.0f;
+			mTNDBlip.ReadSamples(mTNDIndices, count);
+			Mix(count);
+			for (int i = 0; i < count; i++)
+			{
+				// The mixer output is never negative: remove the DC offset
+				const int mixed = mMixBuffer[i];
+				mHighPassOutput = mixed - mHighPassInput + ((mHighPassOutput * mHighPassCoefficient) >> 15);
+				mHighPassInput = mixed;
+				mMixSamples[i] = (Sint16)std::min(std::max(mHighPassOutput, -32768), 32767);
+
+				const uint16_t sample = (uint16_t)mMixSamples[i];
+				mAudioHash = (mAudioHash ^ (sample & 0xFF)) * 1099511628211ull;
+				mAudioHash = (mAudioHash ^ (sample >> 8)) * 1099511628211ull;
+			}
+			mAudioSampleCount += count;
+			const size_t outputCount = mResampler.Process(mMixSamples, count, mOutputSamples.data(), mOutputSamples.size());
+			mRing.Write(mOutputSamples.data(), outputCount);
+		}
+	}
 
-			const double f = sin(2.0f * M_PI * (freq)* mTime);
-			const double fRel = (f + 1.0f) / 2.0f;
-			const int iSample = (fRel * 32);
+	void APU::Mix(int arg_count)
+	{
+		// Looks up both groups, interpolating between the table entries around the band-limited indices.
+		// Ringing can overshoot the index range a little.
+		const int32_t maxPulse = 30 << APU_MIX_FRACTION_BITS;
+		const int32_t maxTND = 202 << APU_MIX_FRACTION_BITS;
+		const int32_t fractionMask = (1 << APU_MIX_FRACTION_BITS) - 1;
+
+		int i = 0;
+#ifdef NESEMU_AVX2
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i mask = _mm256_set1_epi32(fractionMask);
+		for (; i + 8 <= arg_count; i += 8)
+		{
+			const __m256i pulse = _mm256_min_epi32(_mm256_max_epi32(_mm256_loadu_si256((const __m256i*)(mPulseIndices + i)), zero),
+				_mm256_set1_epi32(maxPulse));
+			const __m256i tnd = _mm256_min_epi32(_mm256_max_epi32(_mm256_loadu_si256((const __m256i*)(mTNDIndices + i)), zero),
+				_mm256_set1_epi32(maxTND));
+
+			const __m256i pulseIndex = _mm256_srli_epi32(pulse, APU_MIX_FRACTION_BITS);
+			const __m256i pulse0 = _mm256_i32gather_epi32((const int*)mPulseTable, pulseIndex, 4);
+			const __m256i pulse1 = _mm256_i32gather_epi32((const int*)mPulseTable + 1, pulseIndex, 4);
+			const __m256i tndIndex = _mm256_srli_epi32(tnd, APU_MIX_FRACTION_BITS);
+			const __m256i tnd0 = _mm256_i32gather_epi32((const int*)mTNDTable, tndIndex, 4);
+			const __m256i tnd1 = _mm256_i32gather_epi32((const int*)mTNDTable + 1, tndIndex, 4);
+
+			const __m256i pulseOut = _mm256_add_epi32(pulse0,
+				_mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(pulse1, pulse0), _mm256_and_si256(pulse, mask)), APU_MIX_FRACTION_BITS));
+			const __m256i tndOut = _mm256_add_epi32(tnd0,
+				_mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(tnd1, tnd0), _mm256_and_si256(tnd, mask)), APU_MIX_FRACTION_BITS));
+			_mm256_storeu_si256((__m256i*)(mMixBuffer + i), _mm256_add_epi32(pulseOut, tndOut));
+		}
+#endif
+		for (; i < arg_count; i++)
+		{
+			const int32_t pulse = std::min(std::max(mPulseIndices[i], 0), maxPulse);
+			const int32_t tnd = std::min(std::max(mTNDIndices[i], 0), maxTND);
+			const int32_t* pulseEntry = &mPulseTable[pulse >> APU_MIX_FRACTION_BITS];
+			const int32_t* tndEntry = &mTNDTable[tnd >> APU_MIX_FRACTION_BITS];
+			mMixBuffer[i] = pulseEntry[0] + (((pulseEntry[1] - pulseEntry[0]) * (pulse & fractionMask)) >> APU_MIX_FRACTION_BITS)
+				+ tndEntry[0] + (((tndEntry[1] - tndEntry[0]) * (tnd & fractionMask)) >> APU_MIX_FRACTION_BITS);
+		}
+	}
 
-			return TriangleDutyCycleSequence[iSample];
+	void APU::ControlRate()
+	{
+		// PI control of how far the ring is from its start level, counting half of this frame's samples
+		// which are about to arrive. The integral removes the steady offset of a constant clock mismatch.
+		// The fill level is averaged over frames: it jumps by whole callback periods, which would wobble the pitch.
+		// Applies from the next frame on.
+		const double target = (double)mRing.GetStartLevel();
+		const double fill = mRing.GetFillLevel() + mPulseBlip.GetSamplesAvailable() / 2 * (double)mOutputRate / APU_MIX_RATE;
+		mRateFill = mRateFill < 0.0 ? fill : mRateFill + (fill - mRateFill) / 16.0;
+		const double error = std::min(std::max((target - mRateFill) / target, -1.0), 1.0);
+		if (mAudioPaced)
+		{
+			// The pacing holds the fill level at the start level, where the ratio has no effect on it:
+			// integrating that error would only wind up into a constant speed and pitch offset.
+			// Only make up for the emulation falling behind.
+			mRateIntegral = 0.0;
+			mResampler.SetRatioAdjust(1.0 + APU_RATE_ADJUST * std::max(error, 0.0) * 0.5);
+			return;
 		}
+		mRateIntegral = std::min(std::max(mRateIntegral + error * 0.02, -1.0), 1.0);
+		const double adjust = std::min(std::max(error * 0.5 + mRateIntegral, -1.0), 1.0);
+		mResampler.SetRatioAdjust(1.0 + APU_RATE_ADJUST * adjust);
 	}
 
-	void APU::audio_callback(void *user_data, Uint8 *raw_buffer, int bytes)
+	int APU::GetPacingDelay() const
 	{
-		APU* apu = (APU*)user_data;
-		Sint16 *buffer = (Sint16*)raw_buffer;
-		int length = bytes / 2; // 2 bytes per sample for AUDIO_S16SYS
-		
-		const size_t totalLen = bytes / 2;
-		const size_t lenToEnd = SAMPLE_RATE - apu->mReadPos;
-		const size_t len = lenToEnd > totalLen ? totalLen : lenToEnd;
-		const size_t lenBytes = len * 2;
-
-		memcpy(buffer, apu->mSampleBuffer + apu->mReadPos,  lenBytes);
-		apu->mReadPos += totalLen;
-		if (apu->mReadPos >= SAMPLE_RATE)
-		{
-			apu->mReadPos -= SAMPLE_RATE;
-			if (apu->mReadPos > 0)
+		if (!mAudioPlaying)
+			return 0;
+		const size_t fill = mRing.GetFillLevel();
+		const size_t start = mRing.GetStartLevel();
+		return fill > start ? (int)((fill - start) * 1000000 / mOutputRate) : 0;
+	}
+
+	void APU::SetRateControl(bool arg_enabled)
+	{
+		mRateControl = arg_enabled;
+		mRateIntegral = 0.0;
+		mRateFill = -1.0;
+		if (!mRateControl)
+			mResampler.SetRatioAdjust(1.0);
+	}
+
+	void APU::ConfigureOutput()
+	{
+		mResampler.SetRates(APU_MIX_RATE, mOutputRate);
+		mOutputSamples.resize(mResampler.GetMaxOutput(APU_MIX_BUFFER));
+
+		// Room for the start level, an audio frame arriving at once, and as much again of slack for pacing
+		const size_t startLevel = (size_t)mLatencyPeriods * mAudioPeriod;
+		const size_t frameSamples = (size_t)((uint64_t)APU_AUDIO_FRAME * mOutputRate / APU_CPU_CLOCK) + 1;
+		if (mAudioPlaying)
+			SDL_LockAudio();
+		mRing.Resize(startLevel * 2 + frameSamples, startLevel);
+		if (mAudioPlaying)
+			SDL_UnlockAudio();
+	}
+
+	size_t APU::ReadSamples(int16_t* out_samples, size_t arg_maxCount)
+	{
+		return mRing.ReadAvailable(out_samples, arg_maxCount);
+	}
+
+	void APU::SetOutputRate(int arg_rate)
+	{
+		mOutputRate = arg_rate;
+		ConfigureOutput();
+	}
+
+	void APU::SetResampleQuality(ResampleQuality arg_quality)
+	{
+		mResampler.SetQuality(arg_quality);
+		ConfigureOutput();
+	}
+
+	void APU::SetLatency(int arg_periods)
+	{
+		mLatencyPeriods = std::max(arg_periods, 1);
+		ConfigureOutput();
+	}
+
+	uint8_t APU::ReadRegister(uint16_t arg_address)
+	{
+		if (arg_address != 0x4015)
+			return 0;
+
+		uint8_t status = mStatus;
+		for (int i = 0; i < 2; i++)
+		{
+			if (mPulse[i].mLength > 0)
+				status |= 1 << i;
+		}
+		if (mTriangle.mLength > 0)
+			status |= 0x04;
+		if (mNoise.mLength > 0)
+			status |= 0x08;
+		if (mDMC.mBytesRemaining > 0)
+			status |= 0x10;
+
+		// Reading acknowledges the frame interrupt
+		mStatus &= ~APUSTATUS_FRAME_IRQ;
+		return status;
+	}
+
+	void APU::WriteRegister(uint16_t arg_address, uint8_t arg_value)
+	{
+		switch (arg_address)
+		{
+		case 0x4000:
+		case 0x4004:
+		{
+			APUPulse& pulse = mPulse[(arg_address >> 2) & 0x01];
+			pulse.mDuty = arg_value >> 6;
+			pulse.mEnvelope.mLoop = (arg_value & 0x20) != 0;
+			pulse.mEnvelope.mConstant = (arg_value & 0x10) != 0;
+			pulse.mEnvelope.mVolume = arg_value & 0x0F;
+			break;
+		}
+		case 0x4001:
+		case 0x4005:
+		{
+			APUPulse& pulse = mPulse[(arg_address >> 2) & 0x01];
+			pulse.mSweepEnabled = (arg_value & 0x80) != 0;
+			pulse.mSweepPeriod = (arg_value >> 4) & 0x07;
+			pulse.mSweepNegate = (arg_value & 0x08) != 0;
+			pulse.mSweepShift = arg_value & 0x07;
+			pulse.mSweepReload = true;
+			break;
+		}
+		case 0x4002:
+		case 0x4006:
+		{
+			APUPulse& pulse = mPulse[(arg_address >> 2) & 0x01];
+			pulse.mPeriod = (pulse.mPeriod & 0x0700) | arg_value;
+			break;
+		}
+		case 0x4003:
+		case 0x4007:
+		{
+			const int channel = (arg_address >> 2) & 0x01;
+			APUPulse& pulse = mPulse[channel];
+			pulse.mPeriod = (pulse.mPeriod & 0x00FF) | ((arg_value & 0x07) << 8);
+			if (mEnabled & (1 << channel))
+				pulse.mLength = LengthTable[arg_value >> 3];
+			pulse.mStep = 0;
+			pulse.mEnvelope.mStart = true;
+			break;
+		}
+		case 0x4008:
+			mTriangle.mControl = (arg_value & 0x80) != 0;
+			mTriangle.mLinearReloadValue = arg_value & 0x7F;
+			break;
+		case 0x400A:
+			mTriangle.mPeriod = (mTriangle.mPeriod & 0x0700) | arg_value;
+			break;
+		case 0x400B:
+			mTriangle.mPeriod = (mTriangle.mPeriod & 0x00FF) | ((arg_value & 0x07) << 8);
+			if (mEnabled & 0x04)
+				mTriangle.mLength = LengthTable[arg_value >> 3];
+			mTriangle.mLinearReload = true;
+			break;
+		case 0x400C:
+			mNoise.mEnvelope.mLoop = (arg_value & 0x20) != 0;
+			mNoise.mEnvelope.mConstant = (arg_value & 0x10) != 0;
+			mNoise.mEnvelope.mVolume = arg_value & 0x0F;
+			break;
+		case 0x400E:
+			mNoise.mMode = (arg_value & 0x80) != 0;
+			mNoise.mPeriod = NoisePeriods[arg_value & 0x0F];
+			break;
+		case 0x400F:
+			if (mEnabled & 0x08)
+				mNoise.mLength = LengthTable[arg_value >> 3];
+			mNoise.mEnvelope.mStart = true;
+			break;
+		case 0x4010:
+			mDMC.mIRQEnabled = (arg_value & 0x80) != 0;
+			if (!mDMC.mIRQEnabled)
+				mStatus &= ~APUSTATUS_DMC_IRQ;
+			mDMC.mLoop = (arg_value & 0x40) != 0;
+			mDMC.mPeriod = DMCPeriods[arg_value & 0x0F];
+			break;
+		case 0x4011:
+			mDMC.mOutputLevel = arg_value & 0x7F;
+			break;
+		case 0x4012:
+			mDMC.mSampleAddress = 0xC000 | (arg_value << 6);
+			break;
+		case 0x4013:
+			mDMC.mSampleLength = (arg_value << 4) | 0x01;
+			break;
+		case 0x4015:
+			mEnabled = arg_value & 0x1F;
+			if (!(mEnabled & 0x01))
+				mPulse[0].mLength = 0;
+			if (!(mEnabled & 0x02))
+				mPulse[1].mLength = 0;
+			if (!(mEnabled & 0x04))
+				mTriangle.mLength = 0;
+			if (!(mEnabled & 0x08))
+				mNoise.mLength = 0;
+			mStatus &= ~APUSTATUS_DMC_IRQ;
+			if (!(mEnabled & 0x10))
+			{
+				mDMC.mBytesRemaining = 0;
+			}
+			else if (mDMC.mBytesRemaining == 0)
+			{
+				mDMC.Restart();
+				if (mDMC.FillBuffer())
+					mStatus |= APUSTATUS_DMC_IRQ;
+			}
+			break;
+		case 0x4017:
+			// The reset happens immediately rather than 3-4 cycles later
+			mFiveStepMode = (arg_value & 0x80) != 0;
+			mIRQInhibit = (arg_value & 0x40) != 0;
+			if (mIRQInhibit)
+				mStatus &= ~APUSTATUS_FRAME_IRQ;
+			mFrameCycle = 0;
+			mFrameStep = 0;
+			if (mFiveStepMode)
 			{
-				memcpy(buffer + len, apu->mSampleBuffer, apu->mReadPos * 2);
+				ClockQuarterFrame();
+				ClockHalfFrame();
 			}
+			break;
 		}
+		UpdateOutputs();
+	}
+
+	void APU::Initialise()
+	{
+		mInitialised = true;
+		if (!mAudioDevice)
+			return;
+
+		SDL_AudioSpec audioSpec;
+		audioSpec.freq = mOutputRate; // samples per second
+		audioSpec.format = AUDIO_S16SYS; // signed short (16 bit)
+		audioSpec.channels = 1;
+		audioSpec.samples = 512; // buffer-size
+		audioSpec.callback = audio_callback;
+		audioSpec.userdata = this;
+
+		SDL_AudioSpec desiredSpec;
+		if (SDL_OpenAudio(&audioSpec, &desiredSpec) != 0)
+		{
+			SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to open audio: %s", SDL_GetError());
+			return;
+		}
+		if (audioSpec.format != desiredSpec.format)
+			SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to get the desired AudioSpec");
+
+		// The callback isn't running yet
+		mOutputRate = desiredSpec.freq;
+		mAudioPeriod = desiredSpec.samples;
+		ConfigureOutput();
+
+		SDL_PauseAudio(0);
+		mAudioPlaying = true;
+	}
+
+	void APU::audio_callback(void *user_data, Uint8 *raw_buffer, int bytes)
+	{
+		APU* apu = (APU*)user_data;
+		apu->mRing.Read((int16_t*)raw_buffer, bytes / 2); // 2 bytes per sample for AUDIO_S16SYS
 	}
 
 }
@@ -1,58 +1,308 @@
 #ifndef NESEMU_APU_H
 #define NESEMU_APU_H
 
-#include <SDL2/SDL.h>
-#include <SDL2/SDL_audio.h>
+#include "sdl2/SDL.h"
+#include "sdl2/SDL_audio.h"
+#include <stdint.h>
+#include <vector>
+#include "audioring.h"
+#include "blip.h"
+#include "resampler.h"
 
 const int AMPLITUDE = 28000;
-const int SAMPLE_RATE = 44100;
 
-const int SAMPLE_WRITE_BUFFER = 768; // 512 + 256
+#define APU_CPU_CLOCK			1789773
+#define APU_MIX_RATE			48000	// rate of the band-limited mix, resampled to the output rate
+#define APU_MIX_BUFFER			1024	// mixed samples processed at once
+#define APU_MIX_FRACTION_BITS	8		// fractional bits of the band-limited mixer table indices
+#define APU_AUDIO_FRAME			29780	// CPU cycles of output mixed at once, about one video frame
+#define APU_RATE_ADJUST			0.005	// largest output rate change of the dynamic rate control
+
+#define APUSTATUS_FRAME_IRQ		0x40
+#define APUSTATUS_DMC_IRQ		0x80
 
 namespace nesemu
 {
-	enum SquareChannel
+	// A channel's output level. Changes are added to the delta buffer, weighted for the mixer.
+	struct APUOutput
+	{
+		BlipBuffer* mBuffer = nullptr;
+		int mWeight = 0;
+		int mLevel = 0;
+
+		inline void Update(uint32_t arg_time, int arg_level)
+		{
+			if (arg_level != mLevel)
+			{
+				mBuffer->AddDelta(arg_time, (arg_level - mLevel) * mWeight);
+				mLevel = arg_level;
+			}
+		}
+	};
+
+	// https://wiki.nesdev.com/w/index.php/APU_Envelope
+	struct APUEnvelope
+	{
+		bool mStart = false;
+		bool mLoop = false; // also the length counter halt flag
+		bool mConstant = false;
+		uint8_t mVolume = 0; // constant volume, or the divider period
+		uint8_t mDivider = 0;
+		uint8_t mDecay = 0;
+
+		void Clock();
+		inline uint8_t GetVolume() const { return mConstant ? mVolume : mDecay; }
+	};
+
+	// https://wiki.nesdev.com/w/index.php/APU_Pulse
+	struct APUPulse
+	{
+		APUEnvelope mEnvelope;
+		uint8_t mDuty = 0;
+		uint8_t mStep = 0;
+		uint16_t mPeriod = 0; // 11 bit timer period, in APU cycles (2 CPU cycles)
+		int mTimer = 2;		  // CPU cycles until the sequencer steps
+		uint8_t mLength = 0;
+
+		bool mSweepEnabled = false;
+		bool mSweepNegate = false;
+		bool mSweepReload = false;
+		uint8_t mSweepPeriod = 0;
+		uint8_t mSweepShift = 0;
+		uint8_t mSweepDivider = 0;
+		bool mOnesComplement = false; // pulse 1 negates with one's complement
+
+		APUOutput mOutput;
+
+		uint16_t GetSweepTarget() const;
+		inline bool IsMuted() const { return mPeriod < 8 || GetSweepTarget() > 0x7FF; }
+		void ClockSweep();
+		void Run(uint32_t arg_time, int arg_cycles);
+		uint8_t GetOutput() const;
+	};
+
+	// https://wiki.nesdev.com/w/index.php/APU_Triangle
+	struct APUTriangle
+	{
+		bool mControl = false; // also the length counter halt flag
+		bool mLinearReload = false;
+		uint8_t mLinearReloadValue = 0;
+		uint8_t mLinearCounter = 0;
+		uint8_t mStep = 0;
+		uint16_t mPeriod = 0; // in CPU cycles
+		int mTimer = 1;
+		uint8_t mLength = 0;
+		APUOutput mOutput;
+
+		void ClockLinearCounter();
+		void Run(uint32_t arg_time, int arg_cycles);
+		uint8_t GetOutput() const;
+	};
+
+	// https://wiki.nesdev.com/w/index.php/APU_Noise
+	struct APUNoise
+	{
+		APUEnvelope mEnvelope;
+		bool mMode = false;
+		uint16_t mShiftRegister = 1;
+		uint16_t mPeriod = 4; // in CPU cycles
+		int mTimer = 4;
+		uint8_t mLength = 0;
+		APUOutput mOutput;
+
+		void Run(uint32_t arg_time, int arg_cycles);
+		uint8_t GetOutput() const;
+	};
+
+	// https://wiki.nesdev.com/w/index.php/APU_DMC
+	struct APUDMC
 	{
-		One,
-		Two
+		bool mIRQEnabled = false;
+		bool mLoop = false;
+		uint16_t mPeriod = 428; // in CPU cycles
+		int mTimer = 428;
+		uint8_t mOutputLevel = 0;
+
+		uint16_t mSampleAddress = 0xC000;
+		uint16_t mSampleLength = 1;
+		uint16_t mCurrentAddress = 0xC000;
+		uint16_t mBytesRemaining = 0;
+
+		bool mBufferFull = false;
+		uint8_t mBuffer = 0;
+		uint8_t mShiftRegister = 0;
+		uint8_t mBitsRemaining = 8;
+		bool mSilence = true;
+		APUOutput mOutput;
+
+		void Restart();
+		bool FillBuffer(); // true when the sample ends with an IRQ
+		bool Run(uint32_t arg_time, int arg_cycles);
 	};
 
 	class APU
 	{
 	private:
 		bool mInitialised = false;
-		Uint32 mTimeLastSample;
-		
-		uint64_t mSampleCounter = 0;
-		double mTime = 0.0f;
+		uint64_t mCPUCycle = 0; // CPU cycle the APU has caught up to
 
-		Sint16 mSampleBuffer[SAMPLE_RATE];
-		size_t mReadPos = 0;
-		size_t mWritePos = SAMPLE_WRITE_BUFFER;
+		APUPulse mPulse[2];
+		APUTriangle mTriangle;
+		APUNoise mNoise;
+		APUDMC mDMC;
+		uint8_t mEnabled = 0; // channel enable bits, as written to $4015
 
-		Sint16 mSampleWriteBuffer[SAMPLE_WRITE_BUFFER];
-		size_t mSampleWriteBufferPos = 0;
+		// https://wiki.nesdev.com/w/index.php/APU_Frame_Counter
+		bool mFiveStepMode = false;
+		bool mIRQInhibit = false;
+		int mFrameCycle = 0; // CPU cycles since the frame counter was reset
+		int mFrameStep = 0;
+		uint8_t mStatus = 0; // IRQ flags, as read from $4015
 
-		int TriangleDutyCycleSequence[32] =
-		{ 8, 7, 6, 5, 4, 3, 2, 1, 0, -1, -2, -3, -4, -5, -6, -7
-		 -7, -6, -5, -4, -3, -2, -1, 0, 1, 2, 3, 4, 5, 6, 7, 8 };
+		// Channel output changes, band-limited once per audio frame. The mixer is nonlinear, but only
+		// across the two groups it sums: pulse 1 + 2, and 3 * triangle + 2 * noise + DMC.
+		BlipBuffer mPulseBlip;
+		BlipBuffer mTNDBlip;
+		uint64_t mAudioFrameStart = 0; // CPU cycle
+		int32_t mPulseIndices[APU_MIX_BUFFER];
+		int32_t mTNDIndices[APU_MIX_BUFFER];
+		int32_t mMixBuffer[APU_MIX_BUFFER];
 
-		int SquareDutyChannel[4][8] = 
-		{
-			{ -4, -4, -4, -4, -4, -4, -4,  4 },
-			{ -4, -4, -4, -4, -4, -4,  4,  4 },
-			{ -4, -4, -4, -4,  4,  4,  4,  4 },
-			{  4,  4,  4,  4,  4,  4, -4, -4 }
-		};
+		// https://wiki.nesdev.com/w/index.php/APU_Mixer lookup tables, scaled to AMPLITUDE.
+		// The last entry repeats, for interpolating at the end.
+		int32_t mPulseTable[32];
+		int32_t mTNDTable[204];
+
+		// DC blocking high-pass (the NES's 90 Hz output filter), in 1/32768 units
+		int mHighPassCoefficient = 0;
+		int mHighPassInput = 0;
+		int mHighPassOutput = 0;
+
+		Sint16 mMixSamples[APU_MIX_BUFFER];
+
+		// Conversion to the output rate, which the rate control fine-tunes
+		Resampler mResampler;
+		int mOutputRate = 48000;
+		std::vector<Sint16> mOutputSamples;
+
+		// FNV-1a hash and count of the mixed samples, before resampling. They only depend on the emulated
+		// CPU cycles, not on how often the APU is caught up, the pacing or the audio device.
+		uint64_t mAudioHash = 14695981039346656037ull;
+		uint64_t mAudioSampleCount = 0;
+
+		// Samples waiting for the audio callback (or ReadSamples), about mLatencyPeriods callback periods of them
+		AudioRing mRing;
+		int mLatencyPeriods = 3;
+		int mAudioPeriod = 512; // samples per callback
+		bool mAudioDevice = true;
+		bool mAudioPlaying = false;
+		bool mAudioPaced = false;
+		bool mRateControl = true;
+		double mRateIntegral = 0.0;
+		double mRateFill = -1.0; // averaged fill level, negative until measured
+
+		int GetFrameStepCycle() const;
+		void ClockFrameCounter();
+		void ClockQuarterFrame();
+		void ClockHalfFrame();
+		void RunChannels(int arg_cycles);
+		void UpdateOutputs();
+		void EndAudioFrame();
+		void Mix(int arg_count);
+		void ControlRate();
+		void ConfigureOutput();
 
 	public:
 		APU();
-		void Tick(int arg_cpucycles);
 		void Initialise();
-		void UpdateBuffer();
 
-		double GetSquareChannelSampleValue(const SquareChannel arg_channel);
-		double GetTriangleChannelSampleValue();
+		/**
+		* Runs the channels up to the given CPU cycle, and outputs the samples that are due.
+		* Must be called before any register access.
+		**/
+		void CatchUp(uint64_t arg_cpuCycle);
+
+		/**
+		* The CPU cycle of the next frame counter or DMC IRQ, if one can happen.
+		**/
+		uint64_t GetNextEventCycle() const;
+
+		/**
+		* The IRQ line: frame counter or DMC interrupt flags are set.
+		**/
+		inline bool IsIRQPending() const { return (mStatus & (APUSTATUS_FRAME_IRQ | APUSTATUS_DMC_IRQ)) != 0; }
+
+		uint8_t ReadRegister(uint16_t arg_address);
+		void WriteRegister(uint16_t arg_address, uint8_t arg_value);
+
+		/**
+		* The rate requested from the audio device (48000 by default). The device may choose another,
+		* which GetOutputRate then returns. Call before the first CatchUp.
+		**/
+		void SetOutputRate(int arg_rate);
+		inline int GetOutputRate() const { return mOutputRate; }
+
+		/**
+		* Trades resampling quality for speed (ResampleBalanced by default).
+		**/
+		void SetResampleQuality(ResampleQuality arg_quality);
+
+		/**
+		* Output latency target, in audio callback periods (3 by default). Playback waits until that many
+		* samples are queued, so 2 is the lowest that doesn't underrun between audio frames.
+		**/
+		void SetLatency(int arg_periods);
+		inline int GetLatency() const { return mLatencyPeriods; }
+
+		/**
+		* Samples waiting for the audio callback, and underrun/overrun counts.
+		**/
+		inline const AudioRing& GetAudioRing() const { return mRing; }
+
+		/**
+		* The audio device is open and consuming samples in real time, so it can pace the emulation.
+		**/
+		inline bool IsAudioPlaying() const { return mAudioPlaying; }
+
+		/**
+		* Audio clock pacing: how long to wait, in microseconds, for the device to consume the samples queued
+		* above the ring's start level. 0 if there's nothing to wait for, or audio isn't playing.
+		**/
+		int GetPacingDelay() const;
+
+		/**
+		* Whether the emulation waits for GetPacingDelay. The fill level then can't rise above the start level
+		* whatever the resampling ratio, so the rate control only acts when the emulation falls behind.
+		**/
+		inline void SetAudioPaced(bool arg_paced) { mAudioPaced = arg_paced; }
+
+		/**
+		* Whether to open the audio device (true by default). Call before the first CatchUp. Without it,
+		* nothing paces the emulation and the resampling ratio is exact: read the samples with ReadSamples.
+		**/
+		inline void SetAudioDevice(bool arg_enabled) { mAudioDevice = arg_enabled; }
+
+		/**
+		* Without an audio device: takes up to arg_maxCount queued samples at the output rate.
+		* Unread samples beyond the ring's capacity are dropped, so read at least once per frame.
+		* @return How many samples were read.
+		**/
+		size_t ReadSamples(int16_t* out_samples, size_t arg_maxCount);
+
+		/**
+		* Hash of every sample mixed so far, at APU_MIX_RATE. For N emulated CPU cycles there are exactly
+		* N / APU_AUDIO_FRAME * APU_AUDIO_FRAME * APU_MIX_RATE / APU_CPU_CLOCK of them (rounded down), so runs
+		* of the same inputs give the same hash at any speed, headless or not.
+		**/
+		inline uint64_t GetAudioHash() const { return mAudioHash; }
+		inline uint64_t GetAudioSampleCount() const { return mAudioSampleCount; }
+
+		/**
+		* Dynamic rate control (on by default): while audio is playing, the resampling ratio is adjusted by up to
+		* APU_RATE_ADJUST each audio frame to keep the ring near its start level, whatever paces the emulation.
+		**/
+		void SetRateControl(bool arg_enabled);
+		inline double GetRateAdjust() const { return mResampler.GetRatioAdjust(); }
 
 		static void audio_callback(void *user_data, Uint8 *raw_buffer, int bytes);
 	};
@@ -0,0 +1,88 @@
+#include "audioring.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace nesemu
+{
+	void AudioRing::Resize(size_t arg_capacity, size_t arg_startLevel)
+	{
+		size_t capacity = 1;
+		while (capacity < arg_capacity)
+			capacity <<= 1;
+
+		mSamples.assign(capacity, 0);
+		mMask = capacity - 1;
+		mStartLevel = std::min(arg_startLevel, capacity);
+		mWriteIndex.store(0, std::memory_order_relaxed);
+		mReadIndex.store(0, std::memory_order_relaxed);
+		mPlaying = false;
+		mLastSample = 0;
+	}
+
+	size_t AudioRing::Write(const int16_t* arg_samples, size_t arg_count)
+	{
+		const size_t write = mWriteIndex.load(std::memory_order_relaxed);
+		const size_t read = mReadIndex.load(std::memory_order_acquire);
+		const size_t count = std::min(arg_count, mSamples.size() - (write - read));
+
+		// In up to two parts, around the end of the ring
+		const size_t start = write & mMask;
+		const size_t first = std::min(count, mSamples.size() - start);
+		memcpy(mSamples.data() + start, arg_samples, first * sizeof(int16_t));
+		memcpy(mSamples.data(), arg_samples + first, (count - first) * sizeof(int16_t));
+		mWriteIndex.store(write + count, std::memory_order_release);
+
+		if (count < arg_count)
+			mDroppedSamples.fetch_add(arg_count - count, std::memory_order_relaxed);
+		return count;
+	}
+
+	size_t AudioRing::Read(int16_t* out_samples, size_t arg_count)
+	{
+		const size_t read = mReadIndex.load(std::memory_order_relaxed);
+		const size_t available = mWriteIndex.load(std::memory_order_acquire) - read;
+
+		size_t count = 0;
+		if (mPlaying || available >= mStartLevel)
+		{
+			mPlaying = true;
+			count = std::min(arg_count, available);
+
+			const size_t start = read & mMask;
+			const size_t first = std::min(count, mSamples.size() - start);
+			memcpy(out_samples, mSamples.data() + start, first * sizeof(int16_t));
+			memcpy(out_samples + first, mSamples.data(), (count - first) * sizeof(int16_t));
+			mReadIndex.store(read + count, std::memory_order_release);
+
+			if (count > 0)
+				mLastSample = out_samples[count - 1];
+			if (count < arg_count)
+			{
+				// Wait for the start level again, rather than crackling through every late sample
+				mPlaying = false;
+				mUnderruns.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		const int16_t fill = mUnderrunMode.load(std::memory_order_relaxed) == UnderrunMode::UnderrunRepeat ? mLastSample : 0;
+		std::fill(out_samples + count, out_samples + arg_count, fill);
+		return count;
+	}
+
+	size_t AudioRing::ReadAvailable(int16_t* out_samples, size_t arg_maxCount)
+	{
+		const size_t read = mReadIndex.load(std::memory_order_relaxed);
+		const size_t count = std::min(arg_maxCount, mWriteIndex.load(std::memory_order_acquire) - read);
+
+		const size_t start = read & mMask;
+		const size_t first = std::min(count, mSamples.size() - start);
+		memcpy(out_samples, mSamples.data() + start, first * sizeof(int16_t));
+		memcpy(out_samples + first, mSamples.data(), (count - first) * sizeof(int16_t));
+		mReadIndex.store(read + count, std::memory_order_release);
+
+		if (count > 0)
+			mLastSample = out_samples[count - 1];
+		return count;
+	}
+}
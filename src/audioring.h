@@ -0,0 +1,85 @@
+#ifndef NESEMU_AUDIORING_H
+#define NESEMU_AUDIORING_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace nesemu
+{
+	enum UnderrunMode
+	{
+		UnderrunSilence,	// play zeros
+		UnderrunRepeat		// hold the last sample, which avoids a step back to 0
+	};
+
+	/**
+	* Lock-free single producer, single consumer ring of audio samples: the emulation writes, the audio callback reads.
+	* Playback starts (and restarts after an underrun) once the ring has filled to the start level,
+	* so the latency settles at about that many samples.
+	**/
+	class AudioRing
+	{
+	private:
+		std::vector<int16_t> mSamples;
+		size_t mMask = 0;
+		size_t mStartLevel = 0;
+
+		// Free running sample counts. Each side only writes its own, and publishes it with release.
+		std::atomic<size_t> mWriteIndex{ 0 };
+		std::atomic<size_t> mReadIndex{ 0 };
+
+		// Consumer state. The underrun mode can be changed from any thread.
+		std::atomic<UnderrunMode> mUnderrunMode{ UnderrunMode::UnderrunRepeat };
+		bool mPlaying = false;
+		int16_t mLastSample = 0;
+
+		std::atomic<uint32_t> mUnderruns{ 0 };
+		std::atomic<uint64_t> mDroppedSamples{ 0 };
+
+	public:
+		/**
+		* Sets the start level in samples, and a capacity of at least arg_capacity samples (rounded up to a power of 2).
+		* Discards the queued samples. Not thread safe: only call while the consumer is stopped.
+		**/
+		void Resize(size_t arg_capacity, size_t arg_startLevel);
+		inline size_t GetCapacity() const { return mSamples.size(); }
+		inline size_t GetStartLevel() const { return mStartLevel; }
+
+		/**
+		* Samples queued and not yet read. Safe from either side.
+		**/
+		inline size_t GetFillLevel() const
+		{
+			const size_t read = mReadIndex.load(std::memory_order_acquire);
+			return mWriteIndex.load(std::memory_order_acquire) - read;
+		}
+
+		/**
+		* Producer: queues the samples that fit, and drops the rest (an overrun).
+		* @return How many samples were queued.
+		**/
+		size_t Write(const int16_t* arg_samples, size_t arg_count);
+
+		/**
+		* Consumer: always fills arg_count samples. Missing samples (while starting, or an underrun) are
+		* filled according to the underrun mode.
+		* @return How many samples came from the ring.
+		**/
+		size_t Read(int16_t* out_samples, size_t arg_count);
+
+		/**
+		* Consumer without a device (headless runs, capture): takes up to arg_maxCount queued samples,
+		* without waiting for the start level or filling the rest.
+		* @return How many samples were read.
+		**/
+		size_t ReadAvailable(int16_t* out_samples, size_t arg_maxCount);
+		inline void SetUnderrunMode(UnderrunMode arg_mode) { mUnderrunMode.store(arg_mode, std::memory_order_relaxed); }
+
+		inline uint32_t GetUnderruns() const { return mUnderruns.load(std::memory_order_relaxed); }
+		inline uint64_t GetDroppedSamples() const { return mDroppedSamples.load(std::memory_order_relaxed); }
+	};
+}
+
+#endif
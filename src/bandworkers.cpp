@@ -0,0 +1,86 @@
+#include "bandworkers.h"
+
+#include <algorithm>
+
+namespace nesemu
+{
+	BandWorkers::~BandWorkers()
+	{
+		StopThreads();
+	}
+
+	void BandWorkers::SetThreads(int arg_threads)
+	{
+		std::lock_guard<std::mutex> runLock(mRunMutex);
+		StopThreads();
+
+		mStop = false;
+		for (int i = 1; i < arg_threads; i++)
+		{
+			mThreads.emplace_back(&BandWorkers::WorkerThread, this, (int)mThreads.size(), mJobIndex);
+		}
+	}
+
+	void BandWorkers::Run(int arg_bands, const std::function<void(int, int)>& arg_job)
+	{
+		std::lock_guard<std::mutex> runLock(mRunMutex);
+		const int bands = std::min(std::max(arg_bands, 1), GetThreads());
+		if (bands == 1)
+		{
+			arg_job(0, 1);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mJob = &arg_job;
+			mBands = bands;
+			mPending = (int)mThreads.size();
+			mJobIndex++;
+			mStart.notify_all();
+		}
+		arg_job(0, bands);
+
+		std::unique_lock<std::mutex> lock(mMutex);
+		mDone.wait(lock, [&] { return mPending == 0; });
+		mJob = nullptr;
+	}
+
+	void BandWorkers::WorkerThread(int arg_index, uint64_t arg_job)
+	{
+		// Worker i runs band i + 1, if the job has that many. arg_job is the last job run before it started.
+		uint64_t job = arg_job;
+		while (true)
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mStart.wait(lock, [&] { return mStop || mJobIndex != job; });
+			if (mStop)
+				return;
+			job = mJobIndex;
+			const std::function<void(int, int)>& function = *mJob;
+			const int bands = mBands;
+			lock.unlock();
+
+			if (arg_index + 1 < bands)
+				function(arg_index + 1, bands);
+
+			lock.lock();
+			if (--mPending == 0)
+				mDone.notify_all();
+		}
+	}
+
+	void BandWorkers::StopThreads()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStop = true;
+			mStart.notify_all();
+		}
+		for (std::thread& thread : mThreads)
+		{
+			thread.join();
+		}
+		mThreads.clear();
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef NESEMU_BANDWORKERS_H
+#define NESEMU_BANDWORKERS_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace nesemu
+{
+	/**
+	* Persistent worker threads for jobs split into bands of rows. The calling thread runs the first band and
+	* waits for the others. Like the PPU's render threads, threads are only created when the count changes.
+	**/
+	class BandWorkers
+	{
+	private:
+		std::vector<std::thread> mThreads;
+		std::mutex mRunMutex; // one job at a time
+		std::mutex mMutex;
+		std::condition_variable mStart;
+		std::condition_variable mDone;
+		const std::function<void(int, int)>* mJob = nullptr;
+		int mBands = 0;
+		uint64_t mJobIndex = 0;
+		int mPending = 0;
+		bool mStop = false;
+
+		void WorkerThread(int arg_index, uint64_t arg_job);
+		void StopThreads();
+
+	public:
+		~BandWorkers();
+
+		/**
+		* Total threads, including the calling thread: 1 runs everything on the calling thread.
+		**/
+		void SetThreads(int arg_threads);
+		inline int GetThreads() const { return (int)mThreads.size() + 1; }
+
+		/**
+		* Calls arg_job(band, bands) for bands 0 to arg_bands - 1, each on its own thread, and returns once
+		* they are all done. arg_bands is limited to GetThreads().
+		**/
+		void Run(int arg_bands, const std::function<void(int, int)>& arg_job);
+	};
+}
+
+#endif
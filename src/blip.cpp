@@ -0,0 +1,92 @@
+#include "blip.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+namespace nesemu
+{
+	// Kernel cutoff, as a fraction of the sample rate. Lower trades treble for less aliasing near Nyquist.
+	static const double KernelCutoff = 0.4;
+
+	BlipBuffer::BlipBuffer()
+	{
+		const double pi = 3.14159265358979323846;
+		const int width = BLIP_HALF_WIDTH * 2;
+		for (int phase = 0; phase < BLIP_PHASES; phase++)
+		{
+			// Blackman windowed sinc, centered between taps BLIP_HALF_WIDTH - 1 and BLIP_HALF_WIDTH
+			double taps[BLIP_HALF_WIDTH * 2];
+			double sum = 0.0;
+			for (int i = 0; i < width; i++)
+			{
+				const double x = i - (BLIP_HALF_WIDTH - 1) - (double)phase / BLIP_PHASES;
+				const double sinc = x == 0.0 ? 1.0 : sin(2.0 * pi * KernelCutoff * x) / (2.0 * pi * KernelCutoff * x);
+				const double window = 0.42 + 0.5 * cos(pi * x / BLIP_HALF_WIDTH) + 0.08 * cos(2.0 * pi * x / BLIP_HALF_WIDTH);
+				taps[i] = sinc * window;
+				sum += taps[i];
+			}
+
+			// Each phase sums to exactly 1 << 15, so steps integrate back without any DC error
+			int total = 0;
+			for (int i = 0; i < width; i++)
+			{
+				mKernel[phase][i] = (int16_t)lrint(taps[i] * 32768.0 / sum);
+				total += mKernel[phase][i];
+			}
+			mKernel[phase][BLIP_HALF_WIDTH - 1] += (int16_t)(32768 - total);
+		}
+	}
+
+	void BlipBuffer::SetRates(uint32_t arg_clockRate, uint32_t arg_sampleRate, uint32_t arg_maxFrameClocks)
+	{
+		mClockRate = arg_clockRate;
+		mSampleRate = arg_sampleRate;
+		mBuffer.resize((size_t)((uint64_t)arg_maxFrameClocks * arg_sampleRate / arg_clockRate) + 2 + BLIP_HALF_WIDTH * 2);
+		Clear();
+	}
+
+	void BlipBuffer::Clear()
+	{
+		std::fill(mBuffer.begin(), mBuffer.end(), 0);
+		mIntegrator = 0;
+		mOffset = 0;
+	}
+
+	void BlipBuffer::AddDelta(uint32_t arg_time, int arg_delta)
+	{
+		const uint64_t position = mOffset + (uint64_t)arg_time * mSampleRate;
+		const size_t index = (size_t)(position / mClockRate);
+		const int phase = (int)((position % mClockRate) * BLIP_PHASES / mClockRate);
+
+		const int16_t* kernel = mKernel[phase];
+		int32_t* dest = &mBuffer[index];
+		for (int i = 0; i < BLIP_HALF_WIDTH * 2; i++)
+			dest[i] += kernel[i] * arg_delta;
+	}
+
+	void BlipBuffer::EndFrame(uint32_t arg_time)
+	{
+		mOffset += (uint64_t)arg_time * mSampleRate;
+	}
+
+	int BlipBuffer::ReadSamples(int32_t* out_samples, int arg_count)
+	{
+		const int available = GetSamplesAvailable();
+		const int count = std::min(arg_count, available);
+		int32_t integrator = mIntegrator;
+		for (int i = 0; i < count; i++)
+		{
+			integrator += mBuffer[i];
+			out_samples[i] = integrator >> 15;
+		}
+		mIntegrator = integrator;
+
+		// Keep the kernel tails of the deltas past the samples that were read
+		const size_t remaining = available - count + BLIP_HALF_WIDTH * 2;
+		memmove(mBuffer.data(), mBuffer.data() + count, remaining * sizeof(int32_t));
+		std::fill(mBuffer.begin() + remaining, mBuffer.begin() + remaining + count, 0);
+		mOffset -= (uint64_t)count * mClockRate;
+		return count;
+	}
+}
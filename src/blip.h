@@ -0,0 +1,62 @@
+#ifndef NESEMU_BLIP_H
+#define NESEMU_BLIP_H
+
+#include <stdint.h>
+#include <vector>
+
+#define BLIP_HALF_WIDTH		8	// kernel taps on each side of a step
+#define BLIP_PHASES			64	// kernel sub-sample positions
+
+namespace nesemu
+{
+	/**
+	* Band-limited synthesis (blip buffer): amplitude changes are added as deltas at clock resolution,
+	* each spread over the output samples with a windowed sinc step kernel. Reading integrates them back
+	* into the band-limited waveform. The cost is per amplitude change, not per output sample.
+	* Output is delayed by BLIP_HALF_WIDTH - 1 samples.
+	**/
+	class BlipBuffer
+	{
+	private:
+		uint32_t mClockRate = 1;
+		uint32_t mSampleRate = 1;
+
+		// Kernel for each sub-sample phase, taps sum to 1 << 15
+		int16_t mKernel[BLIP_PHASES][BLIP_HALF_WIDTH * 2];
+
+		// Deltas per output sample, integrated as they are read
+		std::vector<int32_t> mBuffer;
+		int32_t mIntegrator = 0;
+
+		// Position of the frame start, in 1/mClockRate samples from mBuffer[0]. Exact, so there's no drift.
+		uint64_t mOffset = 0;
+
+	public:
+		BlipBuffer();
+
+		/**
+		* Sets the clock rate of delta times, the output sample rate and the longest frame in clocks. Clears the buffer.
+		**/
+		void SetRates(uint32_t arg_clockRate, uint32_t arg_sampleRate, uint32_t arg_maxFrameClocks);
+		void Clear();
+
+		/**
+		* Adds an amplitude change at a clock relative to the start of the frame.
+		**/
+		void AddDelta(uint32_t arg_time, int arg_delta);
+
+		/**
+		* Ends the frame at a clock: the samples before it can be read, and later times are relative to it.
+		**/
+		void EndFrame(uint32_t arg_time);
+		inline int GetSamplesAvailable() const { return (int)(mOffset / mClockRate); }
+
+		/**
+		* Reads and removes up to arg_count samples, in the units of the deltas.
+		* @return How many samples were read.
+		**/
+		int ReadSamples(int32_t* out_samples, int arg_count);
+	};
+}
+
+#endif
@@ -36,6 +36,7 @@ namespace nesemu
 
 	void CPU::Tick()
 	{
+		mCycleCount += mCurrentCycles;
 		mCurrentCycles = 0;
 
 		uint8_t op = GMemory->ReadByte(mProgramCounter);
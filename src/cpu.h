@@ -59,6 +59,7 @@ namespace nesemu
 		uint16_t mCurrentOperandAddress;
 		uint16_t mNextOperationAddress;
 		int mCurrentCycles = 0;
+		uint64_t mCycleCount = 0; // cycles of all completed instructions
 
 		uint16_t mNMILabel;
 		uint16_t mIRQLabel;
@@ -155,6 +156,12 @@ namespace nesemu
 
 		inline int GetCurrentFrameCycles() { return mCurrentCycles; }
 
+		/**
+		* Total CPU cycles, including the instruction being executed.
+		* Memory accesses made by an instruction are treated as happening at its last cycle.
+		**/
+		inline uint64_t GetCycleCount() { return mCycleCount + mCurrentCycles; }
+
 		const int CPUClockRate = 1789773;
 	};
 }
@@ -14,6 +14,13 @@ int main()
 	nes->SetROM("main.nes");
 	nes->Start();
 
+#ifdef NESEMU_BENCHMARK
+	// Let the game set up its screen before measuring
+	for (int i = 0; i < 1000000 && nes->IsRunning(); i++)
+		nes->Update();
+	nes->PrintRenderBenchmark();
+#endif
+
 	while (nes->IsRunning())
 	{
 		nes->Update();
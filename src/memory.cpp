@@ -1,6 +1,7 @@
 #include "memory.h"
 
 #include <memory>
+#include <string.h>
 
 namespace nesemu
 {
@@ -13,6 +14,10 @@ namespace nesemu
 
 	uint8_t Memory::ReadByte(const uint32_t& arg_address)
 	{
+		if (IsPPURegister(arg_address) && mPPURead != nullptr)
+			return mPPURead(arg_address);
+		if (arg_address == MEMLOC_APUSTATUS && mAPURead != nullptr)
+			return mAPURead(arg_address);
 		return mData[arg_address];
 	}
 
@@ -37,6 +42,28 @@ namespace nesemu
 
 	void Memory::Write(const uint32_t& arg_address, void* arg_data, const size_t& arg_bytes)
 	{
+		if (arg_bytes == 1 && IsPPURegister(arg_address) && mPPUWrite != nullptr)
+		{
+			mPPUWrite(arg_address, *(uint8_t*)arg_data);
+			return;
+		}
+		if (arg_bytes == 1 && IsAPURegister(arg_address) && mAPUWrite != nullptr)
+		{
+			mAPUWrite(arg_address, *(uint8_t*)arg_data);
+			return;
+		}
 		memcpy(&mData[arg_address], arg_data, arg_bytes);
 	}
+
+	void Memory::SetPPUCallbacks(IOReadCallback arg_read, IOWriteCallback arg_write)
+	{
+		mPPURead = arg_read;
+		mPPUWrite = arg_write;
+	}
+
+	void Memory::SetAPUCallbacks(IOReadCallback arg_read, IOWriteCallback arg_write)
+	{
+		mAPURead = arg_read;
+		mAPUWrite = arg_write;
+	}
 }
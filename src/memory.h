@@ -2,23 +2,50 @@
 #define NESEMU_MEMORY_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <functional>
 
 #define NESMEM_TOTAL_MEMORY		0x10000
 #define NESMEM_RAM_START		0x0000
 #define NESMEM_PPU_START		0x2000
+#define NESMEM_IO_START			0x4000
 #define NESMEM_APU_START		0x4018
 #define NESMEM_ROM_START		0x4020
 #define NESMEM_PRG_START		0x8000
 
-#define MEMLOC_VBLANK			0x2002
+#define MEMLOC_OAMDMA			0x4014
+#define MEMLOC_APUSTATUS		0x4015
+#define MEMLOC_FRAMECOUNTER		0x4017
 
 namespace nesemu
 {
+	typedef std::function<uint8_t(uint16_t)> IOReadCallback;
+	typedef std::function<void(uint16_t, uint8_t)> IOWriteCallback;
+
 	class Memory
 	{
 	private:
 		uint8_t mData[NESMEM_TOTAL_MEMORY];
 
+		// PPU registers ($2000-$3FFF, mirrored every 8 bytes) and OAM DMA ($4014)
+		IOReadCallback mPPURead;
+		IOWriteCallback mPPUWrite;
+
+		inline bool IsPPURegister(const uint32_t& arg_address) const
+		{
+			return (arg_address >= NESMEM_PPU_START && arg_address < NESMEM_IO_START) || arg_address == MEMLOC_OAMDMA;
+		}
+
+		// APU registers: channels ($4000-$4013), status ($4015) and frame counter ($4017, reads are the 2nd controller)
+		IOReadCallback mAPURead;
+		IOWriteCallback mAPUWrite;
+
+		inline bool IsAPURegister(const uint32_t& arg_address) const
+		{
+			return (arg_address >= NESMEM_IO_START && arg_address < MEMLOC_OAMDMA) || arg_address == MEMLOC_APUSTATUS
+				|| arg_address == MEMLOC_FRAMECOUNTER;
+		}
+
 	public:
 		Memory();
 
@@ -28,6 +55,16 @@ namespace nesemu
 		uint16_t ReadMemoryAddress(const uint16_t& arg_location);
 
 		void Write(const uint32_t& arg_address, void* arg_data, const size_t& arg_bytes);
+
+		/**
+		* Routes single byte CPU reads and writes of the PPU registers to the PPU.
+		**/
+		void SetPPUCallbacks(IOReadCallback arg_read, IOWriteCallback arg_write);
+
+		/**
+		* Routes single byte CPU writes of the APU registers, and reads of $4015, to the APU.
+		**/
+		void SetAPUCallbacks(IOReadCallback arg_read, IOWriteCallback arg_write);
 	};
 
 	extern Memory* GMemory;
@@ -2,6 +2,7 @@
 
 #include "sdl2/SDL.h"
 #include <iostream>
+#include <thread>
 
 namespace nesemu
 {
@@ -27,19 +28,52 @@ namespace nesemu
 		mAPU = new APU();
 		mROM = new ROM();
 
+		// The PPU only calls this when NMI is enabled in PPUCTRL. It can be in the middle of an instruction
+		// (the PPU catches up on register accesses), so the NMI is taken once the instruction completes.
 		std::function<void()> vBlakCallback = [&]
 		{
-			uint8_t byte = GMemory->ReadByte(0x2000);
-			if(byte & 0b10000000) // NMI enabled
-				mCPU->Interrupt(InterruptType::NMI);
+			mNMIPending = true;
 		};
 		mPPU->SetVBlankCallback(vBlakCallback);
+		mPPU->SetFrameBuffer(mFrameBuffer);
+		mPPU->SetRenderThreads(mRenderThreads);
+		mAPU->SetAudioDevice(mAudioDevice);
+
+		// The PPU only runs when its state is observed: catch it up before any register access
+		GMemory->SetPPUCallbacks(
+			[&](uint16_t arg_address)
+			{
+				mPPU->CatchUp(mCPU->GetCycleCount());
+				return mPPU->ReadRegister(arg_address);
+			},
+			[&](uint16_t arg_address, uint8_t arg_value)
+			{
+				mPPU->CatchUp(mCPU->GetCycleCount());
+				mPPU->WriteRegister(arg_address, arg_value);
+			});
+
+		// The APU is caught up the same way, and at its frame counter IRQ
+		GMemory->SetAPUCallbacks(
+			[&](uint16_t arg_address)
+			{
+				mAPU->CatchUp(mCPU->GetCycleCount());
+				const uint8_t value = mAPU->ReadRegister(arg_address);
+				mIRQLine = mAPU->IsIRQPending();
+				return value;
+			},
+			[&](uint16_t arg_address, uint8_t arg_value)
+			{
+				mAPU->CatchUp(mCPU->GetCycleCount());
+				mAPU->WriteRegister(arg_address, arg_value);
+				mIRQLine = mAPU->IsIRQPending();
+			});
 
 		bool romLoaded = false;
 		if (mCurrentROM != "")
 		{
 			romLoaded = mROM->Load(mCurrentROM.c_str());
 			mROM->CopyToMemory(); // TODO: MMU
+			mPPU->SetROM(mROM);
 		
 			mCPU->Initialise();
 		}
@@ -47,29 +81,200 @@ namespace nesemu
 		mIsRunning = romLoaded;
 	}
 
-	void NES::Update()
+	bool NES::Step()
 	{
 		mCPU->Tick();
 
-		int currentFrameCycles = mCPU->GetCurrentFrameCycles();
-		if (currentFrameCycles > 0)
+		const int currentFrameCycles = mCPU->GetCurrentFrameCycles();
+
+		// Peripherals are only synchronised when one has an event due (vblank/NMI, frame end, APU IRQ)
+		const uint64_t cycle = mCPU->GetCycleCount();
+		if (cycle >= mPPU->GetNextEventCycle() || cycle >= mAPU->GetNextEventCycle())
+		{
+			mPPU->CatchUp(cycle);
+			mAPU->CatchUp(cycle);
+			mIRQLine = mAPU->IsIRQPending();
+		}
+		if (mNMIPending)
+		{
+			mNMIPending = false;
+			mCPU->Interrupt(InterruptType::NMI);
+		}
+
+		// The IRQ line stays asserted until the game acknowledges it, and is taken as soon as the I flag allows
+		if (mIRQLine)
+			mCPU->Interrupt(InterruptType::IRQ);
+		return currentFrameCycles > 0;
+	}
+
+	void NES::Update()
+	{
+		Step();
+
+		const uint64_t cycle = mCPU->GetCycleCount();
+		if (cycle - mLastPaceCycle < NES_PACING_CYCLES)
+			return;
+		mLastPaceCycle = cycle;
+
+		// The audio device consumes samples in real time: stay about the ring's start level ahead of it.
+		// Its buffer absorbs the sleep granularity.
+		if (mAPU->IsAudioPlaying())
+		{
+			mAPU->SetAudioPaced(true);
+			const int delay = mAPU->GetPacingDelay();
+			if (delay > 0)
+				std::this_thread::sleep_for(std::chrono::microseconds(delay));
+			return;
+		}
+
+		// Without audio, pace to the wall clock
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		const int64_t ahead = (int64_t)((cycle - mPaceStartCycle) * 1000000 / mCPU->CPUClockRate)
+			- std::chrono::duration_cast<std::chrono::microseconds>(now - mPaceStart).count();
+		if (ahead > 1000)
+			std::this_thread::sleep_for(std::chrono::microseconds(ahead));
+		else if (ahead < -100000)
 		{
-			mPPU->Tick(currentFrameCycles);
-			mAPU->Tick(currentFrameCycles);
+			// Fell behind (or just started): carry on from here rather than rushing to catch up
+			mPaceStart = now;
+			mPaceStartCycle = cycle;
 		}
+	}
 
-		int currTime = SDL_GetTicks();
-		int elapsedTime = currTime - mTimeLastDelay;
-		mCycleCounter += currentFrameCycles;
+	bool NES::RunFrame(bool arg_render)
+	{
+		if (!mIsRunning)
+			return false;
 
-		int expectedTime = (mCycleCounter * 1000) / mCPU->CPUClockRate;
-		int delay = expectedTime - elapsedTime;
-		if (delay > 0 && elapsedTime > 0)
+		mPPU->SetSkipRendering(!arg_render);
+		mAPU->SetAudioPaced(false);
+
+		// Up to the next vblank, as fast as possible
+		const uint64_t frame = mPPU->GetFrameRenderStats().GetTotalFrames();
+		while (mPPU->GetFrameRenderStats().GetTotalFrames() == frame)
 		{
-			SDL_Delay(delay);
-			mTimeLastDelay = currTime; // TODO
-			mCycleCounter = 0; // TODO
+			// The CPU doesn't advance past unknown opcodes, which take no cycles
+			if (!Step())
+				return false;
 		}
+		return true;
+	}
+
+	void NES::SetFrameBuffer(uint8_t* arg_buffer)
+	{
+		mFrameBuffer = arg_buffer;
+		if (mPPU != nullptr)
+			mPPU->SetFrameBuffer(arg_buffer);
+	}
+
+	void NES::SetRenderThreads(int arg_count)
+	{
+		mRenderThreads = arg_count;
+		if (mPPU != nullptr)
+			mPPU->SetRenderThreads(arg_count);
+	}
+
+	void NES::SetAudioDevice(bool arg_enabled)
+	{
+		mAudioDevice = arg_enabled;
+		if (mAPU != nullptr)
+			mAPU->SetAudioDevice(arg_enabled);
+	}
+
+	size_t NES::ReadAudioSamples(int16_t* out_samples, size_t arg_maxCount)
+	{
+		return mAPU->ReadSamples(out_samples, arg_maxCount);
+	}
+
+	uint64_t NES::GetAudioHash() const
+	{
+		return mAPU->GetAudioHash();
+	}
+
+	void NES::WaitForFrame()
+	{
+		if (mPPU != nullptr)
+			mPPU->WaitForFrame();
+	}
+
+	const uint64_t* NES::GetDirtyScanlines()
+	{
+		static const uint64_t allDirty[PPU_DIRTY_WORDS] = { ~0ull, ~0ull, ~0ull, ~0ull };
+		if (mPPU == nullptr)
+			return allDirty;
+
+		mPPU->WaitForFrame();
+		return mPPU->GetDirtyScanlines();
+	}
+
+	void NES::ConvertFrame(const ColorImage& out_image)
+	{
+		if (mPPU == nullptr || mFrameBuffer == nullptr)
+			return;
+
+		mPPU->WaitForFrame();
+		mPaletteConverter.Convert(mFrameBuffer, PPU_SCREEN_WIDTH, mPPU->GetScanlineColorBits(), PPU_SCREEN_WIDTH, PPU_SCREEN_HEIGHT, out_image);
+	}
+
+	void NES::FilterFrameNTSC(uint8_t* out_rgba, int arg_stride)
+	{
+		if (mPPU == nullptr || mFrameBuffer == nullptr)
+			return;
+
+		// Odd frames skip a dot when rendering, so the subcarrier phase alternates between frames
+		mPPU->WaitForFrame();
+		mNTSCFilter.Filter(mFrameBuffer, PPU_SCREEN_WIDTH, mPPU->GetScanlineColorBits(), PPU_SCREEN_HEIGHT,
+			(int)(mPPU->GetFrameCount() & 1), out_rgba, arg_stride);
+	}
+
+	void NES::UpscaleFrame(UpscaleFilter arg_filter, uint8_t* out_rgba, int arg_stride)
+	{
+		if (mPPU == nullptr || mFrameBuffer == nullptr)
+			return;
+
+		mColorFrame.resize(PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT * 4);
+		ColorImage image;
+		image.mPlanes[0] = mColorFrame.data();
+		image.mStrides[0] = PPU_SCREEN_WIDTH * 4;
+		ConvertFrame(image);
+		mUpscaler.Scale(arg_filter, mColorFrame.data(), PPU_SCREEN_WIDTH * 4, PPU_SCREEN_WIDTH, PPU_SCREEN_HEIGHT, out_rgba, arg_stride);
+	}
+
+	void NES::PushObservationFrame()
+	{
+		if (mPPU == nullptr || mFrameBuffer == nullptr)
+			return;
+
+		mPPU->WaitForFrame();
+		mObservationBuilder.PushFrame(mFrameBuffer, PPU_SCREEN_WIDTH, mPPU->GetScanlineColorBits());
+	}
+
+	void NES::PrintRenderBenchmark()
+	{
+		const int scanlines = 100000;
+		const char* pathNames[] = { "Reference", "Scalar", "SSE2", "AVX2", "Cached", "Layer" };
+		for (int path = BackgroundRenderPath::BackgroundReference; path <= BackgroundRenderPath::BackgroundLayer; path++)
+		{
+			const BackgroundRenderPath renderPath = (BackgroundRenderPath)path;
+			std::cout << "Background " << pathNames[path] << ": ";
+			if (PPU::IsBackgroundRenderPathSupported(renderPath))
+				std::cout << mPPU->BenchmarkBackground(renderPath, scanlines) << " ns/scanline" << std::endl;
+			else
+				std::cout << "not compiled in" << std::endl;
+		}
+
+		const FrameRenderStats& frameStats = mPPU->GetFrameRenderStats();
+		std::cout << "Frames rendered at once: " << frameStats.mFrameAtOnceFrames << ", per scanline: " << frameStats.mScanlineFrames
+			<< ", skipped: " << frameStats.mSkippedFrames << std::endl;
+
+		const TileCacheStats& stats = mPPU->GetTileCacheStats();
+		const uint64_t lookups = stats.mHits + stats.mMisses;
+		std::cout << "Tile cache: " << stats.mHits << " hits, " << stats.mMisses << " misses";
+		if (lookups > 0)
+			std::cout << " (" << (100.0 * stats.mHits / lookups) << "% hit rate)";
+		std::cout << std::endl;
+
+		std::cout << "Audio: " << mAPU->GetAudioSampleCount() << " samples, hash " << std::hex << mAPU->GetAudioHash() << std::dec << std::endl;
 	}
 
 	bool NES::IsRunning()
@@ -4,9 +4,18 @@
 #include "memory.h"
 #include "cpu.h"
 #include "rom.h"
+#include <chrono>
 #include <string>
+#include <vector>
 #include "apu.h"
 #include "ppu.h"
+#include "palette.h"
+#include "ntsc.h"
+#include "upscaler.h"
+#include "observation.h"
+
+// Update checks the pacing once this many CPU cycles have run (about 0.56ms): sleeps only matter at that scale
+#define NES_PACING_CYCLES		1000
 
 namespace nesemu
 {
@@ -20,15 +29,103 @@ namespace nesemu
 		ROM* mROM = nullptr;
 		std::string mCurrentROM;
 		bool mIsRunning = false;
+		uint8_t* mFrameBuffer = nullptr;
+		int mRenderThreads = 0;
+		bool mAudioDevice = true;
+		PaletteConverter mPaletteConverter;
+		NTSCFilter mNTSCFilter;
+		Upscaler mUpscaler;
+		ObservationBuilder mObservationBuilder;
+		std::vector<uint8_t> mColorFrame;
+
+		bool mNMIPending = false; // set by the PPU, taken between instructions
+		bool mIRQLine = false; // the APU's IRQ output, as of its last catch-up
+
+		uint64_t mLastPaceCycle = 0;
+
+		// Wall clock pacing, without audio
+		std::chrono::steady_clock::time_point mPaceStart;
+		uint64_t mPaceStartCycle = 0;
 
-		int mTimeLastDelay = 0;
-		int mCycleCounter = 0;
+		// Runs one instruction, and synchronises the peripherals when an event is due. False if no cycles passed.
+		bool Step();
 
 	public:
 		NES();
 		void SetROM(const char* arg_file);
 		void Start();
 		void Update();
+
+		/**
+		* Runs until the next vblank without pacing to real time, for bulk simulation.
+		* With arg_render false, the frame's pixels aren't drawn (see PPU::SetSkipRendering), but
+		* everything the game can observe keeps its exact timing. The frame buffer keeps the last drawn frame.
+		* @return False if the ROM isn't running or the CPU is stuck on an unknown opcode.
+		**/
+		bool RunFrame(bool arg_render);
+
+		/**
+		* Sets the buffer that the PPU renders frames into: 256x240 bytes, one palette index (0-63) per pixel.
+		**/
+		void SetFrameBuffer(uint8_t* arg_buffer);
+
+		/**
+		* Renders frames on worker threads while the next frame is emulated (see PPU::SetRenderThreads).
+		* Call WaitForFrame before reading the frame buffer.
+		**/
+		void SetRenderThreads(int arg_count);
+		void WaitForFrame();
+
+		/**
+		* Whether to play audio on the audio device (true by default); call before Start. Headless and
+		* fast-forward runs can turn it off and take the samples with ReadAudioSamples instead (see APU::SetAudioDevice).
+		**/
+		void SetAudioDevice(bool arg_enabled);
+		size_t ReadAudioSamples(int16_t* out_samples, size_t arg_maxCount);
+
+		/**
+		* Hash of the audio so far (see APU::GetAudioHash), which only depends on the emulated cycles.
+		**/
+		uint64_t GetAudioHash() const;
+
+		/**
+		* Bitmap of the last frame's scanlines that changed since the frame before (see PPU::GetDirtyScanlines).
+		* Consumers can skip the other rows.
+		**/
+		const uint64_t* GetDirtyScanlines();
+
+		/**
+		* Converts the last frame in the frame buffer to colors, in the format of the given image.
+		* Consumers that want palette indices can read the frame buffer directly instead.
+		**/
+		void ConvertFrame(const ColorImage& out_image);
+		inline PaletteConverter& GetPaletteConverter() { return mPaletteConverter; }
+
+		/**
+		* Filters the last frame through the NTSC composite filter: NTSC_OUTPUT_WIDTH x 240 RGBA8888 pixels.
+		**/
+		void FilterFrameNTSC(uint8_t* out_rgba, int arg_stride);
+		inline NTSCFilter& GetNTSCFilter() { return mNTSCFilter; }
+
+		/**
+		* Converts the last frame to RGBA8888 and upscales it: Upscaler::GetScaleFactor times 256x240 pixels.
+		* Doesn't need a window, so it can feed a capture pipeline directly.
+		**/
+		void UpscaleFrame(UpscaleFilter arg_filter, uint8_t* out_rgba, int arg_stride);
+		inline Upscaler& GetUpscaler() { return mUpscaler; }
+
+		/**
+		* Adds the last frame to the observation builder, straight from the palette indices.
+		* With frameskip, push the last two rendered frames of each step, then build the observation.
+		**/
+		void PushObservationFrame();
+		inline ObservationBuilder& GetObservationBuilder() { return mObservationBuilder; }
+
+		/**
+		* Prints the time per scanline of each background render path, using the current PPU state,
+		* how many frames were rendered at once, and the audio hash.
+		**/
+		void PrintRenderBenchmark();
 		bool IsRunning();
 
 	};
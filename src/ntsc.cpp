@@ -0,0 +1,228 @@
+#include "ntsc.h"
+
+#include "ppu.h"
+#include "simd.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+namespace nesemu
+{
+	// Kernels and the scanline accumulator are RGB * 255 with 5 fractional bits
+	static const int KernelShift = 5;
+	static const int KernelSize = NTSC_KERNEL_PIXELS * 4;
+
+	// Output pixels before the first input pixel's centre
+	static const int OutputMargin = 2;
+
+	// Output pixels the accumulator needs room for: 86 groups of 3 input pixels (7 output pixels each) plus a kernel
+	static const int AccumulatorPixels = 7 * 86 + NTSC_KERNEL_PIXELS;
+
+	// Composite levels, relative to sync (nesdev wiki). Colors $xE and $xF use level 1.
+	static const float SignalLow[4] = { 0.350f, 0.518f, 0.962f, 1.550f };
+	static const float SignalHigh[4] = { 1.094f, 1.506f, 1.962f, 1.962f };
+	static const float SignalBlack = 0.518f;
+	static const float SignalWhite = 1.962f;
+	static const float EmphasisAttenuation = 0.746f;
+
+	// Demodulator hue and saturation, fitted against the default palette
+	static const float DecoderHue = 3.9f;
+	static const float DecoderSaturation = 1.3f;
+
+	// Composite voltage (0 = black, 1 = white) of a color at one of the 12 subcarrier phases
+	static float GetSignal(int arg_color, int arg_emphasis, int arg_phase)
+	{
+		const int hue = arg_color & 0x0F;
+		const int level = hue > 13 ? 1 : (arg_color >> 4) & 0x03;
+		float low = SignalLow[level];
+		float high = SignalHigh[level];
+		if (hue == 0)
+			low = high;
+		if (hue > 12)
+			high = low;
+
+		auto inColorPhase = [arg_phase](int arg_hue) { return (arg_hue + arg_phase) % 12 < 6; };
+		float signal = inColorPhase(hue) ? high : low;
+		if (((arg_emphasis & 0x01) && inColorPhase(0)) || ((arg_emphasis & 0x02) && inColorPhase(4)) || ((arg_emphasis & 0x04) && inColorPhase(8)))
+			signal *= EmphasisAttenuation;
+		return (signal - SignalBlack) / (SignalWhite - SignalBlack);
+	}
+
+	// First composite sample of the 12 sample (one color cycle) decoding window of an output pixel
+	static int GetWindowStart(int arg_output)
+	{
+		const float centre = (arg_output - OutputMargin + 0.5f) * 24.0f / 7.0f;
+		return (int)floorf(centre - 5.5f);
+	}
+
+	NTSCFilter::NTSCFilter()
+	{
+		BuildKernels();
+	}
+
+	void NTSCFilter::SetArtifactStrength(float arg_strength)
+	{
+		mArtifactStrength = std::min(std::max(arg_strength, 0.0f), 1.0f);
+		BuildKernels();
+	}
+
+	void NTSCFilter::SetThreads(int arg_threads)
+	{
+		mWorkers.SetThreads(std::max(arg_threads, 1));
+	}
+
+	float NTSCFilter::GetLuma(int arg_color, int arg_emphasis)
+	{
+		float luma = 0.0f;
+		for (int phase = 0; phase < 12; phase++)
+			luma += GetSignal(arg_color & 0x3F, arg_emphasis & 0x07, phase);
+		return luma / 12.0f;
+	}
+
+	const int16_t* NTSCFilter::GetKernel(int arg_linePhase, int arg_position, int arg_color) const
+	{
+		return &mKernels[((arg_linePhase * 3 + arg_position) * 512 + arg_color) * KernelSize];
+	}
+
+	void NTSCFilter::BuildKernels()
+	{
+		mKernels.assign(3 * 3 * 512 * KernelSize, 0);
+
+		for (int position = 0; position < 3; position++)
+		{
+			// Measured on the second group, so the windows reaching back into the first are included
+			const int firstSample = (3 + position) * NTSC_SAMPLES_PER_PIXEL;
+			int firstOutput = 0;
+			while (GetWindowStart(firstOutput) + 12 <= firstSample)
+				firstOutput++;
+			mKernelStart[position] = firstOutput - 7;
+
+			for (int linePhase = 0; linePhase < 3; linePhase++)
+			{
+				for (int color = 0; color < 512; color++)
+				{
+					int16_t* kernel = &mKernels[((linePhase * 3 + position) * 512 + color) * KernelSize];
+					for (int output = 0; output < NTSC_KERNEL_PIXELS; output++)
+					{
+						// Sums of this pixel's samples over the output pixel's windows
+						const int windowStart = GetWindowStart(firstOutput + output);
+						float luma = 0.0f, lumaNarrow = 0.0f, i = 0.0f, q = 0.0f;
+						for (int sample = 0; sample < NTSC_SAMPLES_PER_PIXEL; sample++)
+						{
+							const int offset = firstSample + sample - windowStart;
+							if (offset < 0 || offset >= 12)
+								continue;
+							// Each scanline starts 4 phases (341 * 8 samples) after the previous one
+							const int phase = (linePhase * 4 + position * NTSC_SAMPLES_PER_PIXEL + sample) % 12;
+							const float signal = GetSignal(color & 0x3F, color >> 6, phase) / 12.0f;
+							luma += signal;
+							if (offset >= 4 && offset < 8)
+								lumaNarrow += signal * 3.0f;
+							i += signal * cosf(3.14159265f * (phase + DecoderHue) / 6.0f) * DecoderSaturation;
+							q += signal * sinf(3.14159265f * (phase + DecoderHue) / 6.0f) * DecoderSaturation;
+						}
+
+						// The narrow window lets chroma leak into luma: dot crawl and fringes
+						const float y = luma + (lumaNarrow - luma) * mArtifactStrength;
+						const float rgb[3] =
+						{
+							y + 0.946882f * i + 0.623557f * q,
+							y - 0.274788f * i - 0.635691f * q,
+							y - 1.108545f * i + 1.709007f * q
+						};
+						for (int channel = 0; channel < 3; channel++)
+							kernel[output * 4 + channel] = (int16_t)lrintf(rgb[channel] * (255 << KernelShift));
+					}
+				}
+			}
+		}
+	}
+
+	void NTSCFilter::Filter(const uint8_t* arg_indices, int arg_indexStride, const uint8_t* arg_colorBits, int arg_height,
+		int arg_framePhase, uint8_t* out_rgba, int arg_outStride) const
+	{
+		// Bands of at least 16 rows
+		mWorkers.Run(std::max(arg_height / 16, 1), [&](int arg_band, int arg_bands)
+		{
+			FilterRows(arg_indices, arg_indexStride, arg_colorBits, arg_height * arg_band / arg_bands,
+				arg_height * (arg_band + 1) / arg_bands, arg_framePhase, out_rgba, arg_outStride);
+		});
+	}
+
+	void NTSCFilter::FilterRows(const uint8_t* arg_indices, int arg_indexStride, const uint8_t* arg_colorBits,
+		int arg_firstRow, int arg_lastRow, int arg_framePhase, uint8_t* out_rgba, int arg_outStride) const
+	{
+		alignas(32) int16_t accumulator[AccumulatorPixels * 4];
+
+		for (int row = arg_firstRow; row < arg_lastRow; row++)
+		{
+			const uint8_t* indices = arg_indices + row * arg_indexStride;
+			const uint8_t colorBits = arg_colorBits != nullptr ? arg_colorBits[row] : 0;
+			const int offset = ((colorBits & PPUMASK_EMPHASIS) >> 5) << 6;
+			const uint8_t mask = (colorBits & PPUMASK_GRAYSCALE) ? 0x30 : 0x3F;
+			const int linePhase = (arg_framePhase + row) % 3;
+
+			// Kernels of neighbouring pixels overlap. Adding every sixth pixel per pass keeps each add
+			// independent of the stores just before it, which would otherwise stall store forwarding.
+			memset(accumulator, 0, sizeof(accumulator));
+			for (int pass = 0; pass < 6; pass++)
+			{
+				const int position = pass % 3;
+				for (int x = pass; x < 256; x += 6)
+				{
+					const int16_t* kernel = GetKernel(linePhase, position, offset | (indices[x] & mask));
+					int16_t* dest = accumulator + ((x / 3) * 7 + mKernelStart[position]) * 4;
+#if defined(NESEMU_AVX2)
+					for (int i = 0; i < KernelSize; i += 16)
+					{
+						const __m256i sum = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(dest + i)), _mm256_loadu_si256((const __m256i*)(kernel + i)));
+						_mm256_storeu_si256((__m256i*)(dest + i), sum);
+					}
+#elif defined(NESEMU_SSE2)
+					for (int i = 0; i < KernelSize; i += 8)
+					{
+						const __m128i sum = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(dest + i)), _mm_loadu_si128((const __m128i*)(kernel + i)));
+						_mm_storeu_si128((__m128i*)(dest + i), sum);
+					}
+#else
+					for (int i = 0; i < KernelSize; i++)
+						dest[i] += kernel[i];
+#endif
+				}
+			}
+
+			// Round, clamp and pack to RGBA8888
+			uint8_t* dest = out_rgba + row * arg_outStride;
+			int output = 0;
+#if defined(NESEMU_AVX2)
+			const __m256i rounding = _mm256_set1_epi16(1 << (KernelShift - 1));
+			const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+			for (; output + 8 <= NTSC_OUTPUT_WIDTH; output += 8)
+			{
+				const __m256i low = _mm256_srai_epi16(_mm256_add_epi16(_mm256_load_si256((const __m256i*)(accumulator + output * 4)), rounding), KernelShift);
+				const __m256i high = _mm256_srai_epi16(_mm256_add_epi16(_mm256_load_si256((const __m256i*)(accumulator + output * 4 + 16)), rounding), KernelShift);
+				const __m256i pixels = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+				_mm256_storeu_si256((__m256i*)(dest + output * 4), _mm256_or_si256(pixels, alpha));
+			}
+#elif defined(NESEMU_SSE2)
+			const __m128i rounding = _mm_set1_epi16(1 << (KernelShift - 1));
+			const __m128i alpha = _mm_set1_epi32(0xFF000000);
+			for (; output + 4 <= NTSC_OUTPUT_WIDTH; output += 4)
+			{
+				const __m128i low = _mm_srai_epi16(_mm_add_epi16(_mm_load_si128((const __m128i*)(accumulator + output * 4)), rounding), KernelShift);
+				const __m128i high = _mm_srai_epi16(_mm_add_epi16(_mm_load_si128((const __m128i*)(accumulator + output * 4 + 8)), rounding), KernelShift);
+				_mm_storeu_si128((__m128i*)(dest + output * 4), _mm_or_si128(_mm_packus_epi16(low, high), alpha));
+			}
+#endif
+			for (; output < NTSC_OUTPUT_WIDTH; output++)
+			{
+				for (int channel = 0; channel < 3; channel++)
+				{
+					const int value = (accumulator[output * 4 + channel] + (1 << (KernelShift - 1))) >> KernelShift;
+					dest[output * 4 + channel] = (uint8_t)std::min(std::max(value, 0), 255);
+				}
+				dest[output * 4 + 3] = 0xFF;
+			}
+		}
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef NESEMU_NTSC_H
+#define NESEMU_NTSC_H
+
+#include <stdint.h>
+#include <vector>
+#include "bandworkers.h"
+
+// 8 composite samples per PPU pixel (2048 per scanline), 7 output pixels per 24 samples
+#define NTSC_OUTPUT_WIDTH		602
+#define NTSC_SAMPLES_PER_PIXEL	8
+#define NTSC_KERNEL_PIXELS		8 // output pixels a single input pixel can reach
+
+namespace nesemu
+{
+	/**
+	* NTSC composite video filter for the PPU's palette index frame buffer.
+	* https://wiki.nesdev.com/w/index.php/NTSC_video
+	*
+	* Every pixel's composite waveform (square wave between two voltage levels, 12 phases per color cycle)
+	* is decoded into YIQ with box filters a color cycle wide, then converted to RGB.
+	* The decoder is linear, so the contribution of each (color, phase, position) to the nearby output pixels
+	* is precomputed into a kernel, and a scanline is filtered by adding up one kernel per input pixel.
+	**/
+	class NTSCFilter
+	{
+	private:
+		float mArtifactStrength = 0.5f;
+		mutable BandWorkers mWorkers;
+
+		// [line phase (3)][pixel position in a 3 pixel group][emphasis * 64 + color][output pixel][R, G, B, 0]
+		// in fixed point, see ntsc.cpp
+		std::vector<int16_t> mKernels;
+		int mKernelStart[3]; // first output pixel of each position, relative to the group
+
+		void BuildKernels();
+		const int16_t* GetKernel(int arg_linePhase, int arg_position, int arg_color) const;
+		void FilterRows(const uint8_t* arg_indices, int arg_indexStride, const uint8_t* arg_colorBits,
+			int arg_firstRow, int arg_lastRow, int arg_framePhase, uint8_t* out_rgba, int arg_outStride) const;
+
+	public:
+		NTSCFilter();
+
+		/**
+		* How much luma/chroma crosstalk (dot crawl, color fringes) to keep: 0 = none, 1 = strong.
+		**/
+		void SetArtifactStrength(float arg_strength);
+
+		/**
+		* Splits frames into bands of rows, filtered on this many threads (kept running between frames).
+		**/
+		void SetThreads(int arg_threads);
+
+		/**
+		* Average composite level of a color over a color cycle (0 = black, 1 = white, can exceed 1).
+		* This is the brightness the TV decodes, independent of any RGB palette.
+		**/
+		static float GetLuma(int arg_color, int arg_emphasis);
+
+		/**
+		* Filters an image of palette indices (256 wide) into NTSC_OUTPUT_WIDTH x arg_height RGBA8888 pixels.
+		* @param arg_colorBits The $2001 value of each row (grayscale and emphasis bits), or nullptr for none.
+		* @param arg_framePhase Color subcarrier phase of the frame (0-2). Alternating it gives the NES's dot crawl.
+		**/
+		void Filter(const uint8_t* arg_indices, int arg_indexStride, const uint8_t* arg_colorBits, int arg_height,
+			int arg_framePhase, uint8_t* out_rgba, int arg_outStride) const;
+	};
+}
+
+#endif
@@ -0,0 +1,351 @@
+#include "observation.h"
+
+#include "ntsc.h"
+#include "palette.h"
+#include "ppu.h"
+#include "simd.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+namespace nesemu
+{
+	// Weights of a source row/column are out of 4096, which fits pmaddwd's int16 operands.
+	// Vertical sums are scaled back to 7 fractional bits (255 * 128 fits int16), so the
+	// horizontal pass can use pmaddwd too: outputs are luma * 2^19.
+	static const int WeightBits = 12;
+	static const int WeightTotal = 1 << WeightBits;
+	static const int SumShift = WeightBits - 7;
+	static const int OutputShift = 7 + WeightBits;
+
+	static inline void StoreValue(int32_t arg_sum, uint8_t* out_value)
+	{
+		*out_value = (uint8_t)((arg_sum + (1 << (OutputShift - 1))) >> OutputShift);
+	}
+
+	static inline void StoreValue(int32_t arg_sum, float* out_value)
+	{
+		*out_value = arg_sum * (1.0f / ((float)(1 << OutputShift) * 255.0f));
+	}
+
+#ifdef NESEMU_SSE2
+	static inline __m128i LoadColumnPair(const int16_t* arg_sums)
+	{
+		int32_t pair;
+		memcpy(&pair, arg_sums, sizeof(pair));
+		return _mm_cvtsi32_si128(pair);
+	}
+
+	static inline void StoreValues(__m128i arg_sums, uint8_t* out_values)
+	{
+		const __m128i rounded = _mm_srai_epi32(_mm_add_epi32(arg_sums, _mm_set1_epi32(1 << (OutputShift - 1))), OutputShift);
+		const __m128i words = _mm_packs_epi32(rounded, rounded);
+		const int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+		memcpy(out_values, &bytes, sizeof(bytes));
+	}
+
+	static inline void StoreValues(__m128i arg_sums, float* out_values)
+	{
+		_mm_storeu_ps(out_values, _mm_mul_ps(_mm_cvtepi32_ps(arg_sums), _mm_set1_ps(1.0f / ((float)(1 << OutputShift) * 255.0f))));
+	}
+#endif
+
+	ObservationBuilder::ObservationBuilder()
+	{
+		SetPalette(PaletteConverter());
+		for (int emphasis = 0; emphasis < 8; emphasis++)
+		{
+			for (int color = 0; color < 64; color++)
+			{
+				const float luma = std::min(std::max(NTSCFilter::GetLuma(color, emphasis), 0.0f), 1.0f);
+				mPaletteLumaLUT[(emphasis << 6) | color] = (uint8_t)lrintf(luma * 255.0f);
+			}
+		}
+
+		mFrames[0].resize(PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT);
+		mFrames[1].resize(PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT);
+		mPooled.resize(PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT);
+		SetSize(mWidth, mHeight);
+	}
+
+	void ObservationBuilder::SetSize(int arg_width, int arg_height)
+	{
+		mWidth = std::min(std::max(arg_width, 1), PPU_SCREEN_WIDTH);
+		mHeight = std::min(std::max(arg_height, 1), PPU_SCREEN_HEIGHT);
+		mMaxRowTaps = BuildTaps(PPU_SCREEN_HEIGHT, mHeight, mRowTaps, mRowWeights);
+
+		std::vector<uint16_t> columnWeights;
+		const int columnTaps = BuildTaps(PPU_SCREEN_WIDTH, mWidth, mColumnTaps, columnWeights);
+		mColumnPairs = (columnTaps + 1) / 2;
+		mPaddedWidth = (mWidth + 3) & ~3;
+		mColumnTaps.resize(mPaddedWidth, Taps{ 0, 0 });
+		mColumnWeightPairs.assign(mColumnPairs * mPaddedWidth, 0);
+		for (int x = 0; x < mWidth; x++)
+		{
+			for (int tap = 0; tap < columnTaps; tap++)
+			{
+				int32_t& pair = mColumnWeightPairs[(tap / 2) * mPaddedWidth + x];
+				pair |= columnWeights[x * columnTaps + tap] << ((tap & 1) * 16);
+			}
+		}
+		Reset();
+	}
+
+	void ObservationBuilder::SetMode(ObservationMode arg_mode)
+	{
+		mMode = arg_mode;
+	}
+
+	void ObservationBuilder::SetPalette(const PaletteConverter& arg_palette)
+	{
+		for (int emphasis = 0; emphasis < 8; emphasis++)
+		{
+			for (int color = 0; color < 64; color++)
+			{
+				const uint32_t rgba = arg_palette.GetColor(color, emphasis);
+				const int r = rgba & 0xFF;
+				const int g = (rgba >> 8) & 0xFF;
+				const int b = (rgba >> 16) & 0xFF;
+				mGrayscaleLUT[(emphasis << 6) | color] = (uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8);
+			}
+		}
+	}
+
+	void ObservationBuilder::SetMaxPooling(bool arg_enabled)
+	{
+		mMaxPooling = arg_enabled;
+	}
+
+	void ObservationBuilder::Reset()
+	{
+		mFrameCount = 0;
+	}
+
+	int ObservationBuilder::BuildTaps(int arg_source, int arg_dest, std::vector<Taps>& out_taps, std::vector<uint16_t>& out_weights)
+	{
+		// Positions in units of 1/arg_dest source pixels: source pixel i covers [i * dest, (i + 1) * dest),
+		// output pixel o covers [o * source, (o + 1) * source)
+		const int maxTaps = (arg_source + arg_dest - 1) / arg_dest + 1;
+		out_taps.resize(arg_dest);
+		out_weights.assign(arg_dest * maxTaps, 0);
+		for (int output = 0; output < arg_dest; output++)
+		{
+			const int start = output * arg_source;
+			const int end = start + arg_source;
+			Taps& taps = out_taps[output];
+			taps.mFirst = start / arg_dest;
+			taps.mCount = (end - 1) / arg_dest - taps.mFirst + 1;
+
+			uint16_t* weights = &out_weights[output * maxTaps];
+			int total = 0;
+			int largest = 0;
+			for (int tap = 0; tap < taps.mCount; tap++)
+			{
+				const int pixel = taps.mFirst + tap;
+				const int overlap = std::min(end, (pixel + 1) * arg_dest) - std::max(start, pixel * arg_dest);
+				weights[tap] = (uint16_t)((overlap * WeightTotal + arg_source / 2) / arg_source);
+				total += weights[tap];
+				if (weights[tap] > weights[largest])
+					largest = tap;
+			}
+			// Rounding error goes to the largest weight, so a flat area stays exactly flat
+			weights[largest] = (uint16_t)(weights[largest] + WeightTotal - total);
+		}
+		return maxTaps;
+	}
+
+	void ObservationBuilder::PushFrame(const uint8_t* arg_indices, int arg_indexStride, const uint8_t* arg_colorBits)
+	{
+		mCurrentFrame ^= 1;
+		mFrameCount = std::min(mFrameCount + 1, 2);
+		uint8_t* dest = mFrames[mCurrentFrame].data();
+		const uint8_t* previous = mFrames[mCurrentFrame ^ 1].data();
+
+		// The row's 64 entries: its emphasis copy of the LUT, with grayscale forcing the gray column.
+		// Only rebuilt when the color bits change, which is rare within a frame.
+		const uint8_t* lut = mMode == ObservationMode::ObservationPaletteLuma ? mPaletteLumaLUT : mGrayscaleLUT;
+		alignas(16) uint8_t table[64];
+		int tableBits = -1;
+		for (int y = 0; y < PPU_SCREEN_HEIGHT; y++)
+		{
+			const uint8_t colorBits = arg_colorBits != nullptr ? arg_colorBits[y] : 0;
+			if (colorBits != tableBits)
+			{
+				const uint8_t* rowLUT = lut + (((colorBits & PPUMASK_EMPHASIS) >> 5) << 6);
+				const uint8_t mask = (colorBits & PPUMASK_GRAYSCALE) ? 0x30 : 0x3F;
+				for (int index = 0; index < 64; index++)
+					table[index] = rowLUT[index & mask];
+				tableBits = colorBits;
+			}
+
+			const int offset = y * PPU_SCREEN_WIDTH;
+			MapRow(arg_indices + y * arg_indexStride, table, dest + offset);
+
+			// Maximum with the previous frame (the first frame is pooled with itself)
+			const uint8_t* other = mFrameCount > 1 ? previous + offset : dest + offset;
+			uint8_t* pooled = mPooled.data() + offset;
+			int x = 0;
+#ifdef NESEMU_SSE2
+			for (; x < PPU_SCREEN_WIDTH; x += 16)
+			{
+				const __m128i maximum = _mm_max_epu8(_mm_loadu_si128((const __m128i*)(dest + offset + x)), _mm_loadu_si128((const __m128i*)(other + x)));
+				_mm_storeu_si128((__m128i*)(pooled + x), maximum);
+			}
+#endif
+			for (; x < PPU_SCREEN_WIDTH; x++)
+				pooled[x] = std::max(dest[offset + x], other[x]);
+		}
+	}
+
+	void ObservationBuilder::MapRow(const uint8_t* arg_indices, const uint8_t* arg_table, uint8_t* out_dest)
+	{
+		int x = 0;
+#if defined(NESEMU_AVX2)
+		// Each quarter of the table is looked up with indices relative to it. Adding 0x70 with unsigned
+		// saturation sets bit 7 (which makes pshufb return 0) for indices outside of the quarter.
+		const __m256i outside = _mm256_set1_epi8(0x70);
+		for (; x + 32 <= PPU_SCREEN_WIDTH; x += 32)
+		{
+			const __m256i indices = _mm256_loadu_si256((const __m256i*)(arg_indices + x));
+			__m256i result = _mm256_setzero_si256();
+			for (int quarter = 0; quarter < 4; quarter++)
+			{
+				const __m256i entries = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)(arg_table + quarter * 16)));
+				const __m256i relative = _mm256_adds_epu8(_mm256_sub_epi8(indices, _mm256_set1_epi8((char)(quarter * 16))), outside);
+				result = _mm256_or_si256(result, _mm256_shuffle_epi8(entries, relative));
+			}
+			_mm256_storeu_si256((__m256i*)(out_dest + x), result);
+		}
+#elif defined(NESEMU_SSSE3)
+		const __m128i outside = _mm_set1_epi8(0x70);
+		for (; x + 16 <= PPU_SCREEN_WIDTH; x += 16)
+		{
+			const __m128i indices = _mm_loadu_si128((const __m128i*)(arg_indices + x));
+			__m128i result = _mm_setzero_si128();
+			for (int quarter = 0; quarter < 4; quarter++)
+			{
+				const __m128i entries = _mm_load_si128((const __m128i*)(arg_table + quarter * 16));
+				const __m128i relative = _mm_adds_epu8(_mm_sub_epi8(indices, _mm_set1_epi8((char)(quarter * 16))), outside);
+				result = _mm_or_si128(result, _mm_shuffle_epi8(entries, relative));
+			}
+			_mm_storeu_si128((__m128i*)(out_dest + x), result);
+		}
+#endif
+		for (; x < PPU_SCREEN_WIDTH; x++)
+		{
+			out_dest[x] = arg_table[arg_indices[x] & 0x3F];
+		}
+	}
+
+	void ObservationBuilder::SumRows(int arg_row, const uint8_t* arg_luma, int16_t* out_sums) const
+	{
+		// Weighted sum of the source rows an output row covers
+		const Taps& taps = mRowTaps[arg_row];
+		const uint16_t* weights = &mRowWeights[arg_row * mMaxRowTaps];
+		const uint8_t* source = arg_luma + taps.mFirst * PPU_SCREEN_WIDTH;
+
+		int x = 0;
+#ifdef NESEMU_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i rounding = _mm_set1_epi32(1 << (SumShift - 1));
+		for (; x + 16 <= PPU_SCREEN_WIDTH; x += 16)
+		{
+			__m128i sums[4] = { rounding, rounding, rounding, rounding };
+			for (int tap = 0; tap < taps.mCount; tap += 2)
+			{
+				// Two rows interleaved, so each pmaddwd adds both of their weighted pixels
+				const bool single = tap + 1 == taps.mCount;
+				const __m128i first = _mm_loadu_si128((const __m128i*)(source + tap * PPU_SCREEN_WIDTH + x));
+				const __m128i second = single ? zero : _mm_loadu_si128((const __m128i*)(source + (tap + 1) * PPU_SCREEN_WIDTH + x));
+				const __m128i weightPair = _mm_set1_epi32(weights[tap] | ((single ? 0 : weights[tap + 1]) << 16));
+				const __m128i low = _mm_unpacklo_epi8(first, second);
+				const __m128i high = _mm_unpackhi_epi8(first, second);
+				sums[0] = _mm_add_epi32(sums[0], _mm_madd_epi16(_mm_unpacklo_epi8(low, zero), weightPair));
+				sums[1] = _mm_add_epi32(sums[1], _mm_madd_epi16(_mm_unpackhi_epi8(low, zero), weightPair));
+				sums[2] = _mm_add_epi32(sums[2], _mm_madd_epi16(_mm_unpacklo_epi8(high, zero), weightPair));
+				sums[3] = _mm_add_epi32(sums[3], _mm_madd_epi16(_mm_unpackhi_epi8(high, zero), weightPair));
+			}
+			for (int i = 0; i < 4; i += 2)
+			{
+				const __m128i words = _mm_packs_epi32(_mm_srai_epi32(sums[i], SumShift), _mm_srai_epi32(sums[i + 1], SumShift));
+				_mm_storeu_si128((__m128i*)(out_sums + x + i * 4), words);
+			}
+		}
+#endif
+		for (; x < PPU_SCREEN_WIDTH; x++)
+		{
+			int32_t sum = 1 << (SumShift - 1);
+			for (int tap = 0; tap < taps.mCount; tap++)
+				sum += source[tap * PPU_SCREEN_WIDTH + x] * weights[tap];
+			out_sums[x] = (int16_t)(sum >> SumShift);
+		}
+	}
+
+	template <typename T>
+	void ObservationBuilder::BuildTensor(T* out_tensor, int arg_stride) const
+	{
+		uint8_t* dest = (uint8_t*)out_tensor;
+		if (mFrameCount == 0)
+		{
+			for (int y = 0; y < mHeight; y++)
+				std::fill_n((T*)(dest + y * arg_stride), mWidth, (T)0);
+			return;
+		}
+
+		// Column sums, with room for the pairs of the last columns to read past the end
+		const uint8_t* luma = mMaxPooling ? mPooled.data() : mFrames[mCurrentFrame].data();
+		// (at most 258 extra taps, for a 1 pixel wide output)
+		alignas(16) int16_t sums[PPU_SCREEN_WIDTH * 3];
+		memset(sums, 0, sizeof(sums));
+		for (int y = 0; y < mHeight; y++)
+		{
+			SumRows(y, luma, sums);
+
+			T* row = (T*)(dest + y * arg_stride);
+			int x = 0;
+#ifdef NESEMU_SSE2
+			for (; x + 4 <= mWidth; x += 4)
+			{
+				__m128i total = _mm_setzero_si128();
+				for (int pair = 0; pair < mColumnPairs; pair++)
+				{
+					// Adjacent column sums of 4 outputs, loaded as one 32 bit pair each. Assembled in registers:
+					// a 16 byte load of 4 separate stores would stall store forwarding.
+					const __m128i columns[4] =
+					{
+						LoadColumnPair(sums + mColumnTaps[x].mFirst + pair * 2),
+						LoadColumnPair(sums + mColumnTaps[x + 1].mFirst + pair * 2),
+						LoadColumnPair(sums + mColumnTaps[x + 2].mFirst + pair * 2),
+						LoadColumnPair(sums + mColumnTaps[x + 3].mFirst + pair * 2)
+					};
+					const __m128i pairs = _mm_unpacklo_epi64(_mm_unpacklo_epi32(columns[0], columns[1]), _mm_unpacklo_epi32(columns[2], columns[3]));
+					const __m128i weightPairs = _mm_loadu_si128((const __m128i*)&mColumnWeightPairs[pair * mPaddedWidth + x]);
+					total = _mm_add_epi32(total, _mm_madd_epi16(pairs, weightPairs));
+				}
+				StoreValues(total, row + x);
+			}
+#endif
+			for (; x < mWidth; x++)
+			{
+				int32_t total = 0;
+				for (int pair = 0; pair < mColumnPairs; pair++)
+				{
+					const int32_t weightPair = mColumnWeightPairs[pair * mPaddedWidth + x];
+					const int column = mColumnTaps[x].mFirst + pair * 2;
+					total += sums[column] * (weightPair & 0xFFFF) + sums[column + 1] * (weightPair >> 16);
+				}
+				StoreValue(total, row + x);
+			}
+		}
+	}
+
+	void ObservationBuilder::Build(uint8_t* out_tensor, int arg_stride) const
+	{
+		BuildTensor(out_tensor, arg_stride);
+	}
+
+	void ObservationBuilder::Build(float* out_tensor, int arg_stride) const
+	{
+		BuildTensor(out_tensor, arg_stride);
+	}
+}
@@ -0,0 +1,102 @@
+#ifndef NESEMU_OBSERVATION_H
+#define NESEMU_OBSERVATION_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace nesemu
+{
+	class PaletteConverter;
+
+	enum ObservationMode
+	{
+		ObservationGrayscale,	// BT.601 luma of the RGB palette colors
+		ObservationPaletteLuma	// composite luma the PPU outputs for each color, see NTSCFilter::GetLuma
+	};
+
+	/**
+	* Small single channel observations of the PPU's palette index frames, for learning agents.
+	* Frames are mapped to luma as they are pushed. Observations are the per-pixel maximum of the
+	* last two frames (which removes sprite flicker), area averaged down to the output size.
+	**/
+	class ObservationBuilder
+	{
+	private:
+		ObservationMode mMode = ObservationMode::ObservationGrayscale;
+		int mWidth = 84;
+		int mHeight = 84;
+		bool mMaxPooling = true;
+
+		// Indexed by emphasis bits (0-7) * 64 + palette index
+		uint8_t mGrayscaleLUT[512];
+		uint8_t mPaletteLumaLUT[512];
+
+		// Luma of the last two frames (256x240), mFrames[mCurrentFrame] is the latest,
+		// and their per-pixel maximum, updated as frames are pushed
+		std::vector<uint8_t> mFrames[2];
+		std::vector<uint8_t> mPooled;
+		int mCurrentFrame = 0;
+		int mFrameCount = 0;
+
+		// Area averaging weights (sum 4096) of the source rows/columns each output row/column covers
+		struct Taps
+		{
+			int mFirst;
+			int mCount;
+		};
+		std::vector<Taps> mRowTaps;
+		std::vector<Taps> mColumnTaps;
+		std::vector<uint16_t> mRowWeights;
+		int mMaxRowTaps = 0;
+		// Column weights in pairs of adjacent taps (for pmaddwd): [pair][output column, padded to a multiple of 4]
+		std::vector<int32_t> mColumnWeightPairs;
+		int mColumnPairs = 0;
+		int mPaddedWidth = 0;
+
+		static int BuildTaps(int arg_source, int arg_dest, std::vector<Taps>& out_taps, std::vector<uint16_t>& out_weights);
+		static void MapRow(const uint8_t* arg_indices, const uint8_t* arg_table, uint8_t* out_dest);
+		void SumRows(int arg_row, const uint8_t* arg_luma, int16_t* out_sums) const;
+		template <typename T> void BuildTensor(T* out_tensor, int arg_stride) const;
+
+	public:
+		ObservationBuilder();
+
+		/**
+		* Output size in pixels, at most 256x240. Forgets the pushed frames.
+		**/
+		void SetSize(int arg_width, int arg_height);
+		inline int GetWidth() const { return mWidth; }
+		inline int GetHeight() const { return mHeight; }
+
+		/**
+		* Selects the luma mapping. Applies to frames pushed after the change.
+		**/
+		void SetMode(ObservationMode arg_mode);
+		void SetPalette(const PaletteConverter& arg_palette);
+
+		/**
+		* Max-pools the last two frames (on by default). Without it, only the latest frame is used.
+		**/
+		void SetMaxPooling(bool arg_enabled);
+
+		/**
+		* Forgets the pushed frames, e.g. at the start of an episode.
+		**/
+		void Reset();
+
+		/**
+		* Adds a 256x240 palette index frame (the PPU frame buffer).
+		* @param arg_colorBits The $2001 value of each row (grayscale and emphasis bits), or nullptr for none.
+		**/
+		void PushFrame(const uint8_t* arg_indices, int arg_indexStride, const uint8_t* arg_colorBits);
+
+		/**
+		* Writes the observation of the pushed frames into a caller-provided GetWidth() x GetHeight() tensor,
+		* as bytes (0-255) or floats (0-1). Strides are in bytes. Writes black before any frame was pushed.
+		**/
+		void Build(uint8_t* out_tensor, int arg_stride) const;
+		void Build(float* out_tensor, int arg_stride) const;
+	};
+}
+
+#endif
@@ -0,0 +1,323 @@
+#include "palette.h"
+
+#include "ppu.h"
+#include "simd.h"
+#include <algorithm>
+#include <string.h>
+
+namespace nesemu
+{
+	// FCEUX's default 2C02 palette
+	static const uint8_t DefaultPalette[64 * 3] =
+	{
+		0x74, 0x74, 0x74, 0x24, 0x18, 0x8C, 0x00, 0x00, 0xA8, 0x44, 0x00, 0x9C, 0x8C, 0x00, 0x74, 0xA8, 0x00, 0x10, 0xA4, 0x00, 0x00, 0x7C, 0x08, 0x00,
+		0x40, 0x2C, 0x00, 0x00, 0x44, 0x00, 0x00, 0x50, 0x00, 0x00, 0x3C, 0x14, 0x18, 0x3C, 0x5C, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0xBC, 0xBC, 0xBC, 0x00, 0x70, 0xEC, 0x20, 0x38, 0xEC, 0x80, 0x00, 0xF0, 0xBC, 0x00, 0xBC, 0xE4, 0x00, 0x58, 0xD8, 0x28, 0x00, 0xC8, 0x4C, 0x0C,
+		0x88, 0x70, 0x00, 0x00, 0x94, 0x00, 0x00, 0xA8, 0x00, 0x00, 0x90, 0x38, 0x00, 0x80, 0x88, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0xFC, 0xFC, 0xFC, 0x3C, 0xBC, 0xFC, 0x5C, 0x94, 0xFC, 0xCC, 0x88, 0xFC, 0xF4, 0x78, 0xFC, 0xFC, 0x74, 0xB4, 0xFC, 0x74, 0x60, 0xFC, 0x98, 0x38,
+		0xF0, 0xBC, 0x3C, 0x80, 0xD0, 0x10, 0x4C, 0xDC, 0x48, 0x58, 0xF8, 0x98, 0x00, 0xE8, 0xD8, 0x78, 0x78, 0x78, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0xFC, 0xFC, 0xFC, 0xA8, 0xE4, 0xFC, 0xC4, 0xD4, 0xFC, 0xD4, 0xC8, 0xFC, 0xFC, 0xC4, 0xFC, 0xFC, 0xC4, 0xD8, 0xFC, 0xBC, 0xB0, 0xFC, 0xD8, 0xA8,
+		0xFC, 0xE4, 0xA0, 0xE0, 0xFC, 0xA0, 0xA8, 0xF0, 0xBC, 0xB0, 0xFC, 0xCC, 0x9C, 0xFC, 0xF0, 0xC4, 0xC4, 0xC4, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+	};
+
+	// Emphasis dims the other two channels to about 0.816 (209/256)
+	static const int EmphasisAttenuation = 209;
+
+	// The LUTs hold 8 copies of the palette, one per combination of emphasis bits
+	static inline int GetLUTOffset(uint8_t arg_colorBits)
+	{
+		return ((arg_colorBits & PPUMASK_EMPHASIS) >> 5) << 6;
+	}
+
+	// Grayscale forces the palette index to the gray column
+	static inline uint8_t GetIndexMask(uint8_t arg_colorBits)
+	{
+		return (arg_colorBits & PPUMASK_GRAYSCALE) ? 0x30 : 0x3F;
+	}
+
+#ifdef NESEMU_AVX2
+	// LUT entries of 8 indices
+	static inline __m256i Gather8(const uint8_t* arg_indices, const uint32_t* arg_lut, __m256i arg_mask, __m256i arg_offset)
+	{
+		const __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)arg_indices));
+		const __m256i lutIndices = _mm256_or_si256(_mm256_and_si256(indices, arg_mask), arg_offset);
+		return _mm256_i32gather_epi32((const int*)arg_lut, lutIndices, 4);
+	}
+
+	// LUT entries (below 0x10000) of 16 indices, as 16 bit words in order
+	static inline __m256i Gather16(const uint8_t* arg_indices, const uint32_t* arg_lut, __m256i arg_mask, __m256i arg_offset)
+	{
+		const __m256i low = Gather8(arg_indices, arg_lut, arg_mask, arg_offset);
+		const __m256i high = Gather8(arg_indices + 8, arg_lut, arg_mask, arg_offset);
+		return _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xD8);
+	}
+#elif defined(NESEMU_SSSE3)
+	// 16 indices (0-63) made relative to each quarter of a 64 entry table. Adding 0x70 with unsigned saturation
+	// sets bit 7 (which makes pshufb return 0) for indices outside of the quarter.
+	static inline void GetQuarterIndices(__m128i arg_indices, __m128i* out_relative)
+	{
+		const __m128i outside = _mm_set1_epi8(0x70);
+		for (int quarter = 0; quarter < 4; quarter++)
+		{
+			out_relative[quarter] = _mm_adds_epu8(_mm_sub_epi8(arg_indices, _mm_set1_epi8((char)(quarter * 16))), outside);
+		}
+	}
+
+	// Entries of 16 indices in a 64 byte table, a quarter at a time
+	static inline __m128i Lookup16(const __m128i* arg_relative, const uint8_t* arg_table)
+	{
+		__m128i result = _mm_setzero_si128();
+		for (int quarter = 0; quarter < 4; quarter++)
+		{
+			const __m128i entries = _mm_loadu_si128((const __m128i*)(arg_table + quarter * 16));
+			result = _mm_or_si128(result, _mm_shuffle_epi8(entries, arg_relative[quarter]));
+		}
+		return result;
+	}
+#endif
+
+	void PaletteConverter::ColorLUT::Set(int arg_entry, uint32_t arg_color)
+	{
+		mEntries[arg_entry] = arg_color;
+		for (int byte = 0; byte < 4; byte++)
+		{
+			mBytes[byte][arg_entry] = (uint8_t)(arg_color >> (byte * 8));
+		}
+	}
+
+	PaletteConverter::PaletteConverter()
+	{
+		SetPalette(DefaultPalette);
+	}
+
+	void PaletteConverter::SetPalette(const uint8_t* arg_rgb)
+	{
+		for (int emphasis = 0; emphasis < 8; emphasis++)
+		{
+			for (int color = 0; color < 64; color++)
+			{
+				int r = arg_rgb[color * 3];
+				int g = arg_rgb[color * 3 + 1];
+				int b = arg_rgb[color * 3 + 2];
+				if (emphasis & 0x01) // red
+				{
+					g = g * EmphasisAttenuation >> 8;
+					b = b * EmphasisAttenuation >> 8;
+				}
+				if (emphasis & 0x02) // green
+				{
+					r = r * EmphasisAttenuation >> 8;
+					b = b * EmphasisAttenuation >> 8;
+				}
+				if (emphasis & 0x04) // blue
+				{
+					r = r * EmphasisAttenuation >> 8;
+					g = g * EmphasisAttenuation >> 8;
+				}
+
+				const int entry = (emphasis << 6) | color;
+				mRGBA.Set(entry, r | (g << 8) | (b << 16) | 0xFF000000);
+				mBGRA.Set(entry, b | (g << 8) | (r << 16) | 0xFF000000);
+				mRGB565.Set(entry, ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+				mY.Set(entry, 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+				mU.Set(entry, 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8));
+				mV.Set(entry, 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8));
+			}
+		}
+	}
+
+	void PaletteConverter::Convert(const uint8_t* arg_indices, int arg_indexStride, const uint8_t* arg_colorBits,
+		int arg_width, int arg_height, const ColorImage& out_image) const
+	{
+		for (int y = 0; y < arg_height; y++)
+		{
+			const uint8_t* indices = arg_indices + y * arg_indexStride;
+			const uint8_t colorBits = arg_colorBits != nullptr ? arg_colorBits[y] : 0;
+			uint8_t* dest = out_image.mPlanes[0] + y * out_image.mStrides[0];
+			switch (out_image.mFormat)
+			{
+			case ColorFormat::ColorRGBA8888:
+				ConvertRow32(indices, colorBits, mRGBA, arg_width, dest);
+				break;
+			case ColorFormat::ColorBGRA8888:
+				ConvertRow32(indices, colorBits, mBGRA, arg_width, dest);
+				break;
+			case ColorFormat::ColorRGB565:
+				ConvertRow16(indices, colorBits, mRGB565, arg_width, dest);
+				break;
+			case ColorFormat::ColorYUV420:
+				ConvertRow8(indices, colorBits, mY, arg_width, dest);
+				break;
+			}
+		}
+
+		if (out_image.mFormat != ColorFormat::ColorYUV420)
+			return;
+
+		// Chroma of each 2x2 block. An odd last row or column is paired with itself.
+		for (int y = 0; y < arg_height; y += 2)
+		{
+			const int y1 = std::min(y + 1, arg_height - 1);
+			const uint8_t* row0 = arg_indices + y * arg_indexStride;
+			const uint8_t* row1 = arg_indices + y1 * arg_indexStride;
+			const uint8_t colorBits0 = arg_colorBits != nullptr ? arg_colorBits[y] : 0;
+			const uint8_t colorBits1 = arg_colorBits != nullptr ? arg_colorBits[y1] : 0;
+			ConvertChromaRow(row0, colorBits0, row1, colorBits1, mU, arg_width, out_image.mPlanes[1] + (y / 2) * out_image.mStrides[1]);
+			ConvertChromaRow(row0, colorBits0, row1, colorBits1, mV, arg_width, out_image.mPlanes[2] + (y / 2) * out_image.mStrides[2]);
+		}
+	}
+
+	void PaletteConverter::ConvertRow32(const uint8_t* arg_indices, uint8_t arg_colorBits, const ColorLUT& arg_lut, int arg_width, uint8_t* out_dest) const
+	{
+		const int offset = GetLUTOffset(arg_colorBits);
+		const uint8_t mask = GetIndexMask(arg_colorBits);
+		int x = 0;
+#ifdef NESEMU_AVX2
+		const __m256i offsets = _mm256_set1_epi32(offset);
+		const __m256i masks = _mm256_set1_epi32(mask);
+		for (; x + 8 <= arg_width; x += 8)
+		{
+			_mm256_storeu_si256((__m256i*)(out_dest + x * 4), Gather8(arg_indices + x, arg_lut.mEntries, masks, offsets));
+		}
+#elif defined(NESEMU_SSSE3)
+		const __m128i masks = _mm_set1_epi8((char)mask);
+		for (; x + 16 <= arg_width; x += 16)
+		{
+			// One byte of each color at a time, then interleaved into pixels
+			__m128i relative[4];
+			GetQuarterIndices(_mm_and_si128(_mm_loadu_si128((const __m128i*)(arg_indices + x)), masks), relative);
+			const __m128i byte0 = Lookup16(relative, arg_lut.mBytes[0] + offset);
+			const __m128i byte1 = Lookup16(relative, arg_lut.mBytes[1] + offset);
+			const __m128i byte2 = Lookup16(relative, arg_lut.mBytes[2] + offset);
+			const __m128i byte3 = Lookup16(relative, arg_lut.mBytes[3] + offset);
+			const __m128i low01 = _mm_unpacklo_epi8(byte0, byte1);
+			const __m128i high01 = _mm_unpackhi_epi8(byte0, byte1);
+			const __m128i low23 = _mm_unpacklo_epi8(byte2, byte3);
+			const __m128i high23 = _mm_unpackhi_epi8(byte2, byte3);
+			__m128i* dest = (__m128i*)(out_dest + x * 4);
+			_mm_storeu_si128(dest, _mm_unpacklo_epi16(low01, low23));
+			_mm_storeu_si128(dest + 1, _mm_unpackhi_epi16(low01, low23));
+			_mm_storeu_si128(dest + 2, _mm_unpacklo_epi16(high01, high23));
+			_mm_storeu_si128(dest + 3, _mm_unpackhi_epi16(high01, high23));
+		}
+#endif
+		for (; x < arg_width; x++)
+		{
+			const uint32_t color = arg_lut.mEntries[offset | (arg_indices[x] & mask)];
+			memcpy(out_dest + x * 4, &color, sizeof(color));
+		}
+	}
+
+	void PaletteConverter::ConvertRow16(const uint8_t* arg_indices, uint8_t arg_colorBits, const ColorLUT& arg_lut, int arg_width, uint8_t* out_dest) const
+	{
+		const int offset = GetLUTOffset(arg_colorBits);
+		const uint8_t mask = GetIndexMask(arg_colorBits);
+		int x = 0;
+#ifdef NESEMU_AVX2
+		const __m256i offsets = _mm256_set1_epi32(offset);
+		const __m256i masks = _mm256_set1_epi32(mask);
+		for (; x + 16 <= arg_width; x += 16)
+		{
+			_mm256_storeu_si256((__m256i*)(out_dest + x * 2), Gather16(arg_indices + x, arg_lut.mEntries, masks, offsets));
+		}
+#elif defined(NESEMU_SSSE3)
+		const __m128i masks = _mm_set1_epi8((char)mask);
+		for (; x + 16 <= arg_width; x += 16)
+		{
+			__m128i relative[4];
+			GetQuarterIndices(_mm_and_si128(_mm_loadu_si128((const __m128i*)(arg_indices + x)), masks), relative);
+			const __m128i low = Lookup16(relative, arg_lut.mBytes[0] + offset);
+			const __m128i high = Lookup16(relative, arg_lut.mBytes[1] + offset);
+			__m128i* dest = (__m128i*)(out_dest + x * 2);
+			_mm_storeu_si128(dest, _mm_unpacklo_epi8(low, high));
+			_mm_storeu_si128(dest + 1, _mm_unpackhi_epi8(low, high));
+		}
+#endif
+		for (; x < arg_width; x++)
+		{
+			const uint16_t color = (uint16_t)arg_lut.mEntries[offset | (arg_indices[x] & mask)];
+			memcpy(out_dest + x * 2, &color, sizeof(color));
+		}
+	}
+
+	void PaletteConverter::ConvertRow8(const uint8_t* arg_indices, uint8_t arg_colorBits, const ColorLUT& arg_lut, int arg_width, uint8_t* out_dest) const
+	{
+		const int offset = GetLUTOffset(arg_colorBits);
+		const uint8_t mask = GetIndexMask(arg_colorBits);
+		int x = 0;
+#ifdef NESEMU_AVX2
+		const __m256i offsets = _mm256_set1_epi32(offset);
+		const __m256i masks = _mm256_set1_epi32(mask);
+		for (; x + 16 <= arg_width; x += 16)
+		{
+			const __m256i words = Gather16(arg_indices + x, arg_lut.mEntries, masks, offsets);
+			const __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+			_mm_storeu_si128((__m128i*)(out_dest + x), _mm256_castsi256_si128(bytes));
+		}
+#elif defined(NESEMU_SSSE3)
+		const __m128i masks = _mm_set1_epi8((char)mask);
+		for (; x + 16 <= arg_width; x += 16)
+		{
+			__m128i relative[4];
+			GetQuarterIndices(_mm_and_si128(_mm_loadu_si128((const __m128i*)(arg_indices + x)), masks), relative);
+			_mm_storeu_si128((__m128i*)(out_dest + x), Lookup16(relative, arg_lut.mBytes[0] + offset));
+		}
+#endif
+		for (; x < arg_width; x++)
+		{
+			out_dest[x] = (uint8_t)arg_lut.mEntries[offset | (arg_indices[x] & mask)];
+		}
+	}
+
+	void PaletteConverter::ConvertChromaRow(const uint8_t* arg_row0, uint8_t arg_colorBits0, const uint8_t* arg_row1, uint8_t arg_colorBits1,
+		const ColorLUT& arg_lut, int arg_width, uint8_t* out_dest) const
+	{
+		const int offset0 = GetLUTOffset(arg_colorBits0);
+		const int offset1 = GetLUTOffset(arg_colorBits1);
+		const uint8_t mask0 = GetIndexMask(arg_colorBits0);
+		const uint8_t mask1 = GetIndexMask(arg_colorBits1);
+		int x = 0;
+#ifdef NESEMU_AVX2
+		const __m256i offsets0 = _mm256_set1_epi32(offset0);
+		const __m256i offsets1 = _mm256_set1_epi32(offset1);
+		const __m256i masks0 = _mm256_set1_epi32(mask0);
+		const __m256i masks1 = _mm256_set1_epi32(mask1);
+		const __m256i ones = _mm256_set1_epi16(1);
+		const __m256i rounding = _mm256_set1_epi32(2);
+		const __m256i firstDwords = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+		for (; x + 16 <= arg_width; x += 16)
+		{
+			// Add the rows, then adjacent pixels: 8 sums of 4
+			const __m256i sum = _mm256_add_epi16(Gather16(arg_row0 + x, arg_lut.mEntries, masks0, offsets0), Gather16(arg_row1 + x, arg_lut.mEntries, masks1, offsets1));
+			const __m256i average = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(sum, ones), rounding), 2);
+			const __m256i words = _mm256_packus_epi32(average, average);
+			const __m256i bytes = _mm256_packus_epi16(words, words);
+			_mm_storel_epi64((__m128i*)(out_dest + x / 2), _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(bytes, firstDwords)));
+		}
+#elif defined(NESEMU_SSSE3)
+		const __m128i masks0 = _mm_set1_epi8((char)mask0);
+		const __m128i masks1 = _mm_set1_epi8((char)mask1);
+		const __m128i ones = _mm_set1_epi8(1);
+		const __m128i rounding = _mm_set1_epi16(2);
+		for (; x + 16 <= arg_width; x += 16)
+		{
+			// Adjacent pixels of each row, then the rows: 8 sums of 4
+			__m128i relative0[4];
+			__m128i relative1[4];
+			GetQuarterIndices(_mm_and_si128(_mm_loadu_si128((const __m128i*)(arg_row0 + x)), masks0), relative0);
+			GetQuarterIndices(_mm_and_si128(_mm_loadu_si128((const __m128i*)(arg_row1 + x)), masks1), relative1);
+			const __m128i pairs0 = _mm_maddubs_epi16(Lookup16(relative0, arg_lut.mBytes[0] + offset0), ones);
+			const __m128i pairs1 = _mm_maddubs_epi16(Lookup16(relative1, arg_lut.mBytes[0] + offset1), ones);
+			const __m128i average = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(pairs0, pairs1), rounding), 2);
+			_mm_storel_epi64((__m128i*)(out_dest + x / 2), _mm_packus_epi16(average, average));
+		}
+#endif
+		for (; x < arg_width; x += 2)
+		{
+			const int x1 = std::min(x + 1, arg_width - 1);
+			const uint32_t sum = arg_lut.mEntries[offset0 | (arg_row0[x] & mask0)] + arg_lut.mEntries[offset0 | (arg_row0[x1] & mask0)]
+				+ arg_lut.mEntries[offset1 | (arg_row1[x] & mask1)] + arg_lut.mEntries[offset1 | (arg_row1[x1] & mask1)];
+			out_dest[x / 2] = (uint8_t)((sum + 2) >> 2);
+		}
+	}
+}
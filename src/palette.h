@@ -0,0 +1,80 @@
+#ifndef NESEMU_PALETTE_H
+#define NESEMU_PALETTE_H
+
+#include <stdint.h>
+
+namespace nesemu
+{
+	enum ColorFormat
+	{
+		ColorRGBA8888,	// bytes R, G, B, A
+		ColorBGRA8888,	// bytes B, G, R, A
+		ColorRGB565,	// 16 bit words, red in the high bits
+		ColorYUV420		// planar Y, U, V (BT.601, limited range), chroma at half resolution
+	};
+
+	/**
+	* Caller-provided output image.
+	* Packed formats only use plane 0. YUV420 uses planes 0 (Y), 1 (U) and 2 (V).
+	* Strides are in bytes.
+	**/
+	struct ColorImage
+	{
+		ColorFormat mFormat = ColorFormat::ColorRGBA8888;
+		uint8_t* mPlanes[3] = { nullptr, nullptr, nullptr };
+		int mStrides[3] = { 0, 0, 0 };
+	};
+
+	/**
+	* Converts the PPU's palette indices to colors.
+	* This is a separate stage: consumers that only want indices never pay for it.
+	**/
+	class PaletteConverter
+	{
+	private:
+		// Indexed by emphasis bits (0-7) * 64 + palette index. The bytes of each entry are also kept
+		// as separate tables, which the SSSE3 path looks up 16 pixels at a time with byte shuffles.
+		struct ColorLUT
+		{
+			uint32_t mEntries[512];
+			uint8_t mBytes[4][512];
+
+			void Set(int arg_entry, uint32_t arg_color);
+		};
+
+		ColorLUT mRGBA;
+		ColorLUT mBGRA;
+		ColorLUT mRGB565;
+		ColorLUT mY;
+		ColorLUT mU;
+		ColorLUT mV;
+
+		void ConvertRow32(const uint8_t* arg_indices, uint8_t arg_colorBits, const ColorLUT& arg_lut, int arg_width, uint8_t* out_dest) const;
+		void ConvertRow16(const uint8_t* arg_indices, uint8_t arg_colorBits, const ColorLUT& arg_lut, int arg_width, uint8_t* out_dest) const;
+		void ConvertRow8(const uint8_t* arg_indices, uint8_t arg_colorBits, const ColorLUT& arg_lut, int arg_width, uint8_t* out_dest) const;
+		void ConvertChromaRow(const uint8_t* arg_row0, uint8_t arg_colorBits0, const uint8_t* arg_row1, uint8_t arg_colorBits1,
+			const ColorLUT& arg_lut, int arg_width, uint8_t* out_dest) const;
+
+	public:
+		PaletteConverter();
+
+		/**
+		* Sets the 64 colors of the palette, as R, G, B bytes. Emphasis variants are derived from it.
+		**/
+		void SetPalette(const uint8_t* arg_rgb);
+
+		/**
+		* RGBA8888 color of a palette index (0-63) with the given emphasis bits (0-7).
+		**/
+		inline uint32_t GetColor(int arg_index, int arg_emphasis) const { return mRGBA.mEntries[(arg_emphasis << 6) | arg_index]; }
+
+		/**
+		* Converts an image of palette indices (0-63).
+		* @param arg_colorBits The $2001 value of each row (grayscale and emphasis bits), or nullptr for none.
+		**/
+		void Convert(const uint8_t* arg_indices, int arg_indexStride, const uint8_t* arg_colorBits,
+			int arg_width, int arg_height, const ColorImage& out_image) const;
+	};
+}
+
+#endif
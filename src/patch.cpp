@@ -0,0 +1,210 @@
+#include "patch.h"
+#include <iostream>
+#include <string.h>
+
+namespace nesemu
+{
+	bool Patch::Apply(const std::vector<uint8_t>& arg_patch, const std::vector<uint8_t>& arg_source, std::vector<uint8_t>& out_target)
+	{
+		if (arg_patch.size() >= 5 && memcmp(arg_patch.data(), "PATCH", 5) == 0)
+		{
+			out_target = arg_source;
+			return ApplyIPS(arg_patch, out_target);
+		}
+		if (arg_patch.size() >= 4 && memcmp(arg_patch.data(), "BPS1", 4) == 0)
+		{
+			return ApplyBPS(arg_patch, arg_source, out_target);
+		}
+
+		std::cout << "ERROR: Unknown patch format" << std::endl;
+		return false;
+	}
+
+	bool Patch::ApplyIPS(const std::vector<uint8_t>& arg_patch, std::vector<uint8_t>& out_target)
+	{
+		size_t pos = 5;
+		while (pos + 3 <= arg_patch.size())
+		{
+			if (memcmp(&arg_patch[pos], "EOF", 3) == 0)
+				return true;
+
+			if (pos + 5 > arg_patch.size())
+				break;
+
+			const size_t offset = (arg_patch[pos] << 16) | (arg_patch[pos + 1] << 8) | arg_patch[pos + 2];
+			size_t size = (arg_patch[pos + 3] << 8) | arg_patch[pos + 4];
+			pos += 5;
+
+			if (size > 0)
+			{
+				if (pos + size > arg_patch.size())
+					break;
+				if (offset + size > out_target.size())
+					out_target.resize(offset + size, 0);
+				memcpy(&out_target[offset], &arg_patch[pos], size);
+				pos += size;
+			}
+			else
+			{
+				// RLE record: 16 bit run length, followed by the value
+				if (pos + 3 > arg_patch.size())
+					break;
+				size = (arg_patch[pos] << 8) | arg_patch[pos + 1];
+				const uint8_t value = arg_patch[pos + 2];
+				pos += 3;
+				if (offset + size > out_target.size())
+					out_target.resize(offset + size, 0);
+				memset(&out_target[offset], value, size);
+			}
+		}
+
+		std::cout << "ERROR: Truncated IPS patch" << std::endl;
+		return false;
+	}
+
+	bool Patch::ApplyBPS(const std::vector<uint8_t>& arg_patch, const std::vector<uint8_t>& arg_source, std::vector<uint8_t>& out_target)
+	{
+		const size_t footerSize = 12;
+		if (arg_patch.size() < 4 + footerSize)
+		{
+			std::cout << "ERROR: Truncated BPS patch" << std::endl;
+			return false;
+		}
+
+		const size_t end = arg_patch.size() - footerSize;
+		size_t pos = 4;
+		bool valid = true;
+
+		auto readNumber = [&]() -> uint64_t
+		{
+			uint64_t data = 0;
+			uint64_t shift = 1;
+			while (true)
+			{
+				if (pos >= end)
+				{
+					valid = false;
+					return 0;
+				}
+				const uint8_t x = arg_patch[pos++];
+				data += (x & 0x7F) * shift;
+				if (x & 0x80)
+					break;
+				shift <<= 7;
+				data += shift;
+			}
+			return data;
+		};
+
+		auto readCRC = [&](size_t arg_pos) -> uint32_t
+		{
+			return arg_patch[arg_pos] | (arg_patch[arg_pos + 1] << 8) | (arg_patch[arg_pos + 2] << 16) | ((uint32_t)arg_patch[arg_pos + 3] << 24);
+		};
+
+		const uint64_t sourceSize = readNumber();
+		const uint64_t targetSize = readNumber();
+		const uint64_t metadataSize = readNumber();
+		pos += metadataSize;
+
+		if (!valid || sourceSize != arg_source.size() || CRC32(arg_source.data(), arg_source.size()) != readCRC(end))
+		{
+			std::cout << "ERROR: BPS patch does not match the ROM" << std::endl;
+			return false;
+		}
+
+		out_target.assign(targetSize, 0);
+		size_t outputOffset = 0;
+		int64_t sourceRelativeOffset = 0;
+		int64_t targetRelativeOffset = 0;
+
+		while (valid && pos < end)
+		{
+			const uint64_t data = readNumber();
+			const uint64_t command = data & 3;
+			const uint64_t length = (data >> 2) + 1;
+			if (outputOffset + length > targetSize)
+			{
+				valid = false;
+				break;
+			}
+
+			switch (command)
+			{
+			case 0: // SourceRead
+				if (outputOffset + length > arg_source.size())
+				{
+					valid = false;
+					break;
+				}
+				memcpy(&out_target[outputOffset], &arg_source[outputOffset], length);
+				outputOffset += length;
+				break;
+			case 1: // TargetRead
+				if (pos + length > end)
+				{
+					valid = false;
+					break;
+				}
+				memcpy(&out_target[outputOffset], &arg_patch[pos], length);
+				pos += length;
+				outputOffset += length;
+				break;
+			case 2: // SourceCopy
+			{
+				const uint64_t offset = readNumber();
+				sourceRelativeOffset += (offset & 1 ? -1 : 1) * (int64_t)(offset >> 1);
+				if (sourceRelativeOffset < 0 || (uint64_t)sourceRelativeOffset + length > arg_source.size())
+				{
+					valid = false;
+					break;
+				}
+				memcpy(&out_target[outputOffset], &arg_source[sourceRelativeOffset], length);
+				sourceRelativeOffset += length;
+				outputOffset += length;
+				break;
+			}
+			case 3: // TargetCopy (byte by byte, the ranges may overlap)
+			{
+				const uint64_t offset = readNumber();
+				targetRelativeOffset += (offset & 1 ? -1 : 1) * (int64_t)(offset >> 1);
+				if (targetRelativeOffset < 0 || (uint64_t)targetRelativeOffset >= outputOffset)
+				{
+					valid = false;
+					break;
+				}
+				for (uint64_t i = 0; i < length; i++)
+					out_target[outputOffset++] = out_target[targetRelativeOffset++];
+				break;
+			}
+			}
+		}
+
+		if (!valid || outputOffset != targetSize || CRC32(out_target.data(), out_target.size()) != readCRC(end + 4))
+		{
+			std::cout << "ERROR: Invalid BPS patch" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	uint32_t Patch::CRC32(const uint8_t* arg_data, size_t arg_size)
+	{
+		static const std::vector<uint32_t> table = []
+		{
+			std::vector<uint32_t> t(256);
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++)
+					c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+				t[i] = c;
+			}
+			return t;
+		}();
+
+		uint32_t crc = 0xFFFFFFFF;
+		for (size_t i = 0; i < arg_size; i++)
+			crc = table[(crc ^ arg_data[i]) & 0xFF] ^ (crc >> 8);
+		return crc ^ 0xFFFFFFFF;
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef NESEMU_PATCH_H
+#define NESEMU_PATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace nesemu
+{
+	// Soft-patch formats:
+	// IPS: https://zerosoft.zophar.net/ips.php
+	// BPS: https://www.romhacking.net/documents/746/
+	class Patch
+	{
+	private:
+		static bool ApplyIPS(const std::vector<uint8_t>& arg_patch, std::vector<uint8_t>& out_target);
+		static bool ApplyBPS(const std::vector<uint8_t>& arg_patch, const std::vector<uint8_t>& arg_source, std::vector<uint8_t>& out_target);
+
+		static uint32_t CRC32(const uint8_t* arg_data, size_t arg_size);
+
+	public:
+		/**
+		* Applies an IPS or BPS patch (detected from its magic bytes) to a source file.
+		* @return false if the patch is invalid or does not match the source.
+		**/
+		static bool Apply(const std::vector<uint8_t>& arg_patch, const std::vector<uint8_t>& arg_source, std::vector<uint8_t>& out_target);
+	};
+}
+
+#endif
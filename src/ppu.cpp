@@ -1,53 +1,1504 @@
 #include "ppu.h"
 
 #include "memory.h"
+#include "rom.h"
+#include "simd.h"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Flags in PPU::mSpriteFlags
+#define SPRITEPIXEL_BEHIND_BG	0x01
 
 namespace nesemu
 {
-	void PPU::Tick(int arg_cpucycles)
+	// Mirrors a decoded tile row horizontally (the leftmost pixel is in the lowest byte)
+	static inline uint64_t FlipTileRow(uint64_t arg_row)
+	{
+#ifdef _MSC_VER
+		return _byteswap_uint64(arg_row);
+#else
+		return __builtin_bswap64(arg_row);
+#endif
+	}
+
+	// Index of the lowest set bit. arg_bits must not be 0.
+	static inline int FindFirstSet(uint64_t arg_bits)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		if (_BitScanForward(&index, (unsigned long)arg_bits))
+			return (int)index;
+		_BitScanForward(&index, (unsigned long)(arg_bits >> 32));
+		return (int)index + 32;
+#else
+		return __builtin_ctzll(arg_bits);
+#endif
+	}
+
+#ifdef NESEMU_SSSE3
+	// Looks up 16 palette RAM indices (0-31) at once
+	static inline __m128i MapPalette(__m128i arg_indices, __m128i arg_paletteLow, __m128i arg_paletteHigh)
+	{
+		const __m128i highBit = _mm_set1_epi8(0x10);
+		const __m128i isHigh = _mm_cmpeq_epi8(_mm_and_si128(arg_indices, highBit), highBit);
+		const __m128i low = _mm_shuffle_epi8(arg_paletteLow, arg_indices);
+		const __m128i high = _mm_shuffle_epi8(arg_paletteHigh, arg_indices);
+		return _mm_or_si128(_mm_and_si128(isHigh, high), _mm_andnot_si128(isHigh, low));
+	}
+#endif
+
+	PPU::PPU()
+	{
+		std::fill_n(mVRAM, sizeof(mVRAM), 0);
+		MapNametables();
+		std::fill_n(mPalette, sizeof(mPalette), 0);
+		std::fill_n(mOAM, sizeof(mOAM), 0);
+		std::fill_n(mBgLine, sizeof(mBgLine), 0);
+		std::fill_n(mSpriteLine, sizeof(mSpriteLine), 0);
+		std::fill_n(mSpriteFlags, sizeof(mSpriteFlags), 0);
+		std::fill_n(mBgTileRows, PPU_BG_TILES_PADDED, 0);
+		std::fill_n(mBgTileAttributes, PPU_BG_TILES_PADDED, 0);
+		std::fill_n(mBgColorLine, sizeof(mBgColorLine), 0);
+		std::fill_n(mScanlineColorBits, PPU_SCREEN_HEIGHT, 0);
+		std::fill_n(mPreviousColorBits, PPU_SCREEN_HEIGHT, 0);
+		std::fill_n(mScanlineHashes, PPU_SCREEN_HEIGHT, 0);
+		std::fill_n(mDirtyScanlines, PPU_DIRTY_WORDS, ~0ull);
+		std::fill_n(mColorBitsDirty, PPU_DIRTY_WORDS, 0);
+
+		mTileCache.resize(PPU_TILE_CACHE_SIZE);
+		std::fill_n(mTileGenerations, 0x200, 0);
+		std::fill_n(mPaletteGenerations, 4, 0);
+		ClearTileCache();
+
+		mLayer.resize(PPU_LAYER_WIDTH * PPU_LAYER_HEIGHT);
+		InvalidateLayer();
+
+		std::fill_n(mPatternPages, CHR_BANK_PAGES, nullptr);
+
+		mBackgroundPath = GetFastestTilePath();
+	}
+
+	PPU::~PPU()
 	{
-		mCPUCycle += arg_cpucycles;
-		mPPUCycle = mCPUCycle * 3;
-		mScanline = mPPUCycle / PPUCyclesPerScanline;
+		StopRenderThreads();
+	}
 
-		// Reset cycle counters if done with frame
-		int cyclesOverdue = mPPUCycle - PPUCyclesPerFrame;
-		if (cyclesOverdue >= 0)
+	BackgroundRenderPath PPU::GetFastestTilePath()
+	{
+#if defined(NESEMU_AVX2)
+		return BackgroundRenderPath::BackgroundAVX2;
+#elif defined(NESEMU_SSE2)
+		return BackgroundRenderPath::BackgroundSSE2;
+#else
+		return BackgroundRenderPath::BackgroundScalar;
+#endif
+	}
+
+	void PPU::SetROM(ROM* arg_rom)
+	{
+		FlushScanlines();
+		mROM = arg_rom;
+		mMirroring = mROM != nullptr ? mROM->GetMirroring() : NametableMirroring::HorizontalMirroring;
+		MapNametables();
+		RefreshPatternPages();
+		ClearTileCache();
+		InvalidateLayer();
+		mSpriteEventScanline = -1;
+
+		WaitForFrame();
+		for (std::unique_ptr<PPU>& worker : mRenderWorkers)
 		{
-			mPPUCycle -= PPUCyclesPerFrame;
-			mCPUCycle = mPPUCycle / 3;
-			mScanline -= ScanlinesPerFrame;
-			mVBlank = false;
-			mVBlankCompleted = false;
+			worker->mROM = mROM;
+			worker->mMirroring = mMirroring;
+			worker->MapNametables();
 		}
+	}
 
-		// VBlank
-		if (!mVBlank && !mVBlankCompleted && mScanline >= SCANLINE_VBLANK)
+	void PPU::SetMirroring(NametableMirroring arg_mirroring)
+	{
+		if (arg_mirroring == mMirroring)
+			return;
+		FlushScanlines();
+		mMirroring = arg_mirroring;
+		MapNametables();
+		InvalidateLayer();
+		mRenderMemoryDirty = true;
+		mSpriteEventScanline = -1;
+	}
+
+	void PPU::MapNametables()
+	{
+		// Physical 1KB page of each nametable, by NametableMirroring
+		static const uint8_t Pages[][4] =
 		{
-			StartVBlank();
-		}
-		else if (mVBlank && !mVBlankCompleted && mScanline >= SCANLINE_VBLANK_END)
+			{ 0, 0, 1, 1 },
+			{ 0, 1, 0, 1 },
+			{ 0, 1, 2, 3 },
+			{ 0, 0, 0, 0 },
+			{ 1, 1, 1, 1 }
+		};
+		for (int table = 0; table < 4; table++)
+			mNametables[table] = mVRAM + Pages[mMirroring][table] * 0x0400;
+	}
+
+	void PPU::CatchUp(uint64_t arg_cpuCycle)
+	{
+		if (arg_cpuCycle <= mCPUCycle)
+			return;
+
+		RunDots((int)(arg_cpuCycle - mCPUCycle) * PPUCyclesPerCPUCycle);
+		mCPUCycle = arg_cpuCycle;
+	}
+
+	uint64_t PPU::GetNextEventCycle() const
+	{
+		// The dot position within the frame, ignoring the skipped dot of odd frames.
+		// That dot can only make the frame end event one dot late.
+		const int position = mScanline * PPUCyclesPerScanline + mDot;
+		const int vblankPosition = SCANLINE_VBLANK * PPUCyclesPerScanline + 1;
+		const int target = position < vblankPosition ? vblankPosition : PPUCyclesPerFrame;
+		const int dots = target - position;
+		return mCPUCycle + (dots + PPUCyclesPerCPUCycle - 1) / PPUCyclesPerCPUCycle;
+	}
+
+	void PPU::RunDots(int arg_dots)
+	{
+		int dots = arg_dots;
+		while (dots > 0)
 		{
-			mVBlank = false;
-			mVBlankCompleted = true;
+			if (mSpriteEventScanline != mScanline)
+				PredictSpriteEvents();
+
+			// Skip straight to the next dot where something happens
+			const int eventDot = GetNextEventDot();
+			const int step = std::min(dots, eventDot - mDot);
+			mDot += step;
+			dots -= step;
+			if (mDot < eventDot)
+				break;
+
+			if (mDot == GetScanlineLength())
+			{
+				mDot = 0;
+				mScanline++;
+				if (mScanline == ScanlinesPerFrame)
+				{
+					mScanline = 0;
+					mFrameCount++;
+					mOddFrame = !mOddFrame;
+					mLayerFallback = mLayerRasterEffects;
+					mLayerRasterEffects = false;
+				}
+			}
+			else
+			{
+				RunEvent();
+			}
 		}
+	}
+
+	int PPU::GetScanlineLength() const
+	{
+		// The pre-render scanline is one dot shorter on odd frames when rendering is enabled
+		if (mScanline == SCANLINE_PRERENDER && mOddFrame && IsRenderingEnabled())
+			return PPUCyclesPerScanline - 1;
+		return PPUCyclesPerScanline;
+	}
 
+	int PPU::GetNextEventDot() const
+	{
+		if (mScanline < PPU_SCREEN_HEIGHT)
+		{
+			int eventDot = GetScanlineLength();
+			if (mSprite0HitDot > mDot)
+				eventDot = mSprite0HitDot;
+			if (mOverflowDot > mDot)
+				eventDot = std::min(eventDot, mOverflowDot);
+			if (mDot < 256)
+				eventDot = std::min(eventDot, 256);
+			return eventDot;
+		}
+		else if (mScanline == SCANLINE_VBLANK)
+		{
+			if (mDot < 1)
+				return 1;
+		}
+		else if (mScanline == SCANLINE_PRERENDER)
+		{
+			if (mDot < 1)
+				return 1;
+			if (mDot < 257)
+				return 257;
+			if (mDot < 280)
+				return 280;
+		}
+		return GetScanlineLength();
 	}
 
-	void PPU::InterruptNMI()
+	void PPU::RunEvent()
 	{
+		if (mScanline < PPU_SCREEN_HEIGHT)
+		{
+			if (mDot == mSprite0HitDot)
+				mStatus |= PPUSTATUS_SPRITE0;
+			if (mDot == mOverflowDot)
+				mStatus |= PPUSTATUS_OVERFLOW;
 
+			// Dot 256: the scanline is due. With frame-at-once rendering it's only drawn when the
+			// PPU state is about to change or be observed, or at vblank.
+			if (mDot == 256)
+			{
+				mPendingScanlines++;
+				if (!mFrameAtOnce)
+					FlushScanlines();
+			}
+		}
+		else if (mScanline == SCANLINE_VBLANK)
+		{
+			FlushScanlines();
+			if (mSkippingFrame)
+			{
+				// Nothing was drawn or recorded. The previous frame's dirty scanlines are found first.
+				WaitForFrame();
+				std::fill_n(mDirtyScanlines, PPU_DIRTY_WORDS, 0);
+			}
+			else if (mRenderThreads.empty())
+			{
+				UpdateColorBitsDirty();
+				UpdateDirtyScanlines();
+			}
+			else
+			{
+				// The previous frame's dirty scanlines are found first
+				WaitForFrame();
+				UpdateColorBitsDirty();
+				if (SubmitFrame())
+					mDirtyScanlinesPending = true;
+				else
+					UpdateDirtyScanlines();
+			}
+			if (mSkippingFrame)
+				mFrameRenderStats.mSkippedFrames++;
+			else if (mFrameSplit)
+				mFrameRenderStats.mScanlineFrames++;
+			else
+				mFrameRenderStats.mFrameAtOnceFrames++;
+			mFrameSplit = false;
+			mNextScanline = 0;
+			StartVBlank();
+		}
+		else if (mScanline == SCANLINE_PRERENDER)
+		{
+			if (mDot == 1)
+			{
+				mStatus &= ~(PPUSTATUS_VBLANK | PPUSTATUS_SPRITE0 | PPUSTATUS_OVERFLOW);
+			}
+			else if (IsRenderingEnabled())
+			{
+				if (mDot == 257)
+					CopyX();
+				else if (mDot == 280)
+					CopyY();
+			}
+		}
 	}
 
 	void PPU::StartVBlank()
 	{
-		uint8_t val = 1 << 7;
-		GMemory->Write(MEMLOC_VBLANK, &val, sizeof(val));
-		mVBlank = true;
+		mStatus |= PPUSTATUS_VBLANK;
+		if (mCtrl & PPUCTRL_NMI)
+			SignalNMI();
+	}
+
+	void PPU::SignalNMI()
+	{
 		if (mVBlankCallback != nullptr)
-		{
 			mVBlankCallback();
+	}
+
+	// v moved down one pixel row, as at dot 256 of a rendered scanline
+	static uint16_t IncrementY(uint16_t arg_v)
+	{
+		if ((arg_v & 0x7000) != 0x7000)
+			return arg_v + 0x1000; // fine Y
+
+		uint16_t v = arg_v & ~0x7000;
+		uint16_t coarseY = (v & 0x03E0) >> 5;
+		if (coarseY == 29)
+		{
+			coarseY = 0;
+			v ^= 0x0800; // switch vertical nametable
+		}
+		else if (coarseY == 31)
+		{
+			coarseY = 0; // out of bounds: wraps without switching nametable
+		}
+		else
+		{
+			coarseY++;
+		}
+		return (v & ~0x03E0) | (coarseY << 5);
+	}
+
+	void PPU::IncrementY()
+	{
+		mV = nesemu::IncrementY(mV);
+	}
+
+	void PPU::CopyX()
+	{
+		mV = (mV & ~0x041F) | (mT & 0x041F);
+	}
+
+	void PPU::CopyY()
+	{
+		mV = (mV & ~0x7BE0) | (mT & 0x7BE0);
+	}
+
+	uint16_t PPU::GetScanlineV() const
+	{
+		// v as the current scanline starts with it. Scanlines that are due but not drawn yet (frame-at-once
+		// rendering) haven't moved mV on; nothing that affects rendering has changed since, so their steps are replayed.
+		uint16_t v = mV;
+		if (IsRenderingEnabled())
+		{
+			for (int scanline = mNextScanline; scanline < mScanline; scanline++)
+			{
+				v = (nesemu::IncrementY(v) & ~0x041F) | (mT & 0x041F);
+			}
+		}
+		return v;
+	}
+
+	void PPU::RunScanline(int arg_scanline)
+	{
+		if (arg_scanline == 0)
+			mSkippingFrame = mSkipRendering;
+
+		// The whole scanline is drawn at once, then v moves on to the next one
+		if (!mSkippingFrame)
+		{
+			mScanlineColorBits[arg_scanline] = mMask & (PPUMASK_GRAYSCALE | PPUMASK_EMPHASIS);
+			if (mRenderThreads.empty())
+				RenderScanline(arg_scanline);
+			else
+				RecordScanline(arg_scanline);
+		}
+
+		if (IsRenderingEnabled())
+		{
+			IncrementY();
+			CopyX();
+		}
+	}
+
+	void PPU::FlushScanlines()
+	{
+		if (mPendingScanlines == 0)
+			return;
+
+		// Nothing that affects rendering has changed since these scanlines were due
+		RefreshPatternPages();
+		for (int i = 0; i < mPendingScanlines; i++)
+		{
+			RunScanline(mNextScanline++);
+		}
+		mPendingScanlines = 0;
+
+		if (mScanline < PPU_SCREEN_HEIGHT)
+			mFrameSplit = true;
+	}
+
+	void PPU::RefreshPatternPages()
+	{
+		if (mROM == nullptr)
+			return;
+		for (int page = 0; page < CHR_BANK_PAGES; page++)
+		{
+			mPatternPages[page] = mROM->GetDecodedCHRPage(page);
+		}
+	}
+
+	void PPU::RecordScanline(int arg_scanline)
+	{
+		RenderFrame& frame = mRenderFrames[mRecordFrame];
+		if (frame.mScanlineCount == 0)
+			frame.mFirstScanline = arg_scanline;
+
+		// New memory version when anything was written since the last one
+		if (mRenderMemoryDirty || frame.mMemoryCount == 0)
+		{
+			if (frame.mMemoryCount == (int)frame.mMemory.size())
+				frame.mMemory.emplace_back(new RenderMemory());
+			RenderMemory& memory = *frame.mMemory[frame.mMemoryCount++];
+			memcpy(memory.mVRAM, mVRAM, sizeof(mVRAM));
+			memory.mMirroring = mMirroring;
+			memcpy(memory.mPalette, mPalette, sizeof(mPalette));
+			memcpy(memory.mOAM, mOAM, sizeof(mOAM));
+			for (int page = 0; page < CHR_BANK_PAGES; page++)
+			{
+				memory.mPatternPages[page] = mPatternPages[page];
+			}
+			if (mROM != nullptr && mROM->HasCHRRAM())
+			{
+				memory.mCHRRAMRows.resize(CHR_BANK_PAGES * CHR_PAGE_ROWS);
+				for (int page = 0; page < CHR_BANK_PAGES; page++)
+				{
+					memcpy(&memory.mCHRRAMRows[page * CHR_PAGE_ROWS], mPatternPages[page], CHR_PAGE_ROWS * sizeof(uint64_t));
+					memory.mPatternPages[page] = &memory.mCHRRAMRows[page * CHR_PAGE_ROWS];
+				}
+			}
+			mRenderMemoryDirty = false;
+		}
+
+		ScanlineState& state = frame.mScanlines[arg_scanline];
+		state.mV = mV;
+		state.mX = mX;
+		state.mCtrl = mCtrl;
+		state.mMask = mMask;
+		state.mMemory = (uint8_t)(frame.mMemoryCount - 1);
+		frame.mScanlineCount = arg_scanline + 1;
+	}
+
+	bool PPU::SubmitFrame()
+	{
+		WaitForFrame();
+
+		RenderFrame& frame = mRenderFrames[mRecordFrame];
+		mRecordFrame ^= 1;
+		mRenderFrames[mRecordFrame].mScanlineCount = 0;
+		mRenderFrames[mRecordFrame].mMemoryCount = 0;
+		frame.mOutput = mFrameBuffer;
+		if (frame.mScanlineCount == 0 || frame.mOutput == nullptr)
+			return false;
+
+		std::lock_guard<std::mutex> lock(mRenderMutex);
+		mRenderingFrame = &frame;
+		mRenderPending = (int)mRenderThreads.size();
+		mRenderJob++;
+		mRenderStart.notify_all();
+		return true;
+	}
+
+	void PPU::RenderThread(int arg_index)
+	{
+		PPU& worker = *mRenderWorkers[arg_index];
+		uint64_t job = 0;
+		while (true)
+		{
+			std::unique_lock<std::mutex> lock(mRenderMutex);
+			mRenderStart.wait(lock, [&] { return mRenderStop || mRenderJob != job; });
+			if (mRenderStop)
+				return;
+			job = mRenderJob;
+			const RenderFrame& frame = *mRenderingFrame;
+			lock.unlock();
+
+			// Memory versions are reused between frames
+			worker.mLoadedMemory = nullptr;
+			worker.mFrameBuffer = frame.mOutput;
+			const int threads = (int)mRenderThreads.size();
+			const int scanlines = frame.mScanlineCount - frame.mFirstScanline;
+			const int first = frame.mFirstScanline + scanlines * arg_index / threads;
+			const int last = frame.mFirstScanline + scanlines * (arg_index + 1) / threads;
+			for (int scanline = first; scanline < last; scanline++)
+			{
+				worker.RenderRecordedScanline(frame, scanline);
+			}
+
+			lock.lock();
+			if (--mRenderPending == 0)
+				mRenderDone.notify_all();
+		}
+	}
+
+	void PPU::RenderRecordedScanline(const RenderFrame& arg_frame, int arg_scanline)
+	{
+		const ScanlineState& state = arg_frame.mScanlines[arg_scanline];
+		const RenderMemory* memory = arg_frame.mMemory[state.mMemory].get();
+		if (memory != mLoadedMemory)
+		{
+			memcpy(mVRAM, memory->mVRAM, sizeof(mVRAM));
+			if (memory->mMirroring != mMirroring)
+			{
+				mMirroring = memory->mMirroring;
+				MapNametables();
+			}
+			memcpy(mPalette, memory->mPalette, sizeof(mPalette));
+			memcpy(mOAM, memory->mOAM, sizeof(mOAM));
+			for (int page = 0; page < CHR_BANK_PAGES; page++)
+			{
+				mPatternPages[page] = memory->mPatternPages[page];
+			}
+			mLoadedMemory = memory;
+		}
+
+		mV = state.mV;
+		mX = state.mX;
+		mCtrl = state.mCtrl;
+		mMask = state.mMask;
+		RenderScanline(arg_scanline);
+	}
+
+	void PPU::SetRenderThreads(int arg_count)
+	{
+		FlushScanlines();
+		StopRenderThreads();
+
+		for (int i = 0; i < arg_count; i++)
+		{
+			// Workers only use the tile path, which doesn't keep any caches
+			PPU* worker = new PPU();
+			worker->mROM = mROM;
+			worker->mMirroring = mMirroring;
+			worker->MapNametables();
+			worker->mBackgroundPath = GetFastestTilePath();
+			mRenderWorkers.emplace_back(worker);
+		}
+		mRenderStop = false;
+		for (int i = 0; i < arg_count; i++)
+		{
+			mRenderThreads.emplace_back(&PPU::RenderThread, this, i);
+		}
+	}
+
+	void PPU::WaitForFrame()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mRenderMutex);
+			mRenderDone.wait(lock, [&] { return mRenderPending == 0; });
+		}
+		if (mDirtyScanlinesPending)
+		{
+			mDirtyScanlinesPending = false;
+			UpdateDirtyScanlines();
+		}
+	}
+
+	// Four independent multiply-xor lanes over the 256 bytes of a scanline
+	static uint64_t HashScanline(const uint8_t* arg_pixels)
+	{
+		uint64_t lanes[4] = { 0x243F6A8885A308D3ull, 0x13198A2E03707344ull, 0xA4093822299F31D0ull, 0x082EFA98EC4E6C89ull };
+		for (int x = 0; x < PPU_SCREEN_WIDTH; x += 32)
+		{
+			for (int lane = 0; lane < 4; lane++)
+			{
+				uint64_t word;
+				memcpy(&word, arg_pixels + x + lane * 8, sizeof(word));
+				lanes[lane] = (lanes[lane] ^ word) * 0x9E3779B97F4A7C15ull;
+				lanes[lane] ^= lanes[lane] >> 29;
+			}
+		}
+		return (lanes[0] ^ (lanes[1] * 0xC2B2AE3D27D4EB4Full)) + (lanes[2] ^ (lanes[3] * 0x165667B19E3779F9ull));
+	}
+
+	void PPU::UpdateColorBitsDirty()
+	{
+		std::fill_n(mColorBitsDirty, PPU_DIRTY_WORDS, 0);
+		for (int scanline = 0; scanline < PPU_SCREEN_HEIGHT; scanline++)
+		{
+			if (mScanlineColorBits[scanline] != mPreviousColorBits[scanline])
+				mColorBitsDirty[scanline >> 6] |= 1ull << (scanline & 63);
+		}
+		memcpy(mPreviousColorBits, mScanlineColorBits, sizeof(mPreviousColorBits));
+	}
+
+	void PPU::UpdateDirtyScanlines()
+	{
+		if (mFrameBuffer == nullptr)
+		{
+			std::fill_n(mDirtyScanlines, PPU_DIRTY_WORDS, ~0ull);
+			mScanlineHashesValid = false;
+			return;
+		}
+
+		for (int word = 0; word < PPU_DIRTY_WORDS; word++)
+		{
+			mDirtyScanlines[word] = mScanlineHashesValid ? mColorBitsDirty[word] : ~0ull;
+		}
+		for (int scanline = 0; scanline < PPU_SCREEN_HEIGHT; scanline++)
+		{
+			const uint64_t hash = HashScanline(mFrameBuffer + scanline * PPU_SCREEN_WIDTH);
+			if (hash != mScanlineHashes[scanline])
+				mDirtyScanlines[scanline >> 6] |= 1ull << (scanline & 63);
+			mScanlineHashes[scanline] = hash;
+		}
+		mScanlineHashesValid = true;
+	}
+
+	void PPU::StopRenderThreads()
+	{
+		// Scanlines recorded so far in this frame still have to be drawn
+		if (!mRenderThreads.empty() && mRenderFrames[mRecordFrame].mScanlineCount > 0)
+			SubmitFrame();
+		WaitForFrame();
+		{
+			std::lock_guard<std::mutex> lock(mRenderMutex);
+			mRenderStop = true;
+			mRenderStart.notify_all();
+		}
+		for (std::thread& thread : mRenderThreads)
+		{
+			thread.join();
+		}
+		mRenderThreads.clear();
+		mRenderWorkers.clear();
+	}
+
+	void PPU::RenderScanline(int arg_scanline)
+	{
+		uint8_t* dest = mFrameBuffer != nullptr ? mFrameBuffer + arg_scanline * PPU_SCREEN_WIDTH : mScratchLine;
+
+		if (!IsRenderingEnabled() || mROM == nullptr)
+		{
+			memset(dest, mPalette[0] & 0x3F, PPU_SCREEN_WIDTH);
+			return;
+		}
+
+		uint8_t* bg = mBgLine + mX;
+		if (mMask & PPUMASK_BG)
+		{
+			RenderBackground();
+			if (!(mMask & PPUMASK_BG_LEFT))
+			{
+				memset(bg, 0, 8);
+				if (mBackgroundPath == BackgroundRenderPath::BackgroundCached)
+					memset(mBgColorLine + mX, mPalette[0], 8);
+			}
+		}
+		else
+		{
+			memset(mBgLine, 0, sizeof(mBgLine));
+		}
+
+		int spriteCount = 0;
+		if (mMask & PPUMASK_SPRITES)
+		{
+			spriteCount = EvaluateSprites(arg_scanline);
+		}
+
+		if (spriteCount == 0)
+		{
+			if (mBackgroundPath == BackgroundRenderPath::BackgroundCached && (mMask & PPUMASK_BG))
+				memcpy(dest, mBgColorLine + mX, PPU_SCREEN_WIDTH);
+			else
+				ApplyBackgroundPalette(dest);
+			return;
+		}
+
+		RenderSprites(spriteCount);
+		if (!(mMask & PPUMASK_SPRITES_LEFT))
+			memset(mSpriteLine, 0, 8);
+
+		CompositeScanline(bg, dest);
+	}
+
+	void PPU::CompositeScanline(const uint8_t* arg_bg, uint8_t* out_dest)
+	{
+		// A sprite pixel wins where it's opaque, unless it's behind an opaque background pixel.
+		// Sprite 0 hit isn't found here, see PredictSpriteEvents.
+#ifdef NESEMU_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i allOnes = _mm_cmpeq_epi8(zero, zero);
+		const __m128i behindBit = _mm_set1_epi8(SPRITEPIXEL_BEHIND_BG);
+#ifdef NESEMU_SSSE3
+		const __m128i paletteLow = _mm_loadu_si128((const __m128i*)mPalette);
+		const __m128i paletteHigh = _mm_loadu_si128((const __m128i*)(mPalette + 16));
+#endif
+		for (int x = 0; x < PPU_SCREEN_WIDTH; x += 16)
+		{
+			const __m128i bg = _mm_loadu_si128((const __m128i*)(arg_bg + x));
+			const __m128i sprite = _mm_loadu_si128((const __m128i*)(mSpriteLine + x));
+			const __m128i flags = _mm_loadu_si128((const __m128i*)(mSpriteFlags + x));
+
+			const __m128i bgTransparent = _mm_cmpeq_epi8(bg, zero);
+			const __m128i spriteTransparent = _mm_cmpeq_epi8(sprite, zero);
+			const __m128i behind = _mm_cmpeq_epi8(_mm_and_si128(flags, behindBit), behindBit);
+			const __m128i hidden = _mm_andnot_si128(bgTransparent, behind);
+			const __m128i useSprite = _mm_andnot_si128(_mm_or_si128(spriteTransparent, hidden), allOnes);
+			const __m128i pixels = _mm_or_si128(_mm_and_si128(useSprite, sprite), _mm_andnot_si128(useSprite, bg));
+
+#ifdef NESEMU_SSSE3
+			_mm_storeu_si128((__m128i*)(out_dest + x), MapPalette(pixels, paletteLow, paletteHigh));
+#else
+			_mm_storeu_si128((__m128i*)(out_dest + x), pixels);
+#endif
+		}
+#ifndef NESEMU_SSSE3
+		for (int x = 0; x < PPU_SCREEN_WIDTH; x++)
+		{
+			out_dest[x] = mPalette[out_dest[x]];
+		}
+#endif
+#else
+		for (int x = 0; x < PPU_SCREEN_WIDTH; x++)
+		{
+			const uint8_t bgPixel = arg_bg[x];
+			const uint8_t spritePixel = mSpriteLine[x];
+			uint8_t pixel = bgPixel;
+			if (spritePixel != 0 && (bgPixel == 0 || !(mSpriteFlags[x] & SPRITEPIXEL_BEHIND_BG)))
+				pixel = spritePixel;
+			out_dest[x] = mPalette[pixel];
+		}
+#endif
+	}
+
+	void PPU::RenderBackground()
+	{
+		BackgroundRenderPath path = mBackgroundPath;
+		if (path == BackgroundRenderPath::BackgroundLayer)
+		{
+			if (RenderBackgroundLayer())
+				return;
+			path = GetFastestTilePath();
+		}
+
+		if (path == BackgroundRenderPath::BackgroundReference)
+		{
+			RenderBackgroundReference();
+			return;
+		}
+		if (path == BackgroundRenderPath::BackgroundCached)
+		{
+			RenderBackgroundCached();
+			return;
+		}
+
+		FetchBackgroundTiles();
+
+		// Transparent pixels stay 0, others get the palette in bits 2-3.
+		// Fine X is applied by reading the line from an offset (see RenderScanline).
+		switch (path)
+		{
+#ifdef NESEMU_AVX2
+		case BackgroundRenderPath::BackgroundAVX2:
+		{
+			const __m256i zero = _mm256_setzero_si256();
+			for (int tile = 0; tile < PPU_BG_TILES; tile += 4)
+			{
+				const __m256i rows = _mm256_loadu_si256((const __m256i*)&mBgTileRows[tile]);
+				const __m256i attributes = _mm256_loadu_si256((const __m256i*)&mBgTileAttributes[tile]);
+				const __m256i pixels = _mm256_or_si256(rows, _mm256_andnot_si256(_mm256_cmpeq_epi8(rows, zero), attributes));
+				_mm256_storeu_si256((__m256i*)(mBgLine + tile * 8), pixels);
+			}
+			break;
+		}
+#endif
+#ifdef NESEMU_SSE2
+		case BackgroundRenderPath::BackgroundSSE2:
+		{
+			const __m128i zero = _mm_setzero_si128();
+			for (int tile = 0; tile < PPU_BG_TILES; tile += 2)
+			{
+				const __m128i rows = _mm_loadu_si128((const __m128i*)&mBgTileRows[tile]);
+				const __m128i attributes = _mm_loadu_si128((const __m128i*)&mBgTileAttributes[tile]);
+				const __m128i pixels = _mm_or_si128(rows, _mm_andnot_si128(_mm_cmpeq_epi8(rows, zero), attributes));
+				_mm_storeu_si128((__m128i*)(mBgLine + tile * 8), pixels);
+			}
+			break;
+		}
+#endif
+		default:
+		{
+			for (int tile = 0; tile < PPU_BG_TILES; tile++)
+			{
+				const uint64_t row = mBgTileRows[tile];
+				const uint64_t opaque = ((row | (row >> 1)) & 0x0101010101010101ULL) * 0xFF;
+				const uint64_t pixels = row | (mBgTileAttributes[tile] & opaque);
+				memcpy(mBgLine + tile * 8, &pixels, sizeof(pixels));
+			}
+			break;
+		}
+		}
+	}
+
+	void PPU::FetchBackgroundTiles()
+	{
+		// Fetches 33 tiles from a local copy of v, starting at the tile containing the fine X offset
+		uint16_t v = mV;
+		const uint16_t patternTable = (mCtrl & PPUCTRL_BG_TABLE) << 4;
+		const uint8_t fineY = (v >> 12) & 0x07;
+
+		for (int tile = 0; tile < PPU_BG_TILES; tile++)
+		{
+			const uint8_t tileIndex = GetNametableByte(0x2000 | (v & 0x0FFF));
+			const uint8_t attribute = GetNametableByte(0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+			const uint64_t palette = (attribute >> (((v >> 4) & 0x04) | (v & 0x02))) & 0x03;
+
+			mBgTileRows[tile] = GetTileRow(patternTable | tileIndex, fineY);
+			mBgTileAttributes[tile] = palette * 0x0404040404040404ULL;
+
+			// Coarse X, wrapping into the next horizontal nametable
+			if ((v & 0x001F) == 31)
+				v = (v & ~0x001F) ^ 0x0400;
+			else
+				v++;
+		}
+	}
+
+	void PPU::RenderBackgroundCached()
+	{
+		// Same walk as FetchBackgroundTiles, but each tile is two stores out of the cache
+		uint16_t v = mV;
+		const uint16_t patternTable = (mCtrl & PPUCTRL_BG_TABLE) << 4;
+		const uint8_t fineY = (v >> 12) & 0x07;
+
+		for (int tile = 0; tile < PPU_BG_TILES; tile++)
+		{
+			const uint8_t tileIndex = GetNametableByte(0x2000 | (v & 0x0FFF));
+			const uint8_t attribute = GetNametableByte(0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+			const uint8_t palette = (attribute >> (((v >> 4) & 0x04) | (v & 0x02))) & 0x03;
+
+			const TileCacheEntry& entry = GetCachedTileRow(patternTable | tileIndex, fineY, palette);
+			memcpy(mBgLine + tile * 8, &entry.mIndices, sizeof(entry.mIndices));
+			memcpy(mBgColorLine + tile * 8, &entry.mColors, sizeof(entry.mColors));
+
+			if ((v & 0x001F) == 31)
+				v = (v & ~0x001F) ^ 0x0400;
+			else
+				v++;
+		}
+	}
+
+	const PPU::TileCacheEntry& PPU::GetCachedTileRow(uint16_t arg_tile, uint8_t arg_row, uint8_t arg_palette)
+	{
+		const uint32_t key = (mROM->GetCHRBank() << 14) | (arg_tile << 5) | (arg_row << 2) | arg_palette;
+		TileCacheEntry& entry = mTileCache[(key * 2654435761u) >> 20];
+		if (entry.mKey == key && entry.mTileGeneration == mTileGenerations[arg_tile] && entry.mPaletteGeneration == mPaletteGenerations[arg_palette])
+		{
+			mTileCacheStats.mHits++;
+			return entry;
+		}
+
+		mTileCacheStats.mMisses++;
+		const uint64_t row = GetTileRow(arg_tile, arg_row);
+		const uint64_t opaque = ((row | (row >> 1)) & 0x0101010101010101ULL) * 0xFF;
+		const uint64_t indices = row | ((arg_palette * 0x0404040404040404ULL) & opaque);
+
+		uint64_t colors = 0;
+		for (int x = 0; x < 8; x++)
+		{
+			colors |= (uint64_t)mPalette[(indices >> (x * 8)) & 0xFF] << (x * 8);
+		}
+
+		entry.mKey = key;
+		entry.mTileGeneration = mTileGenerations[arg_tile];
+		entry.mPaletteGeneration = mPaletteGenerations[arg_palette];
+		entry.mIndices = indices;
+		entry.mColors = colors;
+		return entry;
+	}
+
+	void PPU::ClearTileCache()
+	{
+		for (TileCacheEntry& entry : mTileCache)
+		{
+			entry.mKey = 0xFFFFFFFF;
+		}
+	}
+
+	bool PPU::RenderBackgroundLayer()
+	{
+		// Pattern table or CHR bank switches change every tile
+		const uint16_t patternTable = (mCtrl & PPUCTRL_BG_TABLE) << 4;
+		if (patternTable != mLayerPatternTable || mROM->GetCHRBank() != mLayerCHRBank)
+		{
+			InvalidateLayer();
+			mLayerPatternTable = patternTable;
+			mLayerCHRBank = mROM->GetCHRBank();
+		}
+
+		// Redrawing the whole layer mid-frame costs more than rendering tiles, so use tiles for the next frame too.
+		// Rows 30 and 31 (attributes fetched as tiles) are not part of the layer.
+		const int coarseY = (mV >> 5) & 0x1F;
+		if (mLayerFallback || coarseY >= 30)
+			return false;
+
+		const int tileRow = ((mV >> 11) & 0x01) * 30 + coarseY;
+		if (mLayerDirty[tileRow] != 0)
+			RefreshLayerRow(tileRow);
+
+		// The layer position already includes fine X, so the window goes to mBgLine + mX like the tile paths
+		const int x = ((mV >> 10) & 0x01) * PPU_SCREEN_WIDTH + (mV & 0x1F) * 8 + mX;
+		const uint8_t* src = &mLayer[(tileRow * 8 + ((mV >> 12) & 0x07)) * PPU_LAYER_WIDTH];
+		uint8_t* dest = mBgLine + mX;
+		const int firstPart = std::min(PPU_SCREEN_WIDTH, PPU_LAYER_WIDTH - x);
+		memcpy(dest, src + x, firstPart);
+		memcpy(dest + firstPart, src, PPU_SCREEN_WIDTH - firstPart);
+		return true;
+	}
+
+	void PPU::RefreshLayerRow(int arg_tileRow)
+	{
+		const uint16_t nametableRow = ((arg_tileRow / 30) << 11) | 0x2000;
+		const int coarseY = arg_tileRow % 30;
+		uint8_t* rowPixels = &mLayer[arg_tileRow * 8 * PPU_LAYER_WIDTH];
+
+		uint64_t dirty = mLayerDirty[arg_tileRow];
+		mLayerDirty[arg_tileRow] = 0;
+		while (dirty != 0)
+		{
+			const int column = FindFirstSet(dirty);
+			dirty &= dirty - 1;
+
+			const uint16_t nametable = nametableRow | ((column >> 5) << 10);
+			const int coarseX = column & 0x1F;
+			const uint8_t tileIndex = GetNametableByte(nametable | (coarseY << 5) | coarseX);
+			const uint8_t attribute = GetNametableByte(nametable | 0x03C0 | ((coarseY >> 2) << 3) | (coarseX >> 2));
+			const uint64_t palette = (attribute >> (((coarseY & 0x02) << 1) | (coarseX & 0x02))) & 0x03;
+
+			uint8_t* dest = rowPixels + column * 8;
+			for (int row = 0; row < CHR_TILE_ROWS; row++)
+			{
+				const uint64_t tileRow = GetTileRow(mLayerPatternTable | tileIndex, row);
+				const uint64_t opaque = ((tileRow | (tileRow >> 1)) & 0x0101010101010101ULL) * 0xFF;
+				const uint64_t pixels = tileRow | ((palette * 0x0404040404040404ULL) & opaque);
+				memcpy(dest + row * PPU_LAYER_WIDTH, &pixels, sizeof(pixels));
+			}
+		}
+	}
+
+	void PPU::InvalidateLayer()
+	{
+		std::fill_n(mLayerDirty, PPU_LAYER_TILE_ROWS, ~0ULL);
+		if (mScanline > 0 && mScanline < PPU_SCREEN_HEIGHT && IsRenderingEnabled())
+			mLayerRasterEffects = true;
+	}
+
+	void PPU::MarkLayerDirty(uint16_t arg_address, uint8_t arg_oldValue, uint8_t arg_newValue)
+	{
+		// Mark the tile in every nametable that mirrors the written one
+		const uint16_t offset = arg_address & 0x03FF;
+		const uint8_t* page = mNametables[(arg_address >> 10) & 0x03];
+		for (int table = 0; table < 4; table++)
+		{
+			if (mNametables[table] != page)
+				continue;
+
+			const int rowBase = (table >> 1) * 30;
+			const int columnBase = (table & 0x01) * 32;
+			if (offset < 0x03C0)
+			{
+				mLayerDirty[rowBase + (offset >> 5)] |= 1ULL << (columnBase + (offset & 0x1F));
+				continue;
+			}
+
+			// Attribute byte: 4x4 tiles, 2 bits per 2x2 quadrant. Only redraw the quadrants that changed.
+			const uint8_t changed = arg_oldValue ^ arg_newValue;
+			const int attributeX = (offset & 0x07) * 4;
+			const int attributeY = ((offset >> 3) & 0x07) * 4;
+			for (int quadrant = 0; quadrant < 4; quadrant++)
+			{
+				if (((changed >> (quadrant * 2)) & 0x03) == 0)
+					continue;
+				const int x = attributeX + (quadrant & 0x01) * 2;
+				const int y = attributeY + (quadrant >> 1) * 2;
+				for (int row = y; row < y + 2 && row < 30; row++)
+				{
+					mLayerDirty[rowBase + row] |= 3ULL << (columnBase + x);
+				}
+			}
+		}
+	}
+
+	void PPU::RenderBackgroundReference()
+	{
+		uint16_t v = mV;
+		const uint16_t patternTable = (mCtrl & PPUCTRL_BG_TABLE) << 8;
+		const uint8_t fineY = (v >> 12) & 0x07;
+
+		for (int tile = 0; tile < PPU_BG_TILES; tile++)
+		{
+			const uint8_t tileIndex = ReadBus(0x2000 | (v & 0x0FFF));
+			const uint8_t attribute = ReadBus(0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+			const uint8_t palette = (attribute >> (((v >> 4) & 0x04) | (v & 0x02))) & 0x03;
+
+			const uint16_t patternAddress = patternTable | (tileIndex << 4) | fineY;
+			uint8_t plane0 = ReadBus(patternAddress);
+			uint8_t plane1 = ReadBus(patternAddress + 8);
+			for (int x = 0; x < 8; x++)
+			{
+				const uint8_t pixel = ((plane0 >> 7) & 0x01) | ((plane1 >> 6) & 0x02);
+				plane0 <<= 1;
+				plane1 <<= 1;
+				mBgLine[tile * 8 + x] = pixel != 0 ? (palette << 2) | pixel : 0;
+			}
+
+			if ((v & 0x001F) == 31)
+				v = (v & ~0x001F) ^ 0x0400;
+			else
+				v++;
+		}
+	}
+
+	void PPU::ApplyBackgroundPalette(uint8_t* out_dest)
+	{
+		// Background indices are 0-15, so the first 16 palette entries work as a byte shuffle table.
+		// The reference and scalar paths stay plain C, so they can be checked against the SIMD ones in any build.
+		const uint8_t* bg = mBgLine + mX;
+#if defined(NESEMU_AVX2) || defined(NESEMU_SSSE3)
+		if (mBackgroundPath != BackgroundRenderPath::BackgroundReference && mBackgroundPath != BackgroundRenderPath::BackgroundScalar)
+		{
+#if defined(NESEMU_AVX2)
+			const __m256i palette = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)mPalette));
+			for (int x = 0; x < PPU_SCREEN_WIDTH; x += 32)
+			{
+				const __m256i indices = _mm256_loadu_si256((const __m256i*)(bg + x));
+				_mm256_storeu_si256((__m256i*)(out_dest + x), _mm256_shuffle_epi8(palette, indices));
+			}
+#else
+			const __m128i palette = _mm_loadu_si128((const __m128i*)mPalette);
+			for (int x = 0; x < PPU_SCREEN_WIDTH; x += 16)
+			{
+				const __m128i indices = _mm_loadu_si128((const __m128i*)(bg + x));
+				_mm_storeu_si128((__m128i*)(out_dest + x), _mm_shuffle_epi8(palette, indices));
+			}
+#endif
+			return;
+		}
+#endif
+		for (int x = 0; x < PPU_SCREEN_WIDTH; x++)
+		{
+			out_dest[x] = mPalette[bg[x]];
+		}
+	}
+
+	uint64_t PPU::FindSpritesInRange(int arg_scanline) const
+	{
+		// https://wiki.nesdev.com/w/index.php/PPU_sprite_evaluation
+		// Sprites are drawn one scanline below their Y coordinate,
+		// so a sprite is on this scanline when Y is in [scanline - height, scanline - 1].
+		if (arg_scanline == 0)
+			return 0;
+
+		const int height = (mCtrl & PPUCTRL_SPRITE_SIZE) ? 16 : 8;
+		const uint8_t lowY = (uint8_t)std::max(0, arg_scanline - height);
+		const uint8_t highY = (uint8_t)(arg_scanline - 1);
+
+		uint64_t inRange = 0;
+#ifdef NESEMU_SSE2
+		const __m128i yMask = _mm_set1_epi32(0xFF);
+		const __m128i low = _mm_set1_epi8((char)lowY);
+		const __m128i high = _mm_set1_epi8((char)highY);
+		for (int group = 0; group < 4; group++)
+		{
+			// Gather Y (byte 0 of every 4) of 16 sprites
+			const __m128i* oam = (const __m128i*)(mOAM + group * 64);
+			const __m128i y0 = _mm_and_si128(_mm_loadu_si128(oam), yMask);
+			const __m128i y1 = _mm_and_si128(_mm_loadu_si128(oam + 1), yMask);
+			const __m128i y2 = _mm_and_si128(_mm_loadu_si128(oam + 2), yMask);
+			const __m128i y3 = _mm_and_si128(_mm_loadu_si128(oam + 3), yMask);
+			const __m128i y = _mm_packus_epi16(_mm_packs_epi32(y0, y1), _mm_packs_epi32(y2, y3));
+
+			// Unsigned range test
+			const __m128i aboveLow = _mm_cmpeq_epi8(_mm_max_epu8(y, low), y);
+			const __m128i belowHigh = _mm_cmpeq_epi8(_mm_min_epu8(y, high), y);
+			inRange |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_and_si128(aboveLow, belowHigh)) << (group * 16);
+		}
+#else
+		for (int i = 0; i < 64; i++)
+		{
+			const uint8_t y = mOAM[i * 4];
+			if (y >= lowY && y <= highY)
+				inRange |= 1ULL << i;
+		}
+#endif
+		return inRange;
+	}
+
+	int PPU::EvaluateSprites(int arg_scanline)
+	{
+		// The first 8 sprites in OAM order are drawn. Overflow is set by PredictSpriteEvents.
+		uint64_t inRange = FindSpritesInRange(arg_scanline);
+		int count = 0;
+		while (inRange != 0 && count < 8)
+		{
+			mLineSprites[count++] = (uint8_t)FindFirstSet(inRange);
+			inRange &= inRange - 1;
+		}
+
+		mLineSpriteScanline = arg_scanline;
+		return count;
+	}
+
+	uint64_t PPU::GetSpriteRow(int arg_sprite, int arg_scanline) const
+	{
+		const int height = (mCtrl & PPUCTRL_SPRITE_SIZE) ? 16 : 8;
+		const uint8_t* sprite = &mOAM[arg_sprite * 4];
+		const uint8_t attributes = sprite[2];
+
+		int row = arg_scanline - 1 - sprite[0];
+		if (attributes & 0x80)
+			row = height - 1 - row;
+
+		uint16_t tile;
+		if (height == 16)
+		{
+			tile = ((sprite[1] & 0x01) << 8) | (sprite[1] & 0xFE);
+			if (row >= 8)
+			{
+				tile++;
+				row -= 8;
+			}
+		}
+		else
+		{
+			tile = ((mCtrl & PPUCTRL_SPRITE_TABLE) << 5) | sprite[1];
+		}
+
+		uint64_t pixels = GetTileRow(tile, row);
+		if (attributes & 0x40)
+			pixels = FlipTileRow(pixels);
+		return pixels;
+	}
+
+	// Bit n set when byte n (pixel n of a decoded tile row) is opaque
+	static inline uint32_t GetOpaqueMask(uint64_t arg_pixels)
+	{
+		const uint64_t opaque = (arg_pixels | (arg_pixels >> 1)) & 0x0101010101010101ULL;
+		return (uint32_t)((opaque * 0x0102040810204080ULL) >> 56);
+	}
+
+	void PPU::PredictSpriteEvents()
+	{
+		// Sprite 0 hit and overflow are found analytically for the rest of the current scanline,
+		// from the current state, and then happen as events at their dot. Any state change predicts again.
+		mSpriteEventScanline = mScanline;
+		mSprite0HitDot = -1;
+		mOverflowDot = -1;
+		if (mScanline >= PPU_SCREEN_HEIGHT || mROM == nullptr || !IsRenderingEnabled())
+			return;
+
+		// Overflow: sprites are evaluated whenever rendering is enabled, even with sprites hidden.
+		// The evaluation for the next scanline, during dots 65-256 of this one, reads each sprite's Y
+		// in 2 dots, and copies each of the first 8 in range in 6 more. It's set when it reaches a 9th in range.
+		if (!(mStatus & PPUSTATUS_OVERFLOW) && mScanline + 1 < PPU_SCREEN_HEIGHT)
+		{
+			uint64_t inRange = FindSpritesInRange(mScanline + 1);
+			for (int i = 0; i < 8 && inRange != 0; i++)
+				inRange &= inRange - 1;
+			if (inRange != 0)
+			{
+				const int dot = 66 + 2 * FindFirstSet(inRange) + 6 * 8;
+				if (dot > mDot)
+					mOverflowDot = dot;
+				else
+					mStatus |= PPUSTATUS_OVERFLOW;
+			}
+		}
+
+		// Sprite 0 hit: its opaque pixels and the background's, 8 pixels at a time
+		if ((mStatus & PPUSTATUS_SPRITE0) || (mMask & (PPUMASK_BG | PPUMASK_SPRITES)) != (PPUMASK_BG | PPUMASK_SPRITES)
+			|| !(FindSpritesInRange(mScanline) & 1))
+			return;
+
+		const int spriteX = mOAM[3];
+		uint32_t hits = GetOpaqueMask(GetSpriteRow(0, mScanline));
+
+		// The (up to) two background tiles under the sprite
+		const uint16_t scanlineV = GetScanlineV();
+		const int firstPixel = mX + spriteX;
+		const uint16_t patternTable = (mCtrl & PPUCTRL_BG_TABLE) << 4;
+		uint32_t background = 0;
+		for (int tile = 0; tile < 2; tile++)
+		{
+			const int coarseX = (scanlineV & 0x001F) + (firstPixel >> 3) + tile;
+			const uint16_t v = ((scanlineV & ~0x001F) ^ ((coarseX & 0x20) << 5)) | (coarseX & 0x1F);
+			const uint8_t tileIndex = GetNametableByte(0x2000 | (v & 0x0FFF));
+			background |= GetOpaqueMask(GetTileRow(patternTable | tileIndex, (scanlineV >> 12) & 0x07)) << (tile * 8);
+		}
+		hits &= background >> (firstPixel & 7);
+
+		// No hit at x=255, in the clipped left column, or in pixels already drawn before the last state change.
+		// Pixel x is output at dot x + 1.
+		int firstX = std::max(mDot, 0);
+		if (!(mMask & PPUMASK_BG_LEFT) || !(mMask & PPUMASK_SPRITES_LEFT))
+			firstX = std::max(firstX, 8);
+		for (int i = 0; i < 8; i++)
+		{
+			const int x = spriteX + i;
+			if (x < firstX || x > 254)
+				hits &= ~(1u << i);
+		}
+		if (hits != 0)
+			mSprite0HitDot = spriteX + FindFirstSet(hits) + 1;
+	}
+
+	void PPU::RenderSprites(int arg_spriteCount)
+	{
+		memset(mSpriteLine, 0, sizeof(mSpriteLine));
+
+		for (int i = 0; i < arg_spriteCount; i++)
+		{
+			const uint8_t spriteIndex = mLineSprites[i];
+			const uint8_t* sprite = &mOAM[spriteIndex * 4];
+			const uint8_t attributes = sprite[2];
+			const uint64_t pixels = GetSpriteRow(spriteIndex, mLineSpriteScanline);
+
+			// Sprite pixels always have bit 4 set, so a free slot is a 0 byte.
+			// Lower OAM index wins, even if it's behind the background.
+			// The line buffers are padded, so sprites at the right edge can be written whole.
+			const int spriteX = sprite[3];
+			uint64_t line;
+			uint64_t lineFlags;
+			memcpy(&line, mSpriteLine + spriteX, sizeof(line));
+			memcpy(&lineFlags, mSpriteFlags + spriteX, sizeof(lineFlags));
+
+			const uint64_t opaque = ((pixels | (pixels >> 1)) & 0x0101010101010101ULL) * 0xFF;
+			const uint64_t taken = ((line >> 4) & 0x0101010101010101ULL) * 0xFF;
+			const uint64_t write = opaque & ~taken;
+
+			const uint64_t paletteBase = 0x10 | ((attributes & 0x03) << 2);
+			const uint64_t flags = (attributes & 0x20) ? SPRITEPIXEL_BEHIND_BG : 0;
+			line = (line & ~write) | ((pixels | (paletteBase * 0x0101010101010101ULL)) & write);
+			lineFlags = (lineFlags & ~write) | ((flags * 0x0101010101010101ULL) & write);
+
+			memcpy(mSpriteLine + spriteX, &line, sizeof(line));
+			memcpy(mSpriteFlags + spriteX, &lineFlags, sizeof(lineFlags));
+		}
+	}
+
+	uint8_t PPU::ReadBus(uint16_t arg_address)
+	{
+		arg_address &= 0x3FFF;
+		if (arg_address < 0x2000)
+			return mROM != nullptr ? mROM->ReadCHR(arg_address) : 0;
+		if (arg_address < 0x3F00)
+			return GetNametableByte(arg_address);
+
+		// Mirrored palette entries are kept equal by WriteBus
+		return mPalette[arg_address & 0x1F];
+	}
+
+	void PPU::WriteBus(uint16_t arg_address, uint8_t arg_value)
+	{
+		arg_address &= 0x3FFF;
+		if (arg_address < 0x2000)
+		{
+			if (mROM != nullptr && mROM->HasCHRRAM())
+			{
+				mROM->WriteCHR(arg_address, arg_value);
+				mTileGenerations[arg_address >> 4]++;
+				mRenderMemoryDirty = true;
+				InvalidateLayer();
+			}
+			return;
+		}
+		if (arg_address < 0x3F00)
+		{
+			uint8_t& data = GetNametableByte(arg_address);
+			if (data != arg_value)
+			{
+				MarkLayerDirty(arg_address, data, arg_value);
+				data = arg_value;
+				mRenderMemoryDirty = true;
+			}
+			return;
+		}
+
+		// $3F10/$3F14/$3F18/$3F1C mirror $3F00/$3F04/$3F08/$3F0C: both copies are written,
+		// so reads and the renderer index the palette directly
+		const uint8_t mirror = (arg_address & 0x03) == 0 ? 0x10 : 0x00;
+		const uint8_t index = arg_address & (0x1F & ~mirror);
+		const uint8_t value = arg_value & 0x3F;
+		if (mPalette[index] == value)
+			return;
+		mPalette[index] = value;
+		mPalette[index | mirror] = value;
+		mRenderMemoryDirty = true;
+
+		// Invalidate the cached background rows using this entry. $3F00 is the backdrop of all palettes,
+		// and $3F04/$3F08/$3F0C are never used by the background.
+		if (index == 0)
+		{
+			for (uint32_t& generation : mPaletteGenerations)
+				generation++;
+		}
+		else if (index < 0x10 && (index & 0x03) != 0)
+		{
+			mPaletteGenerations[index >> 2]++;
+		}
+	}
+
+	uint8_t PPU::ReadRegister(uint16_t arg_address)
+	{
+		if (arg_address == MEMLOC_OAMDMA)
+			return mOpenBus;
+
+		uint8_t value = mOpenBus;
+		switch (PPUREG_CTRL | (arg_address & 0x07))
+		{
+		case PPUREG_STATUS:
+			value = (mStatus & 0xE0) | (mOpenBus & 0x1F);
+			mStatus &= ~PPUSTATUS_VBLANK;
+			mW = false;
+			break;
+		case PPUREG_OAMDATA:
+			value = mOAM[mOAMAddr];
+			break;
+		case PPUREG_DATA:
+			// Moves v, which the due scanlines must not see. Other reads don't affect rendering,
+			// so polling $2002 keeps the frame drawn at once: sprite 0 hit is predicted from the v
+			// the due scanlines will leave (see GetScanlineV), not from mV.
+			FlushScanlines();
+
+			// Reads are delayed by one, except for the palette
+			if ((mV & 0x3FFF) >= 0x3F00)
+			{
+				value = ReadBus(mV);
+				mReadBuffer = ReadBus(mV - 0x1000);
+			}
+			else
+			{
+				value = mReadBuffer;
+				mReadBuffer = ReadBus(mV);
+			}
+			mV = (mV + ((mCtrl & PPUCTRL_INCREMENT) ? 32 : 1)) & 0x7FFF;
+			mSpriteEventScanline = -1;
+			break;
+		default: // write-only
+			break;
 		}
+
+		mOpenBus = value;
+		return value;
+	}
+
+	void PPU::WriteRegister(uint16_t arg_address, uint8_t arg_value)
+	{
+		FlushScanlines();
+		mSpriteEventScanline = -1;
+		mOpenBus = arg_value;
+
+		if (arg_address == MEMLOC_OAMDMA)
+		{
+			uint8_t page[0x100];
+			GMemory->Read(arg_value << 8, sizeof(page), page);
+			for (int i = 0; i < 0x100; i++)
+			{
+				mOAM[(mOAMAddr + i) & 0xFF] = page[i];
+			}
+			mRenderMemoryDirty = true;
+			return;
+		}
+
+		switch (PPUREG_CTRL | (arg_address & 0x07))
+		{
+		case PPUREG_CTRL:
+		{
+			const bool nmiEnabled = (mCtrl & PPUCTRL_NMI) != 0;
+			mCtrl = arg_value;
+			mT = (mT & ~0x0C00) | ((arg_value & PPUCTRL_NAMETABLE) << 10);
+			// Enabling NMI during vblank triggers it, once the STA $2000 completes (see SetVBlankCallback)
+			if (!nmiEnabled && (mCtrl & PPUCTRL_NMI) && (mStatus & PPUSTATUS_VBLANK))
+				SignalNMI();
+			break;
+		}
+		case PPUREG_MASK:
+			mMask = arg_value;
+			break;
+		case PPUREG_OAMADDR:
+			mOAMAddr = arg_value;
+			break;
+		case PPUREG_OAMDATA:
+			mOAM[mOAMAddr++] = arg_value;
+			mRenderMemoryDirty = true;
+			break;
+		case PPUREG_SCROLL:
+			if (!mW)
+			{
+				mT = (mT & ~0x001F) | (arg_value >> 3);
+				mX = arg_value & 0x07;
+			}
+			else
+			{
+				mT = (mT & ~0x73E0) | ((arg_value & 0x07) << 12) | ((arg_value & 0xF8) << 2);
+			}
+			mW = !mW;
+			break;
+		case PPUREG_ADDR:
+			if (!mW)
+			{
+				mT = (mT & 0x00FF) | ((arg_value & 0x3F) << 8);
+			}
+			else
+			{
+				mT = (mT & 0xFF00) | arg_value;
+				mV = mT;
+			}
+			mW = !mW;
+			break;
+		case PPUREG_DATA:
+			WriteBus(mV, arg_value);
+			mV = (mV + ((mCtrl & PPUCTRL_INCREMENT) ? 32 : 1)) & 0x7FFF;
+			break;
+		default: // read-only
+			break;
+		}
+	}
+
+	void PPU::SetBackgroundRenderPath(BackgroundRenderPath arg_path)
+	{
+		FlushScanlines();
+		mBackgroundPath = IsBackgroundRenderPathSupported(arg_path) ? arg_path : BackgroundRenderPath::BackgroundScalar;
+	}
+
+	bool PPU::IsBackgroundRenderPathSupported(BackgroundRenderPath arg_path)
+	{
+		switch (arg_path)
+		{
+		case BackgroundRenderPath::BackgroundSSE2:
+#ifdef NESEMU_SSE2
+			return true;
+#else
+			return false;
+#endif
+		case BackgroundRenderPath::BackgroundAVX2:
+#ifdef NESEMU_AVX2
+			return true;
+#else
+			return false;
+#endif
+		default:
+			return true;
+		}
+	}
+
+	double PPU::BenchmarkBackground(BackgroundRenderPath arg_path, int arg_scanlines)
+	{
+		if (mROM == nullptr || arg_scanlines <= 0)
+			return 0.0;
+
+		const BackgroundRenderPath previousPath = mBackgroundPath;
+		SetBackgroundRenderPath(arg_path);
+
+		const auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < arg_scanlines; i++)
+		{
+			RenderBackground();
+		}
+		const auto end = std::chrono::high_resolution_clock::now();
+
+		mBackgroundPath = previousPath;
+		return std::chrono::duration<double, std::nano>(end - start).count() / arg_scanlines;
+	}
+
+	void PPU::SetFrameBuffer(uint8_t* arg_buffer)
+	{
+		FlushScanlines();
+		WaitForFrame();
+		mFrameBuffer = arg_buffer;
+		mScanlineHashesValid = false;
+	}
+
+	void PPU::SetFrameAtOnceRendering(bool arg_enabled)
+	{
+		FlushScanlines();
+		mFrameAtOnce = arg_enabled;
 	}
 
 	void PPU::SetVBlankCallback(std::function<void()> arg_callback)
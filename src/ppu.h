@@ -1,7 +1,14 @@
 #ifndef NESEMU_PPU_H
 #define NESEMU_PPU_H
 
+#include <condition_variable>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include "rom.h"
 
 // 262 scanlines per frame
 // 1 scanlane = 341 PPU clock cycles
@@ -9,34 +16,403 @@
 
 #define SCANLINE_VBLANK			241
 #define SCANLINE_VBLANK_END		260
+#define SCANLINE_PRERENDER		261
+
+#define PPU_SCREEN_WIDTH		256
+#define PPU_SCREEN_HEIGHT		240
+
+// Background tiles fetched per scanline (one extra for fine X), padded to a multiple of 4 for AVX2
+#define PPU_BG_TILES			33
+#define PPU_BG_TILES_PADDED		36
+
+// Entries in the tile row cache (power of 2)
+#define PPU_TILE_CACHE_SIZE		4096
+
+// Background layer: the four nametables as one 512x480 image, 64x60 tiles
+#define PPU_LAYER_WIDTH			512
+#define PPU_LAYER_HEIGHT		480
+#define PPU_LAYER_TILE_ROWS		60
+
+// Dirty scanline bitmap: 64 scanlines per word
+#define PPU_DIRTY_WORDS			4
+
+// Registers, mirrored every 8 bytes in $2000-$3FFF
+#define PPUREG_CTRL				0x2000
+#define PPUREG_MASK				0x2001
+#define PPUREG_STATUS			0x2002
+#define PPUREG_OAMADDR			0x2003
+#define PPUREG_OAMDATA			0x2004
+#define PPUREG_SCROLL			0x2005
+#define PPUREG_ADDR				0x2006
+#define PPUREG_DATA				0x2007
+
+#define PPUCTRL_NAMETABLE		0x03
+#define PPUCTRL_INCREMENT		0x04
+#define PPUCTRL_SPRITE_TABLE	0x08
+#define PPUCTRL_BG_TABLE		0x10
+#define PPUCTRL_SPRITE_SIZE		0x20
+#define PPUCTRL_NMI				0x80
+
+#define PPUMASK_GRAYSCALE		0x01
+#define PPUMASK_BG_LEFT			0x02
+#define PPUMASK_SPRITES_LEFT	0x04
+#define PPUMASK_BG				0x08
+#define PPUMASK_SPRITES			0x10
+#define PPUMASK_EMPHASIS		0xE0 // red, green, blue
+
+#define PPUSTATUS_OVERFLOW		0x20
+#define PPUSTATUS_SPRITE0		0x40
+#define PPUSTATUS_VBLANK		0x80
 
 namespace nesemu
 {
+	enum BackgroundRenderPath
+	{
+		BackgroundReference,	// per pixel from the CHR bitplanes, like the hardware shift registers
+		BackgroundScalar,		// 8 pixels at a time from the decoded CHR rows, in 64 bit registers
+		BackgroundSSE2,			// 16 pixels at a time
+		BackgroundAVX2,			// 32 pixels at a time
+		BackgroundCached,		// rows with the palette already applied, from the tile row cache
+		BackgroundLayer			// window copy out of a pre-rendered image of all four nametables
+	};
+
+	struct FrameRenderStats
+	{
+		uint64_t mFrameAtOnceFrames = 0; // rendered in one pass at vblank
+		uint64_t mScanlineFrames = 0;	 // rendered in parts, because the PPU was accessed during the visible scanlines
+		uint64_t mSkippedFrames = 0;	 // not drawn, see PPU::SetSkipRendering
+
+		inline uint64_t GetTotalFrames() const { return mFrameAtOnceFrames + mScanlineFrames + mSkippedFrames; }
+	};
+
+	struct TileCacheStats
+	{
+		uint64_t mHits = 0;
+		uint64_t mMisses = 0;
+	};
+
+	// https://wiki.nesdev.com/w/index.php/PPU_rendering
 	class PPU
 	{
 	private:
-		void InterruptNMI();
+		ROM* mROM = nullptr;
+		NametableMirroring mMirroring = NametableMirroring::HorizontalMirroring;
 
-		int mCPUCycle = 0;
-		int mPPUCycle = 0;
+		uint64_t mCPUCycle = 0; // CPU cycle the PPU has caught up to
+		int mDot = 0;
 		int mScanline = 0;
+		uint64_t mFrameCount = 0;
+		bool mOddFrame = false;
 
 		std::function<void()> mVBlankCallback;
 
+		// Frame-at-once rendering: visible scanlines are drawn when the PPU registers are accessed
+		// (which flushes the scanlines that are due with the state they were due with), or at vblank.
+		// Frames without register accesses during the visible scanlines are drawn in one pass.
+		bool mFrameAtOnce = true;
+		int mPendingScanlines = 0;
+		int mNextScanline = 0;
+		bool mFrameSplit = false;
+
+		// Frameskip: latched when scanline 0 runs, so frames are either drawn or skipped as a whole
+		bool mSkipRendering = false;
+		bool mSkippingFrame = false;
+		FrameRenderStats mFrameRenderStats;
+
+		// Decoded pattern table pages. Points into the ROM, or into a RenderMemory copy on render threads.
+		const uint64_t* mPatternPages[CHR_BANK_PAGES];
+
+		// Multithreaded rendering: scanlines are recorded as the register state they were due with,
+		// plus a version of the memory they read. Render threads draw the recorded frame in bands
+		// while the next one is emulated. Sprite 0 hit and overflow are still found on this thread.
+		struct ScanlineState
+		{
+			uint16_t mV;
+			uint8_t mX;
+			uint8_t mCtrl;
+			uint8_t mMask;
+			uint8_t mMemory; // index in RenderFrame::mMemory
+		};
+		struct RenderMemory
+		{
+			uint8_t mVRAM[0x1000];
+			NametableMirroring mMirroring;
+			uint8_t mPalette[0x20];
+			uint8_t mOAM[0x100];
+			const uint64_t* mPatternPages[CHR_BANK_PAGES];
+			std::vector<uint64_t> mCHRRAMRows; // copy of the decoded CHR-RAM, which can change while the frame renders
+		};
+		struct RenderFrame
+		{
+			ScanlineState mScanlines[PPU_SCREEN_HEIGHT];
+			int mFirstScanline = 0; // render threads can be started mid-frame
+			int mScanlineCount = 0;
+			std::vector<std::unique_ptr<RenderMemory>> mMemory; // pool, reused every other frame
+			int mMemoryCount = 0;
+			uint8_t* mOutput = nullptr;
+		};
+		RenderFrame mRenderFrames[2];
+		int mRecordFrame = 0;
+		bool mRenderMemoryDirty = true;
+
+		std::vector<std::thread> mRenderThreads;
+		std::vector<std::unique_ptr<PPU>> mRenderWorkers; // private render state of each thread
+		std::mutex mRenderMutex;
+		std::condition_variable mRenderStart;
+		std::condition_variable mRenderDone;
+		const RenderFrame* mRenderingFrame = nullptr;
+		uint64_t mRenderJob = 0;
+		int mRenderPending = 0;
+		bool mRenderStop = false;
+		const RenderMemory* mLoadedMemory = nullptr; // on render workers
+
 		const int ScanlinesPerFrame = 262;
 		const int PPUCyclesPerScanline = 341;
 		const int PPUCyclesPerFrame = ScanlinesPerFrame * PPUCyclesPerScanline;
 
-		bool mVBlank = false;
-		bool mVBlankCompleted = false;
+		// Registers
+		uint8_t mCtrl = 0;
+		uint8_t mMask = 0;
+		uint8_t mStatus = 0;
+		uint8_t mOAMAddr = 0;
+		uint8_t mReadBuffer = 0;
+		uint8_t mOpenBus = 0;
+
+		// Loopy scroll registers: https://wiki.nesdev.com/w/index.php/PPU_scrolling
+		uint16_t mV = 0; // current VRAM address
+		uint16_t mT = 0; // temporary VRAM address
+		uint8_t mX = 0;  // fine X scroll
+		bool mW = false; // write toggle
+
+		// Memory
+		uint8_t mVRAM[0x1000]; // 2KB of CIRAM, 4KB with four-screen VRAM
+		uint8_t* mNametables[4]; // 1KB page of mVRAM that each nametable ($2000, $2400, $2800, $2C00) is mapped to
+		uint8_t mPalette[0x20];
+		uint8_t mOAM[0x100];
+
+		// Output: one palette index (0-63) per pixel
+		uint8_t* mFrameBuffer = nullptr;
+		uint8_t mScratchLine[PPU_SCREEN_WIDTH];
+		// Grayscale and emphasis bits of $2001 for each scanline, applied by the color conversion
+		uint8_t mScanlineColorBits[PPU_SCREEN_HEIGHT];
+
+		// Scanlines whose output differs from the previous frame, found by hashing each row once the frame is complete
+		// (at vblank, or in the first WaitForFrame after it with render threads). Color bit changes are found at vblank.
+		uint64_t mDirtyScanlines[PPU_DIRTY_WORDS];
+		uint64_t mColorBitsDirty[PPU_DIRTY_WORDS];
+		uint64_t mScanlineHashes[PPU_SCREEN_HEIGHT];
+		uint8_t mPreviousColorBits[PPU_SCREEN_HEIGHT];
+		bool mScanlineHashesValid = false;
+		bool mDirtyScanlinesPending = false;
+
+		// Scanline buffers. Background holds 4-bit palette RAM indices (0 = transparent),
+		// 33 tiles wide so that fine X can start anywhere within the first tile.
+		uint8_t mBgLine[PPU_BG_TILES_PADDED * 8];
+		// Sprite line buffer: palette RAM index (0x10-0x1F, 0 = transparent) and priority/sprite 0 flags.
+		// Padded by a tile so sprites at the right edge can be written 8 pixels at a time.
+		uint8_t mSpriteLine[PPU_SCREEN_WIDTH + 8];
+		uint8_t mSpriteFlags[PPU_SCREEN_WIDTH + 8];
 
+		// Sprites found by the evaluation, in OAM order
+		uint8_t mLineSprites[8];
+		int mLineSpriteScanline = 0;
+
+		// Dots of the current scanline where sprite 0 hit and sprite overflow get set (-1 for none),
+		// predicted for mSpriteEventScanline. Register accesses that change the state invalidate them.
+		int mSprite0HitDot = -1;
+		int mOverflowDot = -1;
+		int mSpriteEventScanline = -1;
+
+		BackgroundRenderPath mBackgroundPath;
+
+		// Background tiles of the current scanline: decoded pattern row, and palette bits (bits 2-3) in every byte
+		uint64_t mBgTileRows[PPU_BG_TILES_PADDED];
+		uint64_t mBgTileAttributes[PPU_BG_TILES_PADDED];
+
+		// Background line with the palette applied, written by BackgroundCached
+		uint8_t mBgColorLine[PPU_BG_TILES_PADDED * 8];
+
+		// Direct-mapped cache of background tile rows, keyed by CHR bank, tile, row and palette.
+		// Entries are invalidated by bumping the generation of the tile (CHR-RAM writes) or palette they were built from.
+		struct TileCacheEntry
+		{
+			uint32_t mKey;
+			uint32_t mTileGeneration;
+			uint32_t mPaletteGeneration;
+			uint64_t mIndices; // palette RAM indices, as in mBgLine
+			uint64_t mColors;
+		};
+		std::vector<TileCacheEntry> mTileCache;
+		uint32_t mTileGenerations[0x200];
+		uint32_t mPaletteGenerations[4];
+		TileCacheStats mTileCacheStats;
+
+		// Background layer of palette RAM indices, as in mBgLine. Tiles are redrawn lazily, one tile row
+		// at a time, when a scanline uses them. Each row has a bit per tile column that's set when the tile
+		// or its attribute quadrant changes.
+		std::vector<uint8_t> mLayer;
+		uint64_t mLayerDirty[PPU_LAYER_TILE_ROWS];
+		uint16_t mLayerPatternTable = 0;
+		int mLayerCHRBank = 0;
+		// The whole layer had to be redrawn during the visible part of this/the previous frame
+		bool mLayerRasterEffects = false;
+		bool mLayerFallback = false;
+
+		void RunDots(int arg_dots);
 		void StartVBlank();
+		void SignalNMI();
+		int GetScanlineLength() const;
+		int GetNextEventDot() const;
+		void RunEvent();
+
+		inline bool IsRenderingEnabled() const { return (mMask & (PPUMASK_BG | PPUMASK_SPRITES)) != 0; }
+
+		void IncrementY();
+		void CopyX();
+		void CopyY();
+		uint16_t GetScanlineV() const;
+
+		void RunScanline(int arg_scanline);
+		void RecordScanline(int arg_scanline);
+		bool SubmitFrame();
+		void RenderThread(int arg_index);
+		void RenderRecordedScanline(const RenderFrame& arg_frame, int arg_scanline);
+		void StopRenderThreads();
+		void RefreshPatternPages();
+		void UpdateColorBitsDirty();
+		void UpdateDirtyScanlines();
+
+		inline uint64_t GetTileRow(uint16_t arg_tile, uint8_t arg_row) const
+		{
+			return mPatternPages[arg_tile >> 6][(arg_tile & 0x3F) * CHR_TILE_ROWS + arg_row];
+		}
+		void FlushScanlines();
+		void RenderScanline(int arg_scanline);
+		void RenderBackground();
+		static BackgroundRenderPath GetFastestTilePath();
+		void RenderBackgroundReference();
+		void FetchBackgroundTiles();
+		void RenderBackgroundCached();
+		const TileCacheEntry& GetCachedTileRow(uint16_t arg_tile, uint8_t arg_row, uint8_t arg_palette);
+		void ClearTileCache();
+		bool RenderBackgroundLayer();
+		void RefreshLayerRow(int arg_tileRow);
+		void InvalidateLayer();
+		void MarkLayerDirty(uint16_t arg_address, uint8_t arg_oldValue, uint8_t arg_newValue);
+		void ApplyBackgroundPalette(uint8_t* out_dest);
+		uint64_t FindSpritesInRange(int arg_scanline) const;
+		int EvaluateSprites(int arg_scanline);
+		uint64_t GetSpriteRow(int arg_sprite, int arg_scanline) const;
+		void PredictSpriteEvents();
+		void RenderSprites(int arg_spriteCount);
+		void CompositeScanline(const uint8_t* arg_bg, uint8_t* out_dest);
+
+		void MapNametables();
+		inline uint8_t& GetNametableByte(uint16_t arg_address) const { return mNametables[(arg_address >> 10) & 0x03][arg_address & 0x03FF]; }
+		uint8_t ReadBus(uint16_t arg_address);
+		void WriteBus(uint16_t arg_address, uint8_t arg_value);
 
 	public:
-		const float TicksPerCPUCycle = 2.3f;
+		const int PPUCyclesPerCPUCycle = 3;
+
+		PPU();
+		~PPU();
+		PPU(const PPU&) = delete;
+		PPU& operator=(const PPU&) = delete;
+
+		void SetROM(ROM* arg_rom);
+
+		/**
+		* Remaps the nametables, for mappers that control mirroring. SetROM resets it to the ROM header's.
+		**/
+		void SetMirroring(NametableMirroring arg_mirroring);
+
+		/**
+		* Runs all pending dots up to the given CPU cycle.
+		* Must be called before any access to the PPU state, and when GetNextEventCycle is reached.
+		**/
+		void CatchUp(uint64_t arg_cpuCycle);
+
+		/**
+		* The CPU cycle of the next event that is visible without accessing the PPU (vblank start, frame end).
+		**/
+		uint64_t GetNextEventCycle() const;
+
+		uint8_t ReadRegister(uint16_t arg_address);
+		void WriteRegister(uint16_t arg_address, uint8_t arg_value);
+
+		/**
+		* Sets the buffer that frames are rendered into: 256x240 bytes, one palette index (0-63) per pixel.
+		* Pass nullptr to not output any pixels.
+		**/
+		void SetFrameBuffer(uint8_t* arg_buffer);
+
+		inline uint64_t GetFrameCount() const { return mFrameCount; }
+
+		/**
+		* The grayscale and emphasis bits of $2001 that each scanline of the frame was rendered with.
+		* The frame buffer only holds palette indices, see PaletteConverter.
+		**/
+		inline const uint8_t* GetScanlineColorBits() const { return mScanlineColorBits; }
+
+		/**
+		* Bitmap of the scanlines of the last frame whose pixels or color bits differ from the frame before
+		* (scanline n is bit n % 64 of word n / 64). Everything is dirty after the frame buffer changes.
+		* With render threads, it's only up to date after WaitForFrame.
+		**/
+		inline const uint64_t* GetDirtyScanlines() const { return mDirtyScanlines; }
+		inline bool IsScanlineDirty(int arg_scanline) const { return (mDirtyScanlines[arg_scanline >> 6] >> (arg_scanline & 63)) & 1; }
+
+		/**
+		* Enables frame-at-once rendering (on by default). Output is identical with it disabled,
+		* which draws every scanline as soon as it is due.
+		**/
+		void SetFrameAtOnceRendering(bool arg_enabled);
+
+		/**
+		* Skips drawing frames, from the next one that starts. Only pixels are skipped: vblank, sprite 0 hit,
+		* overflow and the scroll registers keep their exact timing. The frame buffer, color bits and
+		* dirty scanlines keep the last drawn frame (skipped frames have no dirty scanlines).
+		**/
+		inline void SetSkipRendering(bool arg_skip) { mSkipRendering = arg_skip; }
+		inline const FrameRenderStats& GetFrameRenderStats() const { return mFrameRenderStats; }
+
+		/**
+		* Renders frames on the given number of threads, in bands of scanlines, while the next frame is emulated.
+		* 0 renders on the calling thread. Output is identical either way.
+		* With render threads, a frame is only complete in the frame buffer after WaitForFrame.
+		**/
+		void SetRenderThreads(int arg_count);
+
+		/**
+		* Waits until the render threads have finished the last frame.
+		**/
+		void WaitForFrame();
+
+		/**
+		* Selects how background pixels are generated. All paths produce identical output.
+		* Defaults to the fastest path compiled in. Paths that are not compiled in fall back to BackgroundScalar.
+		**/
+		void SetBackgroundRenderPath(BackgroundRenderPath arg_path);
+		static bool IsBackgroundRenderPathSupported(BackgroundRenderPath arg_path);
+
+		/**
+		* Renders the background of the current scanline repeatedly.
+		* @return Average nanoseconds per scanline.
+		**/
+		double BenchmarkBackground(BackgroundRenderPath arg_path, int arg_scanlines);
 
-		void Tick(int arg_cpucycles);
+		/**
+		* Hit and miss counts of the tile row cache (used by BackgroundCached).
+		**/
+		inline const TileCacheStats& GetTileCacheStats() const { return mTileCacheStats; }
+		inline void ResetTileCacheStats() { mTileCacheStats = TileCacheStats(); }
 
+		/**
+		* Called for each NMI: at vblank, or when NMI is enabled during vblank. Both can happen inside a register
+		* access, in the middle of an instruction, so the callback should only latch the NMI for the CPU to take
+		* after the instruction.
+		**/
 		void SetVBlankCallback(std::function<void()> arg_callback);
 	};
 }
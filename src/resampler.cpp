@@ -0,0 +1,220 @@
+#include "resampler.h"
+
+#include "simd.h"
+#include <algorithm>
+#include <math.h>
+
+namespace nesemu
+{
+	// Passband, as a fraction of the lower Nyquist frequency
+	static const double ResamplerPassband = 0.92;
+
+	Resampler::Resampler()
+	{
+		BuildKernel();
+		UpdateStep();
+		Reset();
+	}
+
+	void Resampler::SetRates(uint32_t arg_inputRate, uint32_t arg_outputRate)
+	{
+		mInputRate = arg_inputRate;
+		mOutputRate = arg_outputRate;
+		BuildKernel();
+		UpdateStep();
+		Reset();
+	}
+
+	void Resampler::SetQuality(ResampleQuality arg_quality)
+	{
+		mQuality = arg_quality;
+		BuildKernel();
+		Reset();
+	}
+
+	void Resampler::SetRatioAdjust(double arg_factor)
+	{
+		mRatioAdjust = arg_factor;
+		UpdateStep();
+	}
+
+	void Resampler::Reset()
+	{
+		mHistory16.assign(mTaps - 1, 0);
+		mHistoryFloat.assign(mTaps - 1, 0.0f);
+		mPosition = 0;
+		mFraction = 0;
+	}
+
+	size_t Resampler::GetMaxOutput(size_t arg_count) const
+	{
+		return (size_t)ceil((arg_count + mTaps) * (double)mOutputRate * 1.01 / mInputRate) + 1;
+	}
+
+	void Resampler::UpdateStep()
+	{
+		mDenominator = (uint64_t)mOutputRate << 16;
+		const uint64_t step = mRatioAdjust == 1.0 ? (uint64_t)mInputRate << 16 : (uint64_t)llround(mInputRate * 65536.0 / mRatioAdjust);
+		mStepWhole = step / mDenominator;
+		mStepFraction = step % mDenominator;
+	}
+
+	void Resampler::BuildKernel()
+	{
+		static const int QualityTaps[] = { 8, 16, 32 };
+		mTaps = QualityTaps[mQuality];
+
+		const double pi = 3.14159265358979323846;
+		const int half = mTaps / 2;
+		const double cutoff = 0.5 * std::min(1.0, (double)mOutputRate / mInputRate) * ResamplerPassband; // cycles per input sample
+		mKernel16.resize((RESAMPLER_PHASES + 1) * mTaps);
+		mKernelFloat.resize((RESAMPLER_PHASES + 1) * mTaps);
+
+		std::vector<double> taps(mTaps);
+		for (int phase = 0; phase <= RESAMPLER_PHASES; phase++)
+		{
+			// Blackman windowed sinc, centered between taps half - 1 and half
+			double sum = 0.0;
+			for (int i = 0; i < mTaps; i++)
+			{
+				const double x = i - (half - 1) - (double)phase / RESAMPLER_PHASES;
+				const double sinc = x == 0.0 ? 1.0 : sin(2.0 * pi * cutoff * x) / (2.0 * pi * cutoff * x);
+				const double window = 0.42 + 0.5 * cos(pi * x / half) + 0.08 * cos(2.0 * pi * x / half);
+				taps[i] = sinc * window;
+				sum += taps[i];
+			}
+
+			// Unity gain in every phase
+			int16_t* row16 = &mKernel16[phase * mTaps];
+			float* rowFloat = &mKernelFloat[phase * mTaps];
+			int total = 0;
+			for (int i = 0; i < mTaps; i++)
+			{
+				rowFloat[i] = (float)(taps[i] / sum);
+				row16[i] = (int16_t)lrint(taps[i] * 32768.0 / sum);
+				total += row16[i];
+			}
+			row16[half - 1] += (int16_t)(32768 - total);
+		}
+	}
+
+	void Resampler::Filter(const int16_t* arg_input, int16_t& out_sample) const
+	{
+		// Nearest phase
+		const int phase = (int)((mFraction * RESAMPLER_PHASES + mDenominator / 2) / mDenominator);
+		const int16_t* kernel = &mKernel16[phase * mTaps];
+
+		int i = 0;
+		int32_t sum = 0;
+#ifdef NESEMU_SSE2
+		__m128i sums = _mm_setzero_si128();
+#ifdef NESEMU_AVX2
+		__m256i sums256 = _mm256_setzero_si256();
+		for (; i + 16 <= mTaps; i += 16)
+		{
+			const __m256i input = _mm256_loadu_si256((const __m256i*)(arg_input + i));
+			sums256 = _mm256_add_epi32(sums256, _mm256_madd_epi16(input, _mm256_loadu_si256((const __m256i*)(kernel + i))));
+		}
+		sums = _mm_add_epi32(_mm256_castsi256_si128(sums256), _mm256_extracti128_si256(sums256, 1));
+#endif
+		for (; i + 8 <= mTaps; i += 8)
+		{
+			const __m128i input = _mm_loadu_si128((const __m128i*)(arg_input + i));
+			sums = _mm_add_epi32(sums, _mm_madd_epi16(input, _mm_loadu_si128((const __m128i*)(kernel + i))));
+		}
+		sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(1, 0, 3, 2)));
+		sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(2, 3, 0, 1)));
+		sum = _mm_cvtsi128_si32(sums);
+#endif
+		for (; i < mTaps; i++)
+			sum += arg_input[i] * kernel[i];
+
+		out_sample = (int16_t)std::min(std::max((sum + 16384) >> 15, -32768), 32767);
+	}
+
+	void Resampler::Filter(const float* arg_input, float& out_sample) const
+	{
+		// Interpolates between the outputs of this phase and the next
+		const uint64_t phasePosition = mFraction * RESAMPLER_PHASES;
+		const float* kernel0 = &mKernelFloat[(phasePosition / mDenominator) * mTaps];
+		const float* kernel1 = kernel0 + mTaps;
+
+		int i = 0;
+		float sum0 = 0.0f;
+		float sum1 = 0.0f;
+#ifdef NESEMU_SSE2
+		__m128 sums0 = _mm_setzero_ps();
+		__m128 sums1 = _mm_setzero_ps();
+#ifdef NESEMU_AVX2
+		__m256 sums0256 = _mm256_setzero_ps();
+		__m256 sums1256 = _mm256_setzero_ps();
+		for (; i + 8 <= mTaps; i += 8)
+		{
+			const __m256 input = _mm256_loadu_ps(arg_input + i);
+			sums0256 = _mm256_add_ps(sums0256, _mm256_mul_ps(input, _mm256_loadu_ps(kernel0 + i)));
+			sums1256 = _mm256_add_ps(sums1256, _mm256_mul_ps(input, _mm256_loadu_ps(kernel1 + i)));
+		}
+		sums0 = _mm_add_ps(_mm256_castps256_ps128(sums0256), _mm256_extractf128_ps(sums0256, 1));
+		sums1 = _mm_add_ps(_mm256_castps256_ps128(sums1256), _mm256_extractf128_ps(sums1256, 1));
+#endif
+		for (; i + 4 <= mTaps; i += 4)
+		{
+			const __m128 input = _mm_loadu_ps(arg_input + i);
+			sums0 = _mm_add_ps(sums0, _mm_mul_ps(input, _mm_loadu_ps(kernel0 + i)));
+			sums1 = _mm_add_ps(sums1, _mm_mul_ps(input, _mm_loadu_ps(kernel1 + i)));
+		}
+		sums0 = _mm_add_ps(sums0, _mm_movehl_ps(sums0, sums0));
+		sums0 = _mm_add_ss(sums0, _mm_shuffle_ps(sums0, sums0, _MM_SHUFFLE(1, 1, 1, 1)));
+		sums1 = _mm_add_ps(sums1, _mm_movehl_ps(sums1, sums1));
+		sums1 = _mm_add_ss(sums1, _mm_shuffle_ps(sums1, sums1, _MM_SHUFFLE(1, 1, 1, 1)));
+		sum0 = _mm_cvtss_f32(sums0);
+		sum1 = _mm_cvtss_f32(sums1);
+#endif
+		for (; i < mTaps; i++)
+		{
+			sum0 += arg_input[i] * kernel0[i];
+			sum1 += arg_input[i] * kernel1[i];
+		}
+
+		const float weight = (float)((double)(phasePosition % mDenominator) / mDenominator);
+		out_sample = sum0 + (sum1 - sum0) * weight;
+	}
+
+	template <typename T>
+	size_t Resampler::Run(std::vector<T>& arg_history, const T* arg_input, size_t arg_count, T* out_samples, size_t arg_maxCount)
+	{
+		arg_history.insert(arg_history.end(), arg_input, arg_input + arg_count);
+
+		size_t count = 0;
+		while (count < arg_maxCount)
+		{
+			if (mPosition + mTaps > arg_history.size())
+				break;
+
+			Filter(&arg_history[mPosition], out_samples[count++]);
+			mPosition += mStepWhole;
+			mFraction += mStepFraction;
+			if (mFraction >= mDenominator)
+			{
+				mFraction -= mDenominator;
+				mPosition++;
+			}
+		}
+
+		// Drop the input before the next output's taps
+		const size_t consumed = std::min(mPosition, arg_history.size());
+		arg_history.erase(arg_history.begin(), arg_history.begin() + consumed);
+		mPosition -= consumed;
+		return count;
+	}
+
+	size_t Resampler::Process(const int16_t* arg_input, size_t arg_count, int16_t* out_samples, size_t arg_maxCount)
+	{
+		return Run(mHistory16, arg_input, arg_count, out_samples, arg_maxCount);
+	}
+
+	size_t Resampler::Process(const float* arg_input, size_t arg_count, float* out_samples, size_t arg_maxCount)
+	{
+		return Run(mHistoryFloat, arg_input, arg_count, out_samples, arg_maxCount);
+	}
+}
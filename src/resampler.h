@@ -0,0 +1,89 @@
+#ifndef NESEMU_RESAMPLER_H
+#define NESEMU_RESAMPLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define RESAMPLER_PHASES	512	// kernel sub-sample positions
+
+namespace nesemu
+{
+	enum ResampleQuality
+	{
+		ResampleFast,		// 8 taps
+		ResampleBalanced,	// 16 taps
+		ResampleBest		// 32 taps
+	};
+
+	/**
+	* Windowed sinc polyphase resampler, from one sample rate to any other (mono).
+	* The ratio can be adjusted continuously for dynamic rate control.
+	* The int16 path uses fixed-point taps of the nearest phase; the float path interpolates between phases.
+	* Output is delayed by half the taps, in input samples. Output times are exact fractions of the input
+	* (without a ratio adjust), so the output never drifts from arg_count * output rate / input rate samples.
+	**/
+	class Resampler
+	{
+	private:
+		uint32_t mInputRate = 48000;
+		uint32_t mOutputRate = 48000;
+		double mRatioAdjust = 1.0;
+		ResampleQuality mQuality = ResampleQuality::ResampleBalanced;
+		int mTaps = 16;
+
+		// [phase][tap]: taps sum to 1 << 15 and 1.0. The float kernel has an extra phase to interpolate towards.
+		std::vector<int16_t> mKernel16;
+		std::vector<float> mKernelFloat;
+
+		// Input samples per output sample, and the position of the next output in the history: whole samples,
+		// and a fraction over mDenominator (the output rate << 16, so that the unadjusted step is exact)
+		uint64_t mDenominator = 48000ull << 16;
+		uint64_t mStepWhole = 1;
+		uint64_t mStepFraction = 0;
+		size_t mPosition = 0;
+		uint64_t mFraction = 0;
+
+		// Unused input, starting with the taps of the next output
+		std::vector<int16_t> mHistory16;
+		std::vector<float> mHistoryFloat;
+
+		void BuildKernel();
+		void UpdateStep();
+		template <typename T> size_t Run(std::vector<T>& arg_history, const T* arg_input, size_t arg_count, T* out_samples, size_t arg_maxCount);
+		void Filter(const int16_t* arg_input, int16_t& out_sample) const;
+		void Filter(const float* arg_input, float& out_sample) const;
+
+	public:
+		Resampler();
+
+		/**
+		* Nominal input and output rates. Rebuilds the kernel, with its cutoff below the lower Nyquist frequency,
+		* and forgets the queued input.
+		**/
+		void SetRates(uint32_t arg_inputRate, uint32_t arg_outputRate);
+		void SetQuality(ResampleQuality arg_quality);
+
+		/**
+		* Multiplies the output rate by a factor close to 1 (dynamic rate control) without rebuilding the kernel.
+		**/
+		void SetRatioAdjust(double arg_factor);
+		inline double GetRatioAdjust() const { return mRatioAdjust; }
+
+		void Reset();
+
+		/**
+		* Upper bound of the samples Process can output for arg_count input samples, with a ratio adjust of up to 1%.
+		**/
+		size_t GetMaxOutput(size_t arg_count) const;
+
+		/**
+		* Queues the input samples and outputs as many samples as they complete, up to arg_maxCount.
+		* @return How many samples were output.
+		**/
+		size_t Process(const int16_t* arg_input, size_t arg_count, int16_t* out_samples, size_t arg_maxCount);
+		size_t Process(const float* arg_input, size_t arg_count, float* out_samples, size_t arg_maxCount);
+	};
+}
+
+#endif
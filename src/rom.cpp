@@ -1,44 +1,70 @@
 #include "rom.h"
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <string.h>
+#include "patch.h"
+#include "simd.h"
 
 namespace nesemu
 {
+	static std::mutex GCacheMutex;
+	// Only the images and overlays in use are cached. Hashes only narrow the search: contents are compared.
+	static std::multimap<uint64_t, std::weak_ptr<const CartridgeImage>> GImageCache;
+	static std::multimap<std::pair<const CartridgeImage*, uint64_t>, std::weak_ptr<const PatchOverlay>> GPatchCache;
+
+	// Drops the entries whose image or overlay isn't used by any ROM anymore
+	template <typename T>
+	static void PruneCache(T& arg_cache)
+	{
+		for (auto it = arg_cache.begin(); it != arg_cache.end();)
+			it = it->second.expired() ? arg_cache.erase(it) : std::next(it);
+	}
+
+	// Backs pages that neither the image nor the overlay covers
+	static const uint8_t ZeroPage[ROM_PAGE_SIZE] = {};
+	static const uint64_t ZeroDecodedPage[CHR_PAGE_ROWS] = {};
+
 	bool ROM::Load(const char* arg_file)
 	{
 		std::cout << "Loading cartridge " << arg_file << "..." << std::endl;
-		std::basic_ifstream<uint8_t> file;
-		file.open(arg_file, std::ios::in | std::ios::binary);
-		if (!file.is_open())
+		std::vector<uint8_t> fileData;
+		if (!ReadFile(arg_file, fileData))
 		{
 			std::cout << "ERROR: Failed to read ROM file" << std::endl;
 			return false;
 		}
 
-		// Read Header
-		file.read(mHeaderBuffer, ROM_HEADER_SIZE);
-
 		// Validate ROM: first 3 bytes should be "NES"
-		if (mHeaderBuffer[0] != 'N' || mHeaderBuffer[1] != 'E' || mHeaderBuffer[2] != 'S')
+		if (fileData.size() < ROM_HEADER_SIZE || fileData[0] != 'N' || fileData[1] != 'E' || fileData[2] != 'S')
 		{
 			std::cout << "ERROR: Invalid ROM file" << std::endl;
 			return false;
 		}
 		std::cout << "NES" << std::endl;
 
-		mPrgCount = mHeaderBuffer[4];
-		mChrCount = mHeaderBuffer[5];;
-		mPrgSize = mPrgCount * 0x4000;
-
-		// Read PRG
-		file.read(mPRGBuffer, mPrgSize);
-
-		// Read CHR
-		file.read(mCHRBuffer, 0x2000 * mChrCount);
-
-		std::cout << mHeaderBuffer[0];
-		std::cout << mHeaderBuffer[1];
-		std::cout << mHeaderBuffer[2];
+		// Identical files share one image
+		const uint64_t hash = Hash(fileData);
+		{
+			std::lock_guard<std::mutex> lock(GCacheMutex);
+			mImage = nullptr;
+			auto range = GImageCache.equal_range(hash);
+			for (auto it = range.first; it != range.second && mImage == nullptr; ++it)
+			{
+				std::shared_ptr<const CartridgeImage> cachedImage = it->second.lock();
+				if (cachedImage != nullptr && IsImageOf(*cachedImage, fileData))
+					mImage = cachedImage;
+			}
+			if (mImage == nullptr)
+			{
+				mImage = CreateImage(fileData, hash);
+				PruneCache(GImageCache);
+				GImageCache.emplace(hash, mImage);
+			}
+		}
+		mOverlay = nullptr;
+		MapPages();
 
 		std::cout << "PrgCount: " << mPrgCount << std::endl;
 		std::cout << "ChrCount: " << mChrCount << std::endl;
@@ -48,21 +74,376 @@ namespace nesemu
 		return true;
 	}
 
+	bool ROM::ApplyPatch(const char* arg_file)
+	{
+		if (mImage == nullptr)
+		{
+			std::cout << "ERROR: No ROM loaded to patch" << std::endl;
+			return false;
+		}
+
+		std::cout << "Applying patch " << arg_file << "..." << std::endl;
+		std::vector<uint8_t> patchData;
+		if (!ReadFile(arg_file, patchData))
+		{
+			std::cout << "ERROR: Failed to read patch file" << std::endl;
+			return false;
+		}
+
+		// Patches always apply to the base image, replacing any previous overlay.
+		// A live overlay keeps its image alive (through the ROM using it), so the image pointer identifies it.
+		const std::pair<const CartridgeImage*, uint64_t> key(mImage.get(), Hash(patchData));
+		std::shared_ptr<const PatchOverlay> overlay;
+		{
+			std::lock_guard<std::mutex> lock(GCacheMutex);
+			auto range = GPatchCache.equal_range(key);
+			for (auto it = range.first; it != range.second && overlay == nullptr; ++it)
+			{
+				std::shared_ptr<const PatchOverlay> cachedOverlay = it->second.lock();
+				if (cachedOverlay != nullptr && cachedOverlay->mPatch == patchData)
+					overlay = cachedOverlay;
+			}
+		}
+
+		if (overlay == nullptr)
+		{
+			overlay = CreateOverlay(*mImage, patchData);
+			if (overlay == nullptr)
+				return false;
+
+			std::lock_guard<std::mutex> lock(GCacheMutex);
+			PruneCache(GPatchCache);
+			GPatchCache.emplace(key, overlay);
+		}
+
+		mOverlay = overlay;
+		MapPages();
+
+		std::cout << "Patched pages: PRG " << mOverlay->mPRGPages.size() << ", CHR " << mOverlay->mCHRPages.size() << std::endl;
+		return true;
+	}
+
+	void ROM::ClearPatchCache()
+	{
+		std::lock_guard<std::mutex> lock(GCacheMutex);
+		GPatchCache.clear();
+	}
+
+	void ROM::MapPages()
+	{
+		mHeader = mOverlay != nullptr ? mOverlay->mHeader : mImage->mHeader;
+
+		mPrgCount = mHeader[4];
+		mChrCount = mHeader[5];
+		if (mPrgCount * 0x4000 > ROM_PRG_SIZE_MAX)
+		{
+			std::cout << "WARNING: PRG-ROM too large, only the first " << ROM_PRG_SIZE_MAX / 0x4000 << " banks are loaded" << std::endl;
+			mPrgCount = ROM_PRG_SIZE_MAX / 0x4000;
+		}
+		if (mChrCount * ROM_CHR_BANK_SIZE > ROM_CHR_SIZE_MAX)
+		{
+			std::cout << "WARNING: CHR-ROM too large, only the first " << ROM_CHR_SIZE_MAX / ROM_CHR_BANK_SIZE << " banks are loaded" << std::endl;
+			mChrCount = ROM_CHR_SIZE_MAX / ROM_CHR_BANK_SIZE;
+		}
+		mPrgSize = mPrgCount * 0x4000;
+
+		for (int page = 0; page < ROM_PRG_SIZE_MAX / ROM_PAGE_SIZE; page++)
+		{
+			const size_t offset = page * ROM_PAGE_SIZE;
+			auto itPatched = mOverlay != nullptr ? mOverlay->mPRGPages.find(page) : std::map<int, std::vector<uint8_t>>::const_iterator();
+			if (mOverlay != nullptr && itPatched != mOverlay->mPRGPages.end())
+				mPRGPages[page] = itPatched->second.data();
+			else if (offset < mImage->mPRG.size())
+				mPRGPages[page] = mImage->mPRG.data() + offset;
+			else
+				mPRGPages[page] = ZeroPage;
+		}
+
+		// No CHR banks means the cartridge has 8KB of CHR-RAM
+		mHasCHRRAM = mChrCount == 0;
+		if (mHasCHRRAM)
+		{
+			mCHRRAM.assign(ROM_CHR_BANK_SIZE, 0);
+			mCHRRAMDecoded.assign(ROM_CHR_BANK_SIZE / CHR_TILE_SIZE * CHR_TILE_ROWS, 0);
+		}
+		else
+		{
+			mCHRRAM.clear();
+			mCHRRAMDecoded.clear();
+		}
+
+		for (int page = 0; page < ROM_CHR_SIZE_MAX / ROM_PAGE_SIZE; page++)
+		{
+			const size_t offset = page * ROM_PAGE_SIZE;
+			if (mHasCHRRAM)
+			{
+				const int ramPage = page % CHR_BANK_PAGES;
+				mCHRPages[page] = mCHRRAM.data() + ramPage * ROM_PAGE_SIZE;
+				mCHRDecodedPages[page] = mCHRRAMDecoded.data() + ramPage * CHR_PAGE_ROWS;
+				continue;
+			}
+
+			auto itPatched = mOverlay != nullptr ? mOverlay->mCHRPages.find(page) : std::map<int, std::vector<uint8_t>>::const_iterator();
+			if (mOverlay != nullptr && itPatched != mOverlay->mCHRPages.end())
+			{
+				mCHRPages[page] = itPatched->second.data();
+				mCHRDecodedPages[page] = mOverlay->mCHRDecodedPages.at(page).data();
+			}
+			else if (offset < mImage->mCHR.size())
+			{
+				mCHRPages[page] = mImage->mCHR.data() + offset;
+				mCHRDecodedPages[page] = mImage->mCHRDecoded.data() + page * CHR_PAGE_ROWS;
+			}
+			else
+			{
+				mCHRPages[page] = ZeroPage;
+				mCHRDecodedPages[page] = ZeroDecodedPage;
+			}
+		}
+
+		SetCHRBank(0);
+	}
+
+	std::shared_ptr<const CartridgeImage> ROM::CreateImage(const std::vector<uint8_t>& arg_file, uint64_t arg_hash)
+	{
+		std::shared_ptr<CartridgeImage> image = std::make_shared<CartridgeImage>();
+		memcpy(image->mHeader, arg_file.data(), ROM_HEADER_SIZE);
+		image->mHash = arg_hash;
+
+		const size_t prgSize = std::min<size_t>(image->mHeader[4] * 0x4000, ROM_PRG_SIZE_MAX);
+		const size_t chrSize = std::min<size_t>(image->mHeader[5] * ROM_CHR_BANK_SIZE, ROM_CHR_SIZE_MAX);
+
+		// Short files are padded with zeroes
+		image->mPRG.assign(prgSize, 0);
+		image->mCHR.assign(chrSize, 0);
+		const size_t prgAvailable = std::min(prgSize, arg_file.size() - ROM_HEADER_SIZE);
+		memcpy(image->mPRG.data(), arg_file.data() + ROM_HEADER_SIZE, prgAvailable);
+		if (arg_file.size() > ROM_HEADER_SIZE + prgSize)
+		{
+			const size_t chrAvailable = std::min(chrSize, arg_file.size() - ROM_HEADER_SIZE - prgSize);
+			memcpy(image->mCHR.data(), arg_file.data() + ROM_HEADER_SIZE + prgSize, chrAvailable);
+		}
+
+		image->mCHRDecoded.resize(chrSize / CHR_TILE_SIZE * CHR_TILE_ROWS);
+		DecodeCHRTiles(image->mCHR.data(), (int)(chrSize / CHR_TILE_SIZE), image->mCHRDecoded.data());
+
+		return image;
+	}
+
+	bool ROM::IsImageOf(const CartridgeImage& arg_image, const std::vector<uint8_t>& arg_file)
+	{
+		// Compares with the layout CreateImage makes, including the zero padding of short files
+		if (memcmp(arg_image.mHeader, arg_file.data(), ROM_HEADER_SIZE) != 0)
+			return false;
+
+		auto matches = [&](const std::vector<uint8_t>& arg_data, size_t arg_offset)
+		{
+			const size_t available = arg_file.size() > arg_offset ? std::min(arg_data.size(), arg_file.size() - arg_offset) : 0;
+			if (available > 0 && memcmp(arg_data.data(), arg_file.data() + arg_offset, available) != 0)
+				return false;
+			return std::all_of(arg_data.begin() + available, arg_data.end(), [](uint8_t arg_byte) { return arg_byte == 0; });
+		};
+		return matches(arg_image.mPRG, ROM_HEADER_SIZE) && matches(arg_image.mCHR, ROM_HEADER_SIZE + arg_image.mPRG.size());
+	}
+
+	std::shared_ptr<const PatchOverlay> ROM::CreateOverlay(const CartridgeImage& arg_image, const std::vector<uint8_t>& arg_patch)
+	{
+		// Patch offsets are relative to the iNES file, so rebuild the file layout from the image
+		std::vector<uint8_t> source(arg_image.mHeader, arg_image.mHeader + ROM_HEADER_SIZE);
+		source.insert(source.end(), arg_image.mPRG.begin(), arg_image.mPRG.end());
+		source.insert(source.end(), arg_image.mCHR.begin(), arg_image.mCHR.end());
+
+		std::vector<uint8_t> target;
+		if (!Patch::Apply(arg_patch, source, target))
+			return nullptr;
+
+		if (target.size() < ROM_HEADER_SIZE || target[0] != 'N' || target[1] != 'E' || target[2] != 'S')
+		{
+			std::cout << "ERROR: Patched ROM is not a valid ROM file" << std::endl;
+			return nullptr;
+		}
+
+		std::shared_ptr<PatchOverlay> overlay = std::make_shared<PatchOverlay>();
+		overlay->mPatch = arg_patch;
+		memcpy(overlay->mHeader, target.data(), ROM_HEADER_SIZE);
+
+		const size_t prgSize = std::min<size_t>(overlay->mHeader[4] * 0x4000, ROM_PRG_SIZE_MAX);
+		const size_t chrSize = std::min<size_t>(overlay->mHeader[5] * ROM_CHR_BANK_SIZE, ROM_CHR_SIZE_MAX);
+		target.resize(ROM_HEADER_SIZE + prgSize + chrSize, 0);
+
+		// Keep only the pages that differ from the base image
+		const uint8_t* targetPRG = target.data() + ROM_HEADER_SIZE;
+		for (size_t offset = 0; offset < prgSize; offset += ROM_PAGE_SIZE)
+		{
+			const uint8_t* page = targetPRG + offset;
+			if (offset < arg_image.mPRG.size() && memcmp(page, arg_image.mPRG.data() + offset, ROM_PAGE_SIZE) == 0)
+				continue;
+			overlay->mPRGPages[(int)(offset / ROM_PAGE_SIZE)].assign(page, page + ROM_PAGE_SIZE);
+		}
+
+		const uint8_t* targetCHR = targetPRG + prgSize;
+		for (size_t offset = 0; offset < chrSize; offset += ROM_PAGE_SIZE)
+		{
+			const uint8_t* page = targetCHR + offset;
+			if (offset < arg_image.mCHR.size() && memcmp(page, arg_image.mCHR.data() + offset, ROM_PAGE_SIZE) == 0)
+				continue;
+			const int pageIndex = (int)(offset / ROM_PAGE_SIZE);
+			overlay->mCHRPages[pageIndex].assign(page, page + ROM_PAGE_SIZE);
+			std::vector<uint64_t>& decoded = overlay->mCHRDecodedPages[pageIndex];
+			decoded.resize(CHR_PAGE_ROWS);
+			DecodeCHRTiles(page, ROM_PAGE_SIZE / CHR_TILE_SIZE, decoded.data());
+		}
+
+		return overlay;
+	}
+
+	bool ROM::ReadFile(const char* arg_file, std::vector<uint8_t>& out_data)
+	{
+		std::ifstream file;
+		file.open(arg_file, std::ios::in | std::ios::binary | std::ios::ate);
+		if (!file.is_open())
+			return false;
+
+		const std::streamoff size = file.tellg();
+		file.seekg(0, std::ios::beg);
+		out_data.resize((size_t)size);
+		file.read(reinterpret_cast<char*>(out_data.data()), size);
+		return file.good();
+	}
+
+	// FNV-1a
+	uint64_t ROM::Hash(const std::vector<uint8_t>& arg_data)
+	{
+		uint64_t hash = 0xCBF29CE484222325ULL;
+		for (uint8_t byte : arg_data)
+		{
+			hash ^= byte;
+			hash *= 0x100000001B3ULL;
+		}
+		return hash;
+	}
+
 	void ROM::CopyToMemory()
 	{
-		if (mPrgCount == 1)
+		const int pageCount = mPrgCount == 1 ? 0x4000 / ROM_PAGE_SIZE : 0x8000 / ROM_PAGE_SIZE;
+		for (int page = 0; page < pageCount; page++)
 		{
-			GMemory->Write(0x8000, &mPRGBuffer, 0x4000);
-			GMemory->Write(0xC000, &mPRGBuffer, 0x4000);
+			void* pageData = const_cast<uint8_t*>(mPRGPages[page]);
+			GMemory->Write(0x8000 + page * ROM_PAGE_SIZE, pageData, ROM_PAGE_SIZE);
+			if (mPrgCount == 1)
+			{
+				GMemory->Write(0xC000 + page * ROM_PAGE_SIZE, pageData, ROM_PAGE_SIZE);
+			}
 		}
+	}
+
+	void ROM::SetCHRBank(int arg_bank)
+	{
+		const int bankCount = mHasCHRRAM ? 1 : mChrCount;
+		if (bankCount > 0)
+			arg_bank %= bankCount;
 		else
+			arg_bank = 0;
+
+		mCHRBankIndex = arg_bank;
+		for (int page = 0; page < CHR_BANK_PAGES; page++)
+		{
+			mCHRBank[page] = mCHRPages[arg_bank * CHR_BANK_PAGES + page];
+			mCHRDecodedBank[page] = mCHRDecodedPages[arg_bank * CHR_BANK_PAGES + page];
+		}
+	}
+
+	NametableMirroring ROM::GetMirroring() const
+	{
+		// Flags 6: bit 0 = vertical arrangement, bit 3 = four-screen VRAM
+		if (mHeader[6] & 0x08)
+			return NametableMirroring::FourScreenMirroring;
+		return (mHeader[6] & 0x01) ? NametableMirroring::VerticalMirroring : NametableMirroring::HorizontalMirroring;
+	}
+
+	uint8_t ROM::ReadCHR(uint16_t arg_address)
+	{
+		arg_address &= (ROM_CHR_BANK_SIZE - 1);
+		return mCHRBank[arg_address / ROM_PAGE_SIZE][arg_address & (ROM_PAGE_SIZE - 1)];
+	}
+
+	void ROM::WriteCHR(uint16_t arg_address, uint8_t arg_value)
+	{
+		if (!mHasCHRRAM)
+			return;
+
+		arg_address &= (ROM_CHR_BANK_SIZE - 1);
+		mCHRRAM[arg_address] = arg_value;
+
+		// Both bitplanes of the row are needed: plane 0 at +0, plane 1 at +8
+		const uint16_t tile = arg_address / CHR_TILE_SIZE;
+		const uint8_t row = arg_address & 0x07;
+		const uint8_t* tileData = mCHRRAM.data() + tile * CHR_TILE_SIZE;
+		mCHRRAMDecoded[tile * CHR_TILE_ROWS + row] = DecodeCHRRow(tileData[row], tileData[row + 8]);
+	}
+
+	uint64_t ROM::DecodeCHRRow(uint8_t arg_plane0, uint8_t arg_plane1)
+	{
+		uint64_t row = 0;
+		for (int x = 0; x < 8; x++)
 		{
-			GMemory->Write(0x8000, &mPRGBuffer, 0x8000);
+			const uint64_t pixel = ((arg_plane0 >> (7 - x)) & 1) | (((arg_plane1 >> (7 - x)) & 1) << 1);
+			row |= pixel << (x * 8);
 		}
+		return row;
+	}
 
-		if (mChrCount > 0)
+	// https://wiki.nesdev.com/w/index.php/PPU_pattern_tables
+	void ROM::DecodeCHRTiles(const uint8_t* arg_src, int arg_tiles, uint64_t* out_rows)
+	{
+#ifdef NESEMU_SSE2
+		// Bit 7 is the leftmost pixel
+		const __m128i bitMask = _mm_setr_epi8(
+			(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+			(char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+		const __m128i one = _mm_set1_epi8(1);
+		const __m128i two = _mm_set1_epi8(2);
+
+		for (int t = 0; t < arg_tiles; t++)
+		{
+			const uint8_t* tile = arg_src + t * CHR_TILE_SIZE;
+			const __m128i p0 = _mm_loadl_epi64((const __m128i*)tile);
+			const __m128i p1 = _mm_loadl_epi64((const __m128i*)(tile + 8));
+
+			// Broadcast each row byte to 8 lanes: r0 r0 r1 r1 ... -> r0 x4 r1 x4 ... -> two rows per register
+			const __m128i p0b = _mm_unpacklo_epi8(p0, p0);
+			const __m128i p1b = _mm_unpacklo_epi8(p1, p1);
+			const __m128i p0w[2] = { _mm_unpacklo_epi16(p0b, p0b), _mm_unpackhi_epi16(p0b, p0b) };
+			const __m128i p1w[2] = { _mm_unpacklo_epi16(p1b, p1b), _mm_unpackhi_epi16(p1b, p1b) };
+
+			__m128i* dest = (__m128i*)(out_rows + t * CHR_TILE_ROWS);
+			for (int i = 0; i < 2; i++)
+			{
+				const __m128i lo0 = _mm_unpacklo_epi32(p0w[i], p0w[i]);
+				const __m128i hi0 = _mm_unpackhi_epi32(p0w[i], p0w[i]);
+				const __m128i lo1 = _mm_unpacklo_epi32(p1w[i], p1w[i]);
+				const __m128i hi1 = _mm_unpackhi_epi32(p1w[i], p1w[i]);
+
+				const __m128i lo = _mm_or_si128(
+					_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lo0, bitMask), bitMask), one),
+					_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lo1, bitMask), bitMask), two));
+				const __m128i hi = _mm_or_si128(
+					_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(hi0, bitMask), bitMask), one),
+					_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(hi1, bitMask), bitMask), two));
+
+				_mm_storeu_si128(dest + i * 2, lo);
+				_mm_storeu_si128(dest + i * 2 + 1, hi);
+			}
+		}
+#else
+		for (int t = 0; t < arg_tiles; t++)
 		{
-			GMemory->Write(0x0000, &mPRGBuffer, 0x2000); // ???
+			const uint8_t* tile = arg_src + t * CHR_TILE_SIZE;
+			for (int row = 0; row < CHR_TILE_ROWS; row++)
+			{
+				out_rows[t * CHR_TILE_ROWS + row] = DecodeCHRRow(tile[row], tile[row + 8]);
+			}
 		}
+#endif
 	}
 }
@@ -2,28 +2,153 @@
 #define NESEMU_ROM_H
 
 #include <stdint.h>
+#include <map>
+#include <memory>
+#include <vector>
 #include "memory.h"
 
 #define ROM_HEADER_SIZE		0x10
 #define ROM_PRG_SIZE_MAX	0x8000
+#define ROM_CHR_SIZE_MAX	0x8000
+#define ROM_CHR_BANK_SIZE	0x2000
+#define ROM_PAGE_SIZE		0x400 // 1KB, granularity of patch overlays
+
+#define CHR_TILE_SIZE		0x10 // two 8 byte bitplanes
+#define CHR_TILE_ROWS		8
+#define CHR_PAGE_ROWS		(ROM_PAGE_SIZE / CHR_TILE_SIZE * CHR_TILE_ROWS)
+#define CHR_BANK_PAGES		(ROM_CHR_BANK_SIZE / ROM_PAGE_SIZE)
 
 namespace nesemu
 {
+	// https://wiki.nesdev.com/w/index.php/Mirroring#Nametable_Mirroring
+	enum NametableMirroring
+	{
+		HorizontalMirroring,
+		VerticalMirroring,
+		FourScreenMirroring,
+		SingleScreenLowerMirroring, // mapper controlled, all four nametables on one 1KB page
+		SingleScreenUpperMirroring
+	};
+
+	/**
+	* Immutable cartridge contents, shared by all ROMs loaded from identical files.
+	**/
+	struct CartridgeImage
+	{
+		uint8_t mHeader[ROM_HEADER_SIZE];
+		std::vector<uint8_t> mPRG;
+		std::vector<uint8_t> mCHR;
+
+		// Pre-decoded CHR: one uint64_t per tile row, holding 8 chunky pixels (values 0-3).
+		// The leftmost pixel is stored in the lowest byte, so a row can be stored directly into a scanline buffer.
+		std::vector<uint64_t> mCHRDecoded;
+
+		uint64_t mHash = 0;
+	};
+
+	/**
+	* The pages of a patched cartridge that differ from its base image.
+	* Shared by all ROMs with the same base image and patch.
+	**/
+	struct PatchOverlay
+	{
+		uint8_t mHeader[ROM_HEADER_SIZE];
+		std::map<int, std::vector<uint8_t>> mPRGPages;
+		std::map<int, std::vector<uint8_t>> mCHRPages;
+		std::map<int, std::vector<uint64_t>> mCHRDecodedPages;
+
+		std::vector<uint8_t> mPatch; // the patch file, to tell patches with the same hash apart
+	};
+
 	// https://wiki.nesdev.com/w/index.php/INES
 	class ROM
 	{
 	private:
-		uint8_t mHeaderBuffer[ROM_HEADER_SIZE];
-		uint8_t mPRGBuffer[ROM_PRG_SIZE_MAX];
-		uint8_t mCHRBuffer[ROM_PRG_SIZE_MAX];
+		std::shared_ptr<const CartridgeImage> mImage;
+		std::shared_ptr<const PatchOverlay> mOverlay;
+		const uint8_t* mHeader = nullptr;
+
+		// Page tables into the base image, or into the overlay for patched pages
+		const uint8_t* mPRGPages[ROM_PRG_SIZE_MAX / ROM_PAGE_SIZE];
+		const uint8_t* mCHRPages[ROM_CHR_SIZE_MAX / ROM_PAGE_SIZE];
+		const uint64_t* mCHRDecodedPages[ROM_CHR_SIZE_MAX / ROM_PAGE_SIZE];
+
+		// CHR-RAM is owned by each ROM, and only allocated when the cartridge has no CHR-ROM
+		std::vector<uint8_t> mCHRRAM;
+		std::vector<uint64_t> mCHRRAMDecoded;
+
+		// Currently mapped 8KB CHR bank (pattern tables $0000-$1FFF)
+		const uint8_t* mCHRBank[CHR_BANK_PAGES];
+		const uint64_t* mCHRDecodedBank[CHR_BANK_PAGES];
+		int mCHRBankIndex = 0;
 
 		int mPrgCount;
 		int mChrCount;
 		int mPrgSize;
+		bool mHasCHRRAM = false;
+
+		void MapPages();
+
+		static std::shared_ptr<const CartridgeImage> CreateImage(const std::vector<uint8_t>& arg_file, uint64_t arg_hash);
+		static std::shared_ptr<const PatchOverlay> CreateOverlay(const CartridgeImage& arg_image, const std::vector<uint8_t>& arg_patch);
+		static bool IsImageOf(const CartridgeImage& arg_image, const std::vector<uint8_t>& arg_file);
+		static bool ReadFile(const char* arg_file, std::vector<uint8_t>& out_data);
+		static uint64_t Hash(const std::vector<uint8_t>& arg_data);
+
+		static void DecodeCHRTiles(const uint8_t* arg_src, int arg_tiles, uint64_t* out_rows);
+		static uint64_t DecodeCHRRow(uint8_t arg_plane0, uint8_t arg_plane1);
 
 	public:
 		bool Load(const char* arg_file);
+
+		/**
+		* Applies an IPS or BPS patch as a copy-on-write overlay on the loaded image.
+		* Only the 1KB pages changed by the patch are duplicated, and while the overlay is in use,
+		* other ROMs applying the same patch to the same image share it.
+		**/
+		bool ApplyPatch(const char* arg_file);
+
 		void CopyToMemory();
+
+		/**
+		* Maps an 8KB CHR bank into the pattern tables.
+		* The bank is already decoded, so this only moves the bank pointers.
+		**/
+		void SetCHRBank(int arg_bank);
+		inline int GetCHRBank() const { return mCHRBankIndex; }
+
+		uint8_t ReadCHR(uint16_t arg_address);
+
+		/**
+		* Writes to CHR-RAM. Only the touched tile row is re-decoded.
+		* Ignored for cartridges with CHR-ROM.
+		**/
+		void WriteCHR(uint16_t arg_address, uint8_t arg_value);
+
+		/**
+		* Gets a decoded row of a tile in the mapped CHR bank.
+		* @param arg_tile Tile index (0-511). Bit 8 selects the pattern table.
+		* @param arg_row Row in the tile (0-7).
+		**/
+		inline uint64_t GetTileRow(uint16_t arg_tile, uint8_t arg_row) const
+		{
+			return mCHRDecodedBank[arg_tile >> 6][(arg_tile & 0x3F) * CHR_TILE_ROWS + arg_row];
+		}
+
+		/**
+		* Gets the decoded rows of a 1KB page (64 tiles) of the mapped CHR bank.
+		**/
+		inline const uint64_t* GetDecodedCHRPage(int arg_page) const { return mCHRDecodedBank[arg_page]; }
+
+		inline bool HasCHRRAM() const { return mHasCHRRAM; }
+
+		NametableMirroring GetMirroring() const;
+
+		/**
+		* Forgets all cached patch overlays, so the next ApplyPatch of each patch creates a new one.
+		* ROMs using them keep their references. Unused overlays are freed anyway.
+		**/
+		static void ClearPatchCache();
 	};
 }
 
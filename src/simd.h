@@ -0,0 +1,28 @@
+#ifndef NESEMU_SIMD_H
+#define NESEMU_SIMD_H
+
+// Compile-time selection of the vector paths, from the compiler's target (see NESEMU_SIMD in CMakeLists.txt).
+// MSVC has no SSSE3 switch, so the build defines NESEMU_SSSE3 itself.
+// Every SIMD routine also has a scalar path, used when none of these are defined.
+
+#if defined(__AVX2__)
+#define NESEMU_AVX2
+#endif
+
+#if (defined(NESEMU_AVX2) || defined(__SSSE3__)) && !defined(NESEMU_SSSE3)
+#define NESEMU_SSSE3
+#endif
+
+#if defined(NESEMU_SSSE3) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NESEMU_SSE2
+#endif
+
+#if defined(NESEMU_AVX2)
+#include <immintrin.h>
+#elif defined(NESEMU_SSSE3)
+#include <tmmintrin.h>
+#elif defined(NESEMU_SSE2)
+#include <emmintrin.h>
+#endif
+
+#endif
@@ -0,0 +1,418 @@
+#include "upscaler.h"
+
+#include "simd.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+namespace nesemu
+{
+	// YUV keys are bytes Y, Y, U, V, so that the sum of absolute byte differences weighs luma twice.
+	// HQ2x treats pixels as similar when Y, U and V differ by at most 48, 7 and 6.
+	static const uint32_t SimilarThresholds = 0x06073030;
+
+	static inline uint32_t GetKey(uint32_t arg_pixel)
+	{
+		const int r = arg_pixel & 0xFF;
+		const int g = (arg_pixel >> 8) & 0xFF;
+		const int b = (arg_pixel >> 16) & 0xFF;
+		const uint32_t y = (77 * r + 150 * g + 29 * b) >> 8;
+		const uint32_t u = 128 + ((-43 * r - 85 * g + 128 * b) >> 8);
+		const uint32_t v = 128 + ((128 * r - 107 * g - 21 * b) >> 8);
+		return y | (y << 8) | (u << 16) | (v << 24);
+	}
+
+	// Per byte average, rounding up (same as pavgb)
+	static inline uint32_t Average(uint32_t arg_a, uint32_t arg_b)
+	{
+		return (arg_a | arg_b) - (((arg_a ^ arg_b) >> 1) & 0x7F7F7F7F);
+	}
+
+	static inline bool IsSimilar(uint32_t arg_keyA, uint32_t arg_keyB)
+	{
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			const int a = (arg_keyA >> shift) & 0xFF;
+			const int b = (arg_keyB >> shift) & 0xFF;
+			if (std::abs(a - b) > (int)((SimilarThresholds >> shift) & 0xFF))
+				return false;
+		}
+		return true;
+	}
+
+	static inline int GetDistance(uint32_t arg_keyA, uint32_t arg_keyB)
+	{
+		int distance = 0;
+		for (int shift = 0; shift < 32; shift += 8)
+			distance += std::abs((int)((arg_keyA >> shift) & 0xFF) - (int)((arg_keyB >> shift) & 0xFF));
+		return distance;
+	}
+
+	// Neighbours of a padded pixel:
+	// A B C
+	// D E F
+	// G H I
+	static inline void Scale2xPixel(const uint32_t* arg_pixel, int arg_stride, uint32_t* out_pixels)
+	{
+		const uint32_t b = arg_pixel[-arg_stride], d = arg_pixel[-1], e = arg_pixel[0], f = arg_pixel[1], h = arg_pixel[arg_stride];
+		const bool active = b != h && d != f;
+		out_pixels[0] = active && d == b ? d : e;
+		out_pixels[1] = active && b == f ? f : e;
+		out_pixels[2] = active && d == h ? d : e;
+		out_pixels[3] = active && h == f ? f : e;
+	}
+
+	static inline void Scale3xPixel(const uint32_t* arg_pixel, int arg_stride, uint32_t* out_pixels)
+	{
+		const uint32_t a = arg_pixel[-arg_stride - 1], b = arg_pixel[-arg_stride], c = arg_pixel[-arg_stride + 1];
+		const uint32_t d = arg_pixel[-1], e = arg_pixel[0], f = arg_pixel[1];
+		const uint32_t g = arg_pixel[arg_stride - 1], h = arg_pixel[arg_stride], i = arg_pixel[arg_stride + 1];
+		const bool active = b != h && d != f;
+		const bool db = active && d == b, bf = active && b == f, dh = active && d == h, hf = active && h == f;
+		out_pixels[0] = db ? d : e;
+		out_pixels[1] = (db && e != c) || (bf && e != a) ? b : e;
+		out_pixels[2] = bf ? f : e;
+		out_pixels[3] = (db && e != g) || (dh && e != a) ? d : e;
+		out_pixels[4] = e;
+		out_pixels[5] = (bf && e != i) || (hf && e != c) ? f : e;
+		out_pixels[6] = dh ? d : e;
+		out_pixels[7] = (dh && e != i) || (hf && e != g) ? h : e;
+		out_pixels[8] = hf ? f : e;
+	}
+
+	// HQ2x corner towards diagonal neighbour x, between side neighbours p and q
+	static inline uint32_t HQ2xCorner(uint32_t arg_e, uint32_t arg_x, uint32_t arg_p, uint32_t arg_q,
+		uint32_t arg_keyE, uint32_t arg_keyX, uint32_t arg_keyP, uint32_t arg_keyQ)
+	{
+		// An edge across the corner: blend towards the neighbours that form it
+		if (!IsSimilar(arg_keyE, arg_keyP) && !IsSimilar(arg_keyE, arg_keyQ) && IsSimilar(arg_keyP, arg_keyQ))
+			return Average(arg_e, Average(arg_p, arg_q));
+		// Otherwise soften a differing diagonal
+		if (!IsSimilar(arg_keyE, arg_keyX))
+			return Average(arg_e, Average(arg_e, arg_x));
+		return arg_e;
+	}
+
+	static inline void HQ2xPixel(const uint32_t* arg_pixel, const uint32_t* arg_key, int arg_stride, uint32_t* out_pixels)
+	{
+		const int s = arg_stride;
+		out_pixels[0] = HQ2xCorner(arg_pixel[0], arg_pixel[-s - 1], arg_pixel[-1], arg_pixel[-s], arg_key[0], arg_key[-s - 1], arg_key[-1], arg_key[-s]);
+		out_pixels[1] = HQ2xCorner(arg_pixel[0], arg_pixel[-s + 1], arg_pixel[1], arg_pixel[-s], arg_key[0], arg_key[-s + 1], arg_key[1], arg_key[-s]);
+		out_pixels[2] = HQ2xCorner(arg_pixel[0], arg_pixel[s - 1], arg_pixel[-1], arg_pixel[s], arg_key[0], arg_key[s - 1], arg_key[-1], arg_key[s]);
+		out_pixels[3] = HQ2xCorner(arg_pixel[0], arg_pixel[s + 1], arg_pixel[1], arg_pixel[s], arg_key[0], arg_key[s + 1], arg_key[1], arg_key[s]);
+	}
+
+	// xBR corner towards diagonal neighbour x, between side neighbours p and q.
+	// pc and qc are the other diagonals next to p and q, po and qo the side neighbours opposite p and q.
+	static inline uint32_t XBRCorner(uint32_t arg_e, uint32_t arg_p, uint32_t arg_q, uint32_t arg_keyE, uint32_t arg_keyX,
+		uint32_t arg_keyP, uint32_t arg_keyQ, uint32_t arg_keyPC, uint32_t arg_keyQC, uint32_t arg_keyPO, uint32_t arg_keyQO)
+	{
+		if (arg_e == arg_p || arg_e == arg_q)
+			return arg_e;
+		// Edge along p-q if that direction is smoother than across it
+		const int along = GetDistance(arg_keyE, arg_keyPC) + GetDistance(arg_keyE, arg_keyQC) + 4 * GetDistance(arg_keyP, arg_keyQ);
+		const int across = GetDistance(arg_keyQ, arg_keyPO) + GetDistance(arg_keyP, arg_keyQO) + 4 * GetDistance(arg_keyE, arg_keyX);
+		if (along >= across)
+			return arg_e;
+		return Average(arg_e, GetDistance(arg_keyE, arg_keyP) <= GetDistance(arg_keyE, arg_keyQ) ? arg_p : arg_q);
+	}
+
+	static inline void XBR2xPixel(const uint32_t* arg_pixel, const uint32_t* arg_key, int arg_stride, uint32_t* out_pixels)
+	{
+		const int s = arg_stride;
+		const uint32_t* k = arg_key;
+		const uint32_t* p = arg_pixel;
+		out_pixels[0] = XBRCorner(p[0], p[-1], p[-s], k[0], k[-s - 1], k[-1], k[-s], k[s - 1], k[-s + 1], k[1], k[s]);
+		out_pixels[1] = XBRCorner(p[0], p[1], p[-s], k[0], k[-s + 1], k[1], k[-s], k[s + 1], k[-s - 1], k[-1], k[s]);
+		out_pixels[2] = XBRCorner(p[0], p[-1], p[s], k[0], k[s - 1], k[-1], k[s], k[-s - 1], k[s + 1], k[1], k[-s]);
+		out_pixels[3] = XBRCorner(p[0], p[1], p[s], k[0], k[s + 1], k[1], k[s], k[-s + 1], k[s - 1], k[-1], k[-s]);
+	}
+
+	static inline void Store2x(const uint32_t* arg_pixels, int arg_x, uint8_t* out_row0, uint8_t* out_row1)
+	{
+		memcpy(out_row0 + arg_x * 8, arg_pixels, 8);
+		memcpy(out_row1 + arg_x * 8, arg_pixels + 2, 8);
+	}
+
+#ifdef NESEMU_SSE2
+	static inline __m128i Load(const uint32_t* arg_pixels)
+	{
+		return _mm_loadu_si128((const __m128i*)arg_pixels);
+	}
+
+	static inline __m128i Select(__m128i arg_mask, __m128i arg_a, __m128i arg_b)
+	{
+		return _mm_or_si128(_mm_and_si128(arg_mask, arg_a), _mm_andnot_si128(arg_mask, arg_b));
+	}
+
+	static inline __m128i IsSimilar(__m128i arg_keyA, __m128i arg_keyB)
+	{
+		const __m128i difference = _mm_or_si128(_mm_subs_epu8(arg_keyA, arg_keyB), _mm_subs_epu8(arg_keyB, arg_keyA));
+		const __m128i over = _mm_subs_epu8(difference, _mm_set1_epi32(SimilarThresholds));
+		return _mm_cmpeq_epi32(over, _mm_setzero_si128());
+	}
+
+	static inline __m128i GetDistance(__m128i arg_keyA, __m128i arg_keyB)
+	{
+		const __m128i difference = _mm_or_si128(_mm_subs_epu8(arg_keyA, arg_keyB), _mm_subs_epu8(arg_keyB, arg_keyA));
+		const __m128i pairs = _mm_add_epi16(_mm_and_si128(difference, _mm_set1_epi16(0x00FF)), _mm_srli_epi16(difference, 8));
+		return _mm_madd_epi16(pairs, _mm_set1_epi16(1));
+	}
+
+	static inline __m128i HQ2xCorner(__m128i arg_e, __m128i arg_x, __m128i arg_p, __m128i arg_q,
+		__m128i arg_keyE, __m128i arg_keyX, __m128i arg_keyP, __m128i arg_keyQ)
+	{
+		const __m128i edge = _mm_andnot_si128(_mm_or_si128(IsSimilar(arg_keyE, arg_keyP), IsSimilar(arg_keyE, arg_keyQ)), IsSimilar(arg_keyP, arg_keyQ));
+		const __m128i diagonal = IsSimilar(arg_keyE, arg_keyX);
+		const __m128i soft = Select(diagonal, arg_e, _mm_avg_epu8(arg_e, _mm_avg_epu8(arg_e, arg_x)));
+		return Select(edge, _mm_avg_epu8(arg_e, _mm_avg_epu8(arg_p, arg_q)), soft);
+	}
+
+	static inline __m128i XBRCorner(__m128i arg_e, __m128i arg_p, __m128i arg_q, __m128i arg_keyE, __m128i arg_keyX,
+		__m128i arg_keyP, __m128i arg_keyQ, __m128i arg_keyPC, __m128i arg_keyQC, __m128i arg_keyPO, __m128i arg_keyQO)
+	{
+		const __m128i along = _mm_add_epi32(_mm_add_epi32(GetDistance(arg_keyE, arg_keyPC), GetDistance(arg_keyE, arg_keyQC)),
+			_mm_slli_epi32(GetDistance(arg_keyP, arg_keyQ), 2));
+		const __m128i across = _mm_add_epi32(_mm_add_epi32(GetDistance(arg_keyQ, arg_keyPO), GetDistance(arg_keyP, arg_keyQO)),
+			_mm_slli_epi32(GetDistance(arg_keyE, arg_keyX), 2));
+		const __m128i same = _mm_or_si128(_mm_cmpeq_epi32(arg_e, arg_p), _mm_cmpeq_epi32(arg_e, arg_q));
+		const __m128i edge = _mm_andnot_si128(same, _mm_cmplt_epi32(along, across));
+		// p when it's at least as close as q
+		const __m128i closer = Select(_mm_cmpgt_epi32(GetDistance(arg_keyE, arg_keyP), GetDistance(arg_keyE, arg_keyQ)), arg_q, arg_p);
+		return Select(edge, _mm_avg_epu8(arg_e, closer), arg_e);
+	}
+
+	// Interleaves the quadrants of 4 pixels into 8 pixels of each output row
+	static inline void Store2x(__m128i arg_topLeft, __m128i arg_topRight, __m128i arg_bottomLeft, __m128i arg_bottomRight,
+		int arg_x, uint8_t* out_row0, uint8_t* out_row1)
+	{
+		_mm_storeu_si128((__m128i*)(out_row0 + arg_x * 8), _mm_unpacklo_epi32(arg_topLeft, arg_topRight));
+		_mm_storeu_si128((__m128i*)(out_row0 + arg_x * 8 + 16), _mm_unpackhi_epi32(arg_topLeft, arg_topRight));
+		_mm_storeu_si128((__m128i*)(out_row1 + arg_x * 8), _mm_unpacklo_epi32(arg_bottomLeft, arg_bottomRight));
+		_mm_storeu_si128((__m128i*)(out_row1 + arg_x * 8 + 16), _mm_unpackhi_epi32(arg_bottomLeft, arg_bottomRight));
+	}
+
+	// Interleaves the left, middle and right thirds of 4 pixels into 12 pixels of an output row
+	static inline void Store3x(__m128i arg_left, __m128i arg_middle, __m128i arg_right, int arg_x, uint8_t* out_row)
+	{
+		// l0 m0 r0 l1 | m1 r1 l2 m2 | r2 l3 m3 r3
+		const __m128i leftMiddleLow = _mm_unpacklo_epi32(arg_left, arg_middle);
+		const __m128i leftMiddleHigh = _mm_unpackhi_epi32(arg_left, arg_middle);
+		const __m128i first = _mm_unpacklo_epi64(leftMiddleLow, _mm_unpacklo_epi32(arg_right, _mm_srli_si128(arg_left, 4)));
+		const __m128i second = _mm_unpacklo_epi64(_mm_unpacklo_epi32(_mm_srli_si128(arg_middle, 4), _mm_srli_si128(arg_right, 4)), leftMiddleHigh);
+		const __m128i third = _mm_unpacklo_epi64(_mm_unpacklo_epi32(_mm_srli_si128(arg_right, 8), _mm_srli_si128(arg_left, 12)),
+			_mm_unpackhi_epi64(_mm_unpackhi_epi32(arg_middle, arg_right), _mm_setzero_si128()));
+		_mm_storeu_si128((__m128i*)(out_row + arg_x * 12), first);
+		_mm_storeu_si128((__m128i*)(out_row + arg_x * 12 + 16), second);
+		_mm_storeu_si128((__m128i*)(out_row + arg_x * 12 + 32), third);
+	}
+#endif
+
+	int Upscaler::GetScaleFactor(UpscaleFilter arg_filter)
+	{
+		return arg_filter == UpscaleFilter::UpscaleScale3x ? 3 : 2;
+	}
+
+	void Upscaler::SetThreads(int arg_threads)
+	{
+		mWorkers.SetThreads(std::max(arg_threads, 1));
+	}
+
+	void Upscaler::Scale(UpscaleFilter arg_filter, const uint8_t* arg_source, int arg_sourceStride, int arg_width, int arg_height,
+		uint8_t* out_dest, int arg_destStride)
+	{
+		const bool keys = arg_filter == UpscaleFilter::UpscaleHQ2x || arg_filter == UpscaleFilter::UpscaleXBR2x;
+		PadSource(arg_source, arg_sourceStride, arg_width, arg_height, keys);
+
+		// Bands of at least 16 rows
+		mWorkers.Run(std::max(arg_height / 16, 1), [&](int arg_band, int arg_bands)
+		{
+			ScaleRows(arg_filter, arg_width, arg_height * arg_band / arg_bands, arg_height * (arg_band + 1) / arg_bands,
+				out_dest, arg_destStride);
+		});
+	}
+
+	void Upscaler::PadSource(const uint8_t* arg_source, int arg_sourceStride, int arg_width, int arg_height, bool arg_keys)
+	{
+		mPaddedStride = arg_width + 2;
+		mPadded.resize(mPaddedStride * (arg_height + 2));
+		for (int y = 0; y < arg_height; y++)
+		{
+			uint32_t* row = &mPadded[(y + 1) * mPaddedStride];
+			memcpy(row + 1, arg_source + y * arg_sourceStride, arg_width * 4);
+			row[0] = row[1];
+			row[arg_width + 1] = row[arg_width];
+		}
+		memcpy(&mPadded[0], &mPadded[mPaddedStride], mPaddedStride * 4);
+		memcpy(&mPadded[(arg_height + 1) * mPaddedStride], &mPadded[arg_height * mPaddedStride], mPaddedStride * 4);
+
+		if (!arg_keys)
+			return;
+
+		// Frames have few distinct colors, mostly in runs
+		mKeys.resize(mPadded.size());
+		uint32_t lastPixel = mPadded[0];
+		uint32_t lastKey = GetKey(lastPixel);
+		for (size_t i = 0; i < mPadded.size(); i++)
+		{
+			if (mPadded[i] != lastPixel)
+			{
+				lastPixel = mPadded[i];
+				lastKey = GetKey(lastPixel);
+			}
+			mKeys[i] = lastKey;
+		}
+	}
+
+	void Upscaler::ScaleRows(UpscaleFilter arg_filter, int arg_width, int arg_firstRow, int arg_lastRow, uint8_t* out_dest, int arg_destStride) const
+	{
+		for (int y = arg_firstRow; y < arg_lastRow; y++)
+		{
+			switch (arg_filter)
+			{
+			case UpscaleFilter::UpscaleScale2x:
+				Scale2xRow(y, arg_width, out_dest, arg_destStride);
+				break;
+			case UpscaleFilter::UpscaleScale3x:
+				Scale3xRow(y, arg_width, out_dest, arg_destStride);
+				break;
+			case UpscaleFilter::UpscaleHQ2x:
+				HQ2xRow(y, arg_width, out_dest, arg_destStride);
+				break;
+			case UpscaleFilter::UpscaleXBR2x:
+				XBR2xRow(y, arg_width, out_dest, arg_destStride);
+				break;
+			}
+		}
+	}
+
+	void Upscaler::Scale2xRow(int arg_row, int arg_width, uint8_t* out_dest, int arg_destStride) const
+	{
+		const int s = mPaddedStride;
+		const uint32_t* pixels = &mPadded[(arg_row + 1) * s + 1];
+		uint8_t* row0 = out_dest + arg_row * 2 * arg_destStride;
+		uint8_t* row1 = row0 + arg_destStride;
+		int x = 0;
+#ifdef NESEMU_SSE2
+		for (; x + 4 <= arg_width; x += 4)
+		{
+			const uint32_t* p = pixels + x;
+			const __m128i b = Load(p - s), d = Load(p - 1), e = Load(p), f = Load(p + 1), h = Load(p + s);
+			const __m128i active = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f)), _mm_set1_epi32(-1));
+			Store2x(Select(_mm_and_si128(active, _mm_cmpeq_epi32(d, b)), d, e),
+				Select(_mm_and_si128(active, _mm_cmpeq_epi32(b, f)), f, e),
+				Select(_mm_and_si128(active, _mm_cmpeq_epi32(d, h)), d, e),
+				Select(_mm_and_si128(active, _mm_cmpeq_epi32(h, f)), f, e), x, row0, row1);
+		}
+#endif
+		for (; x < arg_width; x++)
+		{
+			uint32_t quadrants[4];
+			Scale2xPixel(pixels + x, s, quadrants);
+			Store2x(quadrants, x, row0, row1);
+		}
+	}
+
+	void Upscaler::Scale3xRow(int arg_row, int arg_width, uint8_t* out_dest, int arg_destStride) const
+	{
+		const int s = mPaddedStride;
+		const uint32_t* pixels = &mPadded[(arg_row + 1) * s + 1];
+		uint8_t* rows[3];
+		for (int i = 0; i < 3; i++)
+			rows[i] = out_dest + (arg_row * 3 + i) * arg_destStride;
+		int x = 0;
+#ifdef NESEMU_SSE2
+		for (; x + 4 <= arg_width; x += 4)
+		{
+			const uint32_t* p = pixels + x;
+			const __m128i a = Load(p - s - 1), b = Load(p - s), c = Load(p - s + 1);
+			const __m128i d = Load(p - 1), e = Load(p), f = Load(p + 1);
+			const __m128i g = Load(p + s - 1), h = Load(p + s), i = Load(p + s + 1);
+			const __m128i active = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f)), _mm_set1_epi32(-1));
+			const __m128i db = _mm_and_si128(active, _mm_cmpeq_epi32(d, b));
+			const __m128i bf = _mm_and_si128(active, _mm_cmpeq_epi32(b, f));
+			const __m128i dh = _mm_and_si128(active, _mm_cmpeq_epi32(d, h));
+			const __m128i hf = _mm_and_si128(active, _mm_cmpeq_epi32(h, f));
+			const __m128i ea = _mm_cmpeq_epi32(e, a), ec = _mm_cmpeq_epi32(e, c), eg = _mm_cmpeq_epi32(e, g), ei = _mm_cmpeq_epi32(e, i);
+
+			Store3x(Select(db, d, e),
+				Select(_mm_or_si128(_mm_andnot_si128(ec, db), _mm_andnot_si128(ea, bf)), b, e),
+				Select(bf, f, e), x, rows[0]);
+			Store3x(Select(_mm_or_si128(_mm_andnot_si128(eg, db), _mm_andnot_si128(ea, dh)), d, e),
+				e,
+				Select(_mm_or_si128(_mm_andnot_si128(ei, bf), _mm_andnot_si128(ec, hf)), f, e), x, rows[1]);
+			Store3x(Select(dh, d, e),
+				Select(_mm_or_si128(_mm_andnot_si128(ei, dh), _mm_andnot_si128(eg, hf)), h, e),
+				Select(hf, f, e), x, rows[2]);
+		}
+#endif
+		for (; x < arg_width; x++)
+		{
+			uint32_t quadrants[9];
+			Scale3xPixel(pixels + x, s, quadrants);
+			for (int row = 0; row < 3; row++)
+				memcpy(rows[row] + x * 12, quadrants + row * 3, 12);
+		}
+	}
+
+	void Upscaler::HQ2xRow(int arg_row, int arg_width, uint8_t* out_dest, int arg_destStride) const
+	{
+		const int s = mPaddedStride;
+		const uint32_t* pixels = &mPadded[(arg_row + 1) * s + 1];
+		const uint32_t* keys = &mKeys[(arg_row + 1) * s + 1];
+		uint8_t* row0 = out_dest + arg_row * 2 * arg_destStride;
+		uint8_t* row1 = row0 + arg_destStride;
+		int x = 0;
+#ifdef NESEMU_SSE2
+		for (; x + 4 <= arg_width; x += 4)
+		{
+			const uint32_t* p = pixels + x;
+			const uint32_t* k = keys + x;
+			const __m128i e = Load(p), ke = Load(k);
+			const __m128i b = Load(p - s), d = Load(p - 1), f = Load(p + 1), h = Load(p + s);
+			const __m128i kb = Load(k - s), kd = Load(k - 1), kf = Load(k + 1), kh = Load(k + s);
+			Store2x(HQ2xCorner(e, Load(p - s - 1), d, b, ke, Load(k - s - 1), kd, kb),
+				HQ2xCorner(e, Load(p - s + 1), f, b, ke, Load(k - s + 1), kf, kb),
+				HQ2xCorner(e, Load(p + s - 1), d, h, ke, Load(k + s - 1), kd, kh),
+				HQ2xCorner(e, Load(p + s + 1), f, h, ke, Load(k + s + 1), kf, kh), x, row0, row1);
+		}
+#endif
+		for (; x < arg_width; x++)
+		{
+			uint32_t quadrants[4];
+			HQ2xPixel(pixels + x, keys + x, s, quadrants);
+			Store2x(quadrants, x, row0, row1);
+		}
+	}
+
+	void Upscaler::XBR2xRow(int arg_row, int arg_width, uint8_t* out_dest, int arg_destStride) const
+	{
+		const int s = mPaddedStride;
+		const uint32_t* pixels = &mPadded[(arg_row + 1) * s + 1];
+		const uint32_t* keys = &mKeys[(arg_row + 1) * s + 1];
+		uint8_t* row0 = out_dest + arg_row * 2 * arg_destStride;
+		uint8_t* row1 = row0 + arg_destStride;
+		int x = 0;
+#ifdef NESEMU_SSE2
+		for (; x + 4 <= arg_width; x += 4)
+		{
+			const uint32_t* p = pixels + x;
+			const uint32_t* k = keys + x;
+			const __m128i e = Load(p), b = Load(p - s), d = Load(p - 1), f = Load(p + 1), h = Load(p + s);
+			const __m128i ka = Load(k - s - 1), kb = Load(k - s), kc = Load(k - s + 1);
+			const __m128i kd = Load(k - 1), ke = Load(k), kf = Load(k + 1);
+			const __m128i kg = Load(k + s - 1), kh = Load(k + s), ki = Load(k + s + 1);
+			Store2x(XBRCorner(e, d, b, ke, ka, kd, kb, kg, kc, kf, kh),
+				XBRCorner(e, f, b, ke, kc, kf, kb, ki, ka, kd, kh),
+				XBRCorner(e, d, h, ke, kg, kd, kh, ka, ki, kf, kb),
+				XBRCorner(e, f, h, ke, ki, kf, kh, kc, kg, kd, kb), x, row0, row1);
+		}
+#endif
+		for (; x < arg_width; x++)
+		{
+			uint32_t quadrants[4];
+			XBR2xPixel(pixels + x, keys + x, s, quadrants);
+			Store2x(quadrants, x, row0, row1);
+		}
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef NESEMU_UPSCALER_H
+#define NESEMU_UPSCALER_H
+
+#include <stdint.h>
+#include <vector>
+#include "bandworkers.h"
+
+namespace nesemu
+{
+	enum UpscaleFilter
+	{
+		UpscaleScale2x,	// AdvanceMAME Scale2x
+		UpscaleScale3x,	// AdvanceMAME Scale3x
+		UpscaleHQ2x,	// HQ2x's YUV similarity test, with a compact set of corner rules instead of the 256 case table
+		UpscaleXBR2x	// xBR's weighted edge test, restricted to the 3x3 neighbourhood
+	};
+
+	/**
+	* Pixel art upscalers for 32 bit pixels (e.g. PaletteConverter's RGBA8888 output).
+	* Pixels outside the image repeat the edge pixels.
+	**/
+	class Upscaler
+	{
+	private:
+		BandWorkers mWorkers;
+
+		// Source image with a one pixel border, and the YUV keys of its pixels (HQ2x and xBR)
+		std::vector<uint32_t> mPadded;
+		std::vector<uint32_t> mKeys;
+		int mPaddedStride = 0;
+
+		void PadSource(const uint8_t* arg_source, int arg_sourceStride, int arg_width, int arg_height, bool arg_keys);
+		void ScaleRows(UpscaleFilter arg_filter, int arg_width, int arg_firstRow, int arg_lastRow, uint8_t* out_dest, int arg_destStride) const;
+		void Scale2xRow(int arg_row, int arg_width, uint8_t* out_dest, int arg_destStride) const;
+		void Scale3xRow(int arg_row, int arg_width, uint8_t* out_dest, int arg_destStride) const;
+		void HQ2xRow(int arg_row, int arg_width, uint8_t* out_dest, int arg_destStride) const;
+		void XBR2xRow(int arg_row, int arg_width, uint8_t* out_dest, int arg_destStride) const;
+
+	public:
+		static int GetScaleFactor(UpscaleFilter arg_filter);
+
+		/**
+		* Splits the output into bands of rows, scaled on this many threads (kept running between frames).
+		* Only worth it for the larger filters and output sizes.
+		**/
+		void SetThreads(int arg_threads);
+
+		/**
+		* Scales arg_width x arg_height pixels into an image GetScaleFactor times larger. Strides are in bytes.
+		**/
+		void Scale(UpscaleFilter arg_filter, const uint8_t* arg_source, int arg_sourceStride, int arg_width, int arg_height,
+			uint8_t* out_dest, int arg_destStride);
+	};
+}
+
+#endif
@@ -0,0 +1,113 @@
+#include "apu.h"
+#include "memory.h"
+#include <stdio.h>
+#include <vector>
+
+using namespace nesemu;
+
+// The APU's output must only depend on the emulated CPU cycles: the same register writes at the same cycles give
+// the same samples whether the APU is caught up every cycle or once a frame, at any output rate, with or without
+// an audio device.
+
+#define SECONDS		5
+
+static uint32_t GRandom = 1;
+static uint32_t Random(uint32_t arg_range)
+{
+	GRandom = GRandom * 1664525 + 1013904223;
+	return (GRandom >> 8) % arg_range;
+}
+
+struct AudioRun
+{
+	uint64_t mHash;
+	uint64_t mSampleCount;
+	uint64_t mOutputCount;
+};
+
+static AudioRun Run(int arg_step, int arg_outputRate, bool arg_device)
+{
+	APU apu;
+	apu.SetAudioDevice(arg_device);
+	apu.SetOutputRate(arg_outputRate);
+
+	// Random writes to every channel register, the same for every run
+	GRandom = 1;
+	const uint64_t end = (uint64_t)APU_CPU_CLOCK * SECONDS;
+	uint64_t cycle = 0;
+	uint64_t nextWrite = 0;
+	uint64_t outputCount = 0;
+	std::vector<int16_t> samples(4096);
+	while (cycle < end)
+	{
+		const uint64_t target = std::min(cycle + arg_step, end);
+		for (; nextWrite <= target; nextWrite += 1000 + Random(30000))
+		{
+			uint16_t address = (uint16_t)(0x4000 + Random(0x14));
+			if (address == 0x4009 || address == 0x400D)
+				address = 0x4015;
+			apu.CatchUp(nextWrite);
+			apu.WriteRegister(address, (uint8_t)Random(256));
+		}
+		cycle = target;
+		apu.CatchUp(cycle);
+
+		// Headless: drain the ring like a capture would. The device drops what it doesn't play.
+		if (!arg_device)
+		{
+			size_t count;
+			while ((count = apu.ReadSamples(samples.data(), samples.size())) > 0)
+				outputCount += count;
+		}
+	}
+	return { apu.GetAudioHash(), apu.GetAudioSampleCount(), outputCount };
+}
+
+int main()
+{
+	GMemory = new Memory();
+
+	// Audio frames are mixed whole: every sample of the frames that ended
+	const uint64_t cycles = (uint64_t)APU_CPU_CLOCK * SECONDS;
+	const uint64_t expectedCount = cycles / APU_AUDIO_FRAME * APU_AUDIO_FRAME * APU_MIX_RATE / APU_CPU_CLOCK;
+
+	const AudioRun reference = Run(1, 44100, false);
+	printf("Reference: %llu samples, hash %016llx\n", (unsigned long long)reference.mSampleCount, (unsigned long long)reference.mHash);
+	bool passed = reference.mSampleCount == expectedCount;
+	if (!passed)
+		printf("Expected %llu samples\n", (unsigned long long)expectedCount);
+
+	struct Variant { int mStep; int mOutputRate; bool mDevice; };
+	const Variant variants[] = {
+		{ 1, 44100, false }, // a second run
+		{ 7, 44100, false },
+		{ 113, 44100, false },
+		{ APU_AUDIO_FRAME, 44100, false },
+		{ 113, 48000, false },
+		{ 113, 32000, false },
+		{ 113, 44100, true },
+	};
+	for (const Variant& variant : variants)
+	{
+		const AudioRun run = Run(variant.mStep, variant.mOutputRate, variant.mDevice);
+		const bool same = run.mHash == reference.mHash && run.mSampleCount == reference.mSampleCount;
+		printf("Step %5d, %5d Hz, %s: %llu samples, hash %016llx%s\n", variant.mStep, variant.mOutputRate,
+			variant.mDevice ? "device  " : "headless", (unsigned long long)run.mSampleCount, (unsigned long long)run.mHash,
+			same ? "" : " MISMATCH");
+		passed &= same;
+
+		// Headless, the resampled output has no drift: about the mixed count at the output rate, less the filter delay
+		if (!variant.mDevice)
+		{
+			const double expectedOutput = (double)run.mSampleCount * variant.mOutputRate / APU_MIX_RATE;
+			if (run.mOutputCount > expectedOutput + 1 || run.mOutputCount + 64 < expectedOutput)
+			{
+				printf("Output %llu samples, expected about %.0f\n", (unsigned long long)run.mOutputCount, expectedOutput);
+				passed = false;
+			}
+		}
+	}
+
+	printf(passed ? "Passed\n" : "FAILED\n");
+	return passed ? 0 : 1;
+}
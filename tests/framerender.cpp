@@ -0,0 +1,274 @@
+#include "ppu.h"
+#include "rom.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace nesemu;
+
+// Frame-at-once rendering must draw exactly what per-scanline rendering draws. Two PPUs get the same register
+// accesses at the same CPU cycles, through frames with and without mid-frame writes, and every frame and every
+// register read is compared.
+
+#define FRAMES			300
+#define SCANLINE_CYCLES	(341.0 / 3.0)
+
+static uint32_t GRandom = 12345;
+static uint32_t Random(uint32_t arg_range)
+{
+	GRandom = GRandom * 1664525 + 1013904223;
+	return (GRandom >> 8) % arg_range;
+}
+
+struct FrameTest
+{
+	PPU mFrameAtOnce;
+	PPU mPerScanline;
+	std::vector<uint8_t> mFrameAtOnceBuffer;
+	std::vector<uint8_t> mPerScanlineBuffer;
+	uint64_t mCycle = 0;
+	uint64_t mFrames = 0;
+	int mMismatches = 0;
+
+	FrameTest(ROM* arg_rom)
+		: mFrameAtOnceBuffer(PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT), mPerScanlineBuffer(PPU_SCREEN_WIDTH * PPU_SCREEN_HEIGHT)
+	{
+		mPerScanline.SetFrameAtOnceRendering(false);
+		mFrameAtOnce.SetFrameBuffer(mFrameAtOnceBuffer.data());
+		mPerScanline.SetFrameBuffer(mPerScanlineBuffer.data());
+		mFrameAtOnce.SetROM(arg_rom);
+		mPerScanline.SetROM(arg_rom);
+	}
+
+	void CatchUp(uint64_t arg_cycle)
+	{
+		mCycle = arg_cycle;
+		mFrameAtOnce.CatchUp(arg_cycle);
+		mPerScanline.CatchUp(arg_cycle);
+	}
+
+	void Write(uint64_t arg_cycle, uint16_t arg_address, uint8_t arg_value)
+	{
+		CatchUp(arg_cycle);
+		mFrameAtOnce.WriteRegister(arg_address, arg_value);
+		mPerScanline.WriteRegister(arg_address, arg_value);
+	}
+
+	uint8_t Read(uint64_t arg_cycle, uint16_t arg_address)
+	{
+		CatchUp(arg_cycle);
+		const uint8_t value = mFrameAtOnce.ReadRegister(arg_address);
+		if (mPerScanline.ReadRegister(arg_address) != value)
+		{
+			printf("Frame %llu: $%04X reads differ\n", (unsigned long long)mFrames, arg_address);
+			mMismatches++;
+		}
+		return value;
+	}
+
+	// Runs to the next vblank, where both frames are complete, and compares them
+	void RunToVBlank()
+	{
+		const uint64_t frames = mFrameAtOnce.GetFrameRenderStats().GetTotalFrames();
+		while (mFrameAtOnce.GetFrameRenderStats().GetTotalFrames() == frames)
+			CatchUp(std::min(mFrameAtOnce.GetNextEventCycle(), mPerScanline.GetNextEventCycle()));
+
+		mFrames++;
+		mFrameAtOnce.WaitForFrame();
+		mPerScanline.WaitForFrame();
+		if (memcmp(mFrameAtOnceBuffer.data(), mPerScanlineBuffer.data(), mFrameAtOnceBuffer.size()) != 0)
+		{
+			printf("Frame %llu differs from per-scanline rendering\n", (unsigned long long)mFrames);
+			mMismatches++;
+		}
+	}
+};
+
+// An NROM cartridge with random CHR-ROM, or with sparse CHR-ROM: background tiles opaque on their last row only,
+// and tile $FF opaque everywhere for the sprite
+static bool WriteROM(const char* arg_file, bool arg_sparse)
+{
+	std::vector<uint8_t> data(ROM_HEADER_SIZE + 0x4000 + ROM_CHR_BANK_SIZE, 0);
+	memcpy(data.data(), "NES\x1A", 4);
+	data[4] = 1; // 16KB PRG
+	data[5] = 1; // 8KB CHR
+	data[6] = 0x01; // vertical mirroring
+	uint8_t* chr = data.data() + ROM_HEADER_SIZE + 0x4000;
+	for (int i = 0; i < ROM_CHR_BANK_SIZE; i++)
+	{
+		const int tile = (i >> 4) & 0xFF;
+		const int row = i & 0x07;
+		if (!arg_sparse)
+			chr[i] = (uint8_t)Random(256);
+		else if (tile == 0xFF || (row == 7 && !(i & 0x08)))
+			chr[i] = 0xFF;
+	}
+
+	FILE* file = fopen(arg_file, "wb");
+	if (file == nullptr)
+		return false;
+	const bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+	fclose(file);
+	return written;
+}
+
+static bool LoadROM(ROM* out_rom, bool arg_sparse)
+{
+	const char* romFile = "framerender_test.nes";
+	const bool loaded = WriteROM(romFile, arg_sparse) && out_rom->Load(romFile);
+	remove(romFile);
+	return loaded;
+}
+
+// Status bar style sprite 0 hit polling: $2002 is read every few cycles through the frame, so the scanlines
+// drawn at once are still due when the hit is predicted. The background is opaque on one row in 8 only.
+static bool TestSprite0Hit()
+{
+	ROM rom;
+	if (!LoadROM(&rom, true))
+	{
+		printf("FAILED: couldn't create the sparse test ROM\n");
+		return false;
+	}
+
+	FrameTest test(&rom);
+	test.RunToVBlank();
+	uint64_t cycle = test.mCycle + 10;
+	test.Write(cycle, 0x2006, 0x20);
+	test.Write(cycle, 0x2006, 0x00);
+	for (int i = 0; i < 0x800; i++)
+		test.Write(cycle, 0x2007, (uint8_t)Random(0xFF));
+	test.Write(cycle, 0x2003, 0x00);
+	for (int i = 0; i < 0x100; i++)
+		test.Write(cycle, 0x2004, i < 4 ? 0 : 0xF0); // only sprite 0 on screen
+
+	int hitFrames = 0;
+	for (int frame = 0; frame < FRAMES / 5; frame++)
+	{
+		const uint64_t vblankCycle = test.mCycle;
+		cycle = vblankCycle + 10 + Random(1000);
+		test.Write(cycle, 0x2003, 0x00);
+		test.Write(cycle, 0x2004, (uint8_t)(20 + Random(180))); // Y
+		test.Write(cycle, 0x2004, 0xFF); // tile
+		test.Write(cycle, 0x2004, 0x00); // attributes
+		test.Write(cycle, 0x2004, (uint8_t)(8 + Random(230))); // X
+		test.Write(cycle, 0x2000, (uint8_t)(0x80 | Random(4)));
+		test.Write(cycle, 0x2005, (uint8_t)Random(256));
+		test.Write(cycle, 0x2005, (uint8_t)Random(240));
+		test.Write(cycle, 0x2001, 0x1E);
+
+		bool hit = false;
+		const uint64_t end = vblankCycle + (uint64_t)(261 * SCANLINE_CYCLES);
+		for (cycle = vblankCycle + (uint64_t)(21 * SCANLINE_CYCLES); cycle < end; cycle += 10)
+		{
+			hit |= (test.Read(cycle, 0x2002) & PPUSTATUS_SPRITE0) != 0;
+		}
+		if (hit)
+			hitFrames++;
+		test.RunToVBlank();
+	}
+
+	// The sprite covers 8 scanlines, one of which has an opaque background row under all of it
+	printf("Sprite 0 hit: %d frames compared, %d mismatches, %d hits (expected %d)\n", FRAMES / 5, test.mMismatches,
+		hitFrames, FRAMES / 5);
+	return test.mMismatches == 0 && hitFrames == FRAMES / 5;
+}
+
+int main()
+{
+	GMemory = new Memory();
+	ROM rom;
+	if (!LoadROM(&rom, false))
+	{
+		printf("FAILED: couldn't create the test ROM\n");
+		return 1;
+	}
+
+	FrameTest test(&rom);
+	test.RunToVBlank();
+
+	// Random nametables, attributes, palette and sprites
+	uint64_t cycle = test.mCycle + 10;
+	test.Write(cycle, 0x2006, 0x20);
+	test.Write(cycle, 0x2006, 0x00);
+	for (int i = 0; i < 0x800; i++)
+		test.Write(cycle, 0x2007, (uint8_t)Random(256));
+	test.Write(cycle, 0x2006, 0x3F);
+	test.Write(cycle, 0x2006, 0x00);
+	for (int i = 0; i < 0x20; i++)
+		test.Write(cycle, 0x2007, (uint8_t)Random(64));
+	test.Write(cycle, 0x2003, 0x00);
+	for (int i = 0; i < 0x100; i++)
+		test.Write(cycle, 0x2004, (uint8_t)Random(256));
+
+	uint64_t expectedFrameAtOnce = 0;
+	const uint64_t startFrameAtOnce = test.mFrameAtOnce.GetFrameRenderStats().mFrameAtOnceFrames;
+	for (int frame = 0; frame < FRAMES; frame++)
+	{
+		// Scroll and enable rendering during vblank, which never splits a frame
+		const uint64_t vblankCycle = test.mCycle;
+		cycle = vblankCycle + 10 + Random(1000);
+		test.Write(cycle, 0x2000, (uint8_t)(0x80 | Random(4) | (Random(2) << 3) | (Random(2) << 4) | (Random(2) << 5)));
+		test.Write(cycle, 0x2005, (uint8_t)Random(256));
+		test.Write(cycle, 0x2005, (uint8_t)Random(240));
+		test.Write(cycle, 0x2001, (uint8_t)(0x18 | (Random(4) << 1)));
+
+		// Scanline 0 starts 21 scanlines after vblank
+		const double frameStart = (double)vblankCycle + 21 * SCANLINE_CYCLES;
+		auto scanlineCycle = [&](int arg_scanline)
+		{
+			return (uint64_t)(frameStart + arg_scanline * SCANLINE_CYCLES) + Random((int)SCANLINE_CYCLES);
+		};
+
+		const int kind = frame % 5;
+		switch (kind)
+		{
+		case 0: // nothing during the visible scanlines
+			break;
+		case 1: // polling $2002 and reading OAM, as games waiting for sprite 0 hit do
+			for (int scanline = 0; scanline < PPU_SCREEN_HEIGHT; scanline += 1 + Random(12))
+			{
+				const uint64_t poll = scanlineCycle(scanline);
+				test.Read(poll, 0x2002);
+				if (Random(4) == 0)
+					test.Read(poll, 0x2004);
+			}
+			break;
+		case 2: // a horizontal scroll split
+		{
+			const uint64_t split = scanlineCycle(20 + Random(180));
+			test.Read(split, 0x2002);
+			test.Write(split, 0x2005, (uint8_t)Random(256));
+			test.Write(split, 0x2005, 0);
+			break;
+		}
+		case 3: // toggling sprites and the nametable
+			test.Write(scanlineCycle(40 + Random(60)), 0x2001, 0x0A);
+			test.Write(scanlineCycle(110 + Random(20)), 0x2000, (uint8_t)(0x80 | Random(4)));
+			test.Write(scanlineCycle(140 + Random(60)), 0x2001, 0x1E);
+			break;
+		case 4: // a $2005/$2006 split, which moves v mid-frame
+		{
+			const uint64_t split = scanlineCycle(30 + Random(170));
+			test.Write(split, 0x2006, (uint8_t)(Random(4) << 2));
+			test.Write(split, 0x2005, (uint8_t)Random(240));
+			test.Write(split, 0x2005, (uint8_t)Random(256));
+			test.Write(split, 0x2006, (uint8_t)Random(256));
+			break;
+		}
+		}
+		if (kind <= 1)
+			expectedFrameAtOnce++;
+
+		test.RunToVBlank();
+	}
+
+	// Frames without writes during the visible scanlines are drawn at once
+	const uint64_t frameAtOnce = test.mFrameAtOnce.GetFrameRenderStats().mFrameAtOnceFrames - startFrameAtOnce;
+	printf("%d frames compared, %d mismatches, %llu drawn at once (expected %llu)\n", FRAMES, test.mMismatches,
+		(unsigned long long)frameAtOnce, (unsigned long long)expectedFrameAtOnce);
+	bool passed = test.mMismatches == 0 && frameAtOnce == expectedFrameAtOnce;
+	passed &= TestSprite0Hit();
+	printf(passed ? "Passed\n" : "FAILED\n");
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,73 @@
+#include "apu.h"
+#include "memory.h"
+#include <math.h>
+#include <stdio.h>
+
+using namespace nesemu;
+
+// Simulates the emulation and an audio device whose clock is off by arg_deviceError, for two minutes.
+// Paced: the emulation runs 4x faster than real time, and waits for the ring (NES::Update).
+// Otherwise: something else paces it at exactly real time (vsync), and the rate control keeps up.
+static bool Run(bool arg_paced, double arg_deviceError)
+{
+	APU apu;
+	apu.SetOutputRate(44100);
+	apu.SetAudioPaced(arg_paced);
+	apu.CatchUp(0);
+	apu.WriteRegister(0x4015, 0x0F);
+	apu.WriteRegister(0x4000, 0xBF);
+	apu.WriteRegister(0x4002, 253);
+	apu.WriteRegister(0x4003, 0);
+
+	const int period = 512;
+	int16_t buffer[period];
+	const int chunk = 1000; // CPU cycles between pacing checks, NES_PACING_CYCLES
+	uint64_t cycle = 0;
+	double emulationTime = 0.0;
+	double callbackTime = 0.0;
+	double maxAdjust = 0.0;
+	uint32_t settledUnderruns = 0;
+	while (emulationTime < 120.0 || callbackTime < 120.0)
+	{
+		if (emulationTime <= callbackTime)
+		{
+			cycle += chunk;
+			apu.CatchUp(cycle);
+			emulationTime += (double)chunk / APU_CPU_CLOCK / (arg_paced ? 4.0 : 1.0);
+			if (arg_paced)
+				emulationTime += apu.GetPacingDelay() * 1e-6;
+		}
+		else
+		{
+			APU::audio_callback(&apu, (Uint8*)buffer, period * 2);
+			callbackTime += period / (apu.GetOutputRate() * (1.0 + arg_deviceError));
+			if (callbackTime < 10.0)
+				settledUnderruns = apu.GetAudioRing().GetUnderruns();
+			else
+				maxAdjust = std::max(maxAdjust, fabs(apu.GetRateAdjust() - 1.0));
+		}
+	}
+
+	const uint32_t underruns = apu.GetAudioRing().GetUnderruns() - settledUnderruns;
+	const uint64_t dropped = apu.GetAudioRing().GetDroppedSamples();
+	printf("%s, device clock %+.2f%%: max ratio adjust %.5f, underruns %u, dropped %llu\n", arg_paced ? "Paced" : "Unpaced",
+		arg_deviceError * 100.0, maxAdjust, underruns, (unsigned long long)dropped);
+
+	// Paced, the emulation follows the device clock, so the ratio has nothing to correct
+	const double limit = arg_paced ? 0.0005 : APU_RATE_ADJUST;
+	return maxAdjust <= limit && underruns == 0 && (arg_paced || dropped == 0);
+}
+
+int main()
+{
+	GMemory = new Memory();
+
+	bool passed = true;
+	for (double deviceError : { -0.003, 0.0, 0.003 })
+	{
+		passed &= Run(true, deviceError);
+		passed &= Run(false, deviceError);
+	}
+	printf(passed ? "Passed\n" : "FAILED\n");
+	return passed ? 0 : 1;
+}
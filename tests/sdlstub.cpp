@@ -0,0 +1,18 @@
+#include "sdl2/SDL.h"
+
+// Stands in for the SDL audio device, so the tests run without SDL: the device opens with the requested spec,
+// and the tests call APU::audio_callback themselves.
+extern "C"
+{
+	int SDL_OpenAudio(SDL_AudioSpec* desired, SDL_AudioSpec* obtained)
+	{
+		*obtained = *desired;
+		return 0;
+	}
+
+	void SDL_PauseAudio(int /*pause_on*/) {}
+	void SDL_LockAudio(void) {}
+	void SDL_UnlockAudio(void) {}
+	void SDL_LogError(int /*category*/, const char* /*fmt*/, ...) {}
+	const char* SDL_GetError(void) { return ""; }
+}